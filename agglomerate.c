@@ -3,23 +3,49 @@
  *
  * Implements Agglomerative Hierarchical Clustering algorithm.
  */
-#include <float.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahc.h"
 
 #define NOT_USED  0 /* node is currently not used */
 #define LEAF_NODE 1 /* node contains a leaf node */
 #define A_MERGER  2 /* node contains a merged pair of root clusters */
-#define MAX_LABEL_LEN 16
-
-#define AVERAGE_LINKAGE  'a' /* choose average distance */
-#define CENTROID_LINKAGE 't' /* choose distance between cluster centroids */
-#define COMPLETE_LINKAGE 'c' /* choose maximum distance */
-#define SINGLE_LINKAGE   's' /* choose minimum distance */
+#define VECTOR_WIDTH AHC_VECTOR_WIDTH /* coordinates are zero padded */
+#define VECTOR_ALIGN AHC_VECTOR_ALIGN /* alignment of coordinate blocks */
+#define MAX_THREADS AHC_MAX_THREADS
+#define ARENA_BLOCK_SIZE (1 << 20) /* bytes in each block of an arena */
+#define ARENA_ALIGN 16 /* alignment of small arena allocations */
+#define BINARY_MAGIC "AHCITEMS" /* first bytes of binary input files */
+#define MATRIX_MAGIC "AHCDISTS" /* first bytes of distance matrix files */
+#define SNAPSHOT_MAGIC "AHCHIERS" /* first bytes of hierarchy snapshots */
+#define BINARY_VERSION 1
+#define SNAPSHOT_VERSION 1
+#define INCONSISTENCY_DEPTH 2 /* levels of merges in the -i statistics */
+#define MAX_CLIENTS 64 /* connections served at once */
+#define MAX_REQUEST 4096 /* bytes in a request line */
+#define CUT_CACHE_SIZE 8 /* recent cuts kept for each served hierarchy */
 
 #define alloc_mem(N, T) (T *) calloc(N, sizeof(T))
+#define arena_mem(A, N, T) (T *) arena_alloc(A, N, sizeof(T))
 #define alloc_fail(M) fprintf(stderr,                                   \
                               "Failed to allocate memory for %s.\n", M)
 #define read_fail(M) fprintf(stderr, "Failed to read %s from file.\n", M)
@@ -28,286 +54,448 @@
 
 typedef struct cluster_s cluster_t;
 typedef struct cluster_node_s cluster_node_t;
-typedef struct neighbour_s neighbour_t;
-typedef struct item_s item_t;
+typedef struct dataset_s dataset_t;
+typedef struct binary_header_s binary_header_t;
+typedef struct matrix_header_s matrix_header_t;
+typedef struct snapshot_header_s snapshot_header_t;
+typedef struct distance_matrix_s distance_matrix_t;
+typedef struct arena_s arena_t;
+typedef struct arena_block_s arena_block_t;
+typedef struct options_s options_t;
+typedef struct item_stream_s item_stream_t;
+typedef struct update_s update_t;
+typedef struct cut_cache_s cut_cache_t;
+typedef struct served_s served_t;
+typedef struct client_s client_t;
+typedef struct batch_s batch_t;
+typedef struct batch_worker_s batch_worker_t;
 
-float (*distance_fptr)(float **, const int *, const int *, int, int);
+/*
+ * Allocations are carved out of large blocks, and are only released
+ * together, when the whole arena is freed.
+ */
+struct arena_s {
+        arena_block_t *blocks; /* newest block first */
+        size_t used; /* bytes handed out */
+        size_t reserved; /* bytes in all blocks */
+        int num_blocks; /* number of blocks */
+};
 
-typedef struct coord_s {
-        float x, y;
-} coord_t;
+struct arena_block_s {
+        arena_block_t *next; /* block allocated before this one */
+        char *data; /* first free byte, aligned to VECTOR_ALIGN */
+        size_t free; /* bytes left in the block */
+};
 
 struct cluster_s {
         int num_items; /* number of items that was clustered */
         int num_clusters; /* current number of root clusters */
         int num_nodes; /* number of leaf and merged clusters */
+        int num_dims; /* number of coordinates of each centroid */
+        int stride; /* floats between consecutive centroids */
         cluster_node_t *nodes; /* leaf and merged clusters */
-        float **distances; /* distance between leaves */
+        float *centroids; /* aligned block of centroids, one per node */
+        int *next_item; /* leaf after each leaf in the member lists */
+        ahc_merge_t *merges; /* merges made by the clustering */
+        arena_t arena; /* memory of the nodes */
+        size_t work_reserved; /* bytes that clustering the items took */
+        ahc_stats_t stats; /* what clustering the items did */
+        ahc_timing_t hierarchy_time; /* building the nodes */
+        char linkage; /* linkage the items were clustered with */
+        void *mapped; /* snapshot that holds the arrays, if any */
+        size_t mapped_size; /* number of bytes mapped */
+};
+
+/* what to print once the items are clustered */
+struct options_s {
+        const char *format; /* tree, csv, binary or labels */
+        char cut; /* by count 'k', distance 'd' or 'i'nconsistency */
+        float threshold; /* distance or inconsistency of a 'd' or 'i' cut */
+        int report_memory; /* report memory use on stderr */
+        const char *stats_file; /* statistics in JSON, "-" for stderr */
+        size_t budget; /* bytes of a two-phase clustering, or 0 */
+        const char *hierarchy_file; /* binary linkage to insert into */
+        const char *snapshot_file; /* where to save the hierarchy, or NULL */
+        float tolerance; /* of subtrees clustered again on insertion */
+        const char *matrix_format; /* entries of the distance matrix */
+        int compare_precision; /* report agreement with a float matrix */
+        int num_neighbours; /* of the graph merges are made along, or 0 */
+};
+
+/* hierarchy of the first items, which the others are inserted into */
+struct update_s {
+        ahc_merge_t *merges; /* merges of the first items */
+        size_t num_items; /* number of first items */
+        float tolerance; /* passed to ahc_insert() */
+        ahc_update_t report; /* how inserting changed the hierarchy */
+};
+
+/* response to a cut, kept to answer it again */
+struct cut_cache_s {
+        char cut; /* 'k', 'd' or 'i', or 0 if the entry is unused */
+        double value; /* number of clusters or threshold */
+        char *response; /* labels of the items, as sent */
+        size_t length; /* bytes in the response */
+        unsigned long used; /* clock of the hierarchy at the last use */
+};
+
+/* hierarchy loaded by the server, with what answers its queries */
+struct served_s {
+        cluster_t *cluster; /* mapped snapshot */
+        int *parent; /* node above each node, or -1 at the root */
+        int *jump; /* ancestor to skip to, see top_ancestor() */
+        float *key; /* highest merge distance at or below each node */
+        int *table; /* items, plus one, by hash of their labels */
+        size_t table_mask; /* size of the table, less one */
+        cut_cache_t cuts[CUT_CACHE_SIZE]; /* most recent cuts */
+        unsigned long clock; /* counts cuts asked for */
+};
+
+/* connection to the server */
+struct client_s {
+        int fd; /* socket, or -1 if unused */
+        int closing; /* close once the responses are sent */
+        char in[MAX_REQUEST]; /* start of a request line not yet whole */
+        size_t in_len; /* bytes in it */
+        char *out; /* responses not yet sent */
+        size_t out_len, out_sent, out_size; /* bytes in, sent, allocated */
+};
+
+/* inputs clustered one per job by a pool of threads */
+struct batch_s {
+        char **inputs; /* names of the input files */
+        size_t num_inputs; /* number of jobs */
+        int k; /* number of flat clusters to cut */
+        const options_t *options; /* cut and output format */
+        batch_worker_t *workers; /* one for each thread */
+        int num_workers; /* number of threads */
+        size_t done; /* jobs that succeeded */
+};
+
+/*
+ * Each thread takes jobs from the start of its own range of the inputs,
+ * and once that is empty steals them from the end of the others.
+ */
+struct batch_worker_s {
+        uint64_t jobs; /* first job in the high half, end in the low */
+        ahc_context_t *ctx; /* copy of the settings, with one thread */
+        arena_t work; /* memory of a job, reused by the next */
+        ahc_allocator_t allocator; /* working memory from the arena */
+        FILE *out; /* lines of a job, written to the buffer */
+        char *buffer; /* reused by the next job */
+        size_t size; /* bytes in the buffer */
+        char pad[64]; /* keeps the ranges on separate cache lines */
+};
+
+/* reads the items of an input file one at a time, without keeping them */
+struct item_stream_s {
+        FILE *file; /* text input, or NULL */
+        dataset_t *items; /* mapped binary input, or NULL */
+        size_t num_items; /* number of items in the file */
+        size_t next; /* number of items read so far */
+        int num_dims; /* number of coordinates of each item */
+        char *line; /* last line read from a text file */
+        size_t line_size; /* bytes allocated for the line */
+        int pending; /* the line holds an item not yet returned */
+        float *coords; /* coordinates of the current item, which are
+                          mapped in place for binary files */
+        const char *label; /* label of the current item */
+};
+
+struct distance_matrix_s {
+        int n; /* number of rows in the square matrix being represented */
+        int square; /* true if data holds all n * n entries, row by row */
+        float *data; /* condensed upper triangle, n(n - 1) / 2 entries */
+        void *mapping; /* mmap()ed file holding data */
+        size_t size; /* number of bytes mapped */
 };
 
 struct cluster_node_s {
         int type; /* type of the cluster node */
         int is_root; /* true if cluster hasn't merged with another */
         int height; /* height of node from the bottom */
-        coord_t centroid; /* centroid of this cluster */
+        float distance; /* distance between the merged clusters */
+        float *centroid; /* centroid of this cluster */
         char *label; /* label of a leaf node */
         int *merged; /* indexes of root clusters merged */
         int num_items; /* number of leaf nodes inside new cluster */
-        int *items; /* array of leaf nodes indices inside merged clusters */
-        neighbour_t *neighbours; /* sorted linked list of distances to roots */
+        int first_item, last_item; /* ends of the list of leaf nodes */
 };
 
-struct neighbour_s {
-        int target; /* the index of cluster node representing neighbour */
-        float distance; /* distance between the nodes */
-        neighbour_t *next, *prev; /* linked list entries */
+struct dataset_s {
+        size_t num_items; /* number of input data points */
+        int num_dims; /* number of coordinates of each data point */
+        int stride; /* floats between consecutive data points */
+        float *coords; /* aligned row-major block of coordinates */
+        uint64_t *label_offsets; /* offset of each label in the table */
+        char *labels; /* string table of null terminated labels */
+        void *mapped; /* file mapping that holds the arrays, if any */
+        size_t mapped_size; /* number of bytes mapped */
 };
 
-struct item_s {
-        coord_t coord; /* coordinate of the input data point */
-        char label[MAX_LABEL_LEN]; /* label of the input data point */
+/*
+ * Binary input files start with this header, in native byte order,
+ * followed by the coordinate block, the label offsets and the string
+ * table at the given file offsets. The coordinate block is laid out
+ * exactly as in memory, so the file can be mapped and used in place.
+ */
+struct binary_header_s {
+        char magic[8]; /* BINARY_MAGIC, without terminating null */
+        uint32_t version; /* BINARY_VERSION */
+        uint32_t num_dims; /* number of coordinates of each item */
+        uint64_t num_items; /* number of items */
+        uint64_t stride; /* floats between consecutive items */
+        uint64_t coords_offset; /* multiple of VECTOR_ALIGN */
+        uint64_t offsets_offset; /* num_items label offsets */
+        uint64_t labels_offset; /* string table of labels */
+        uint64_t labels_size; /* bytes in the string table */
 };
 
-float euclidean_distance(const coord_t *a, const coord_t *b)
-{
-        return sqrt(pow(a->x - b->x, 2) + pow(a->y - b->y, 2));
-}
+/*
+ * Distance matrix files start with this header, in native byte order.
+ * The matrix is stored either condensed, or square with all n * n
+ * entries; only the upper triangle of a square matrix is used. Labels
+ * are stored as in binary input files; without them, items are labelled
+ * with their index.
+ */
+struct matrix_header_s {
+        char magic[8]; /* MATRIX_MAGIC, without terminating null */
+        uint32_t version; /* BINARY_VERSION */
+        uint32_t square; /* true if the matrix is square */
+        uint64_t n; /* number of items */
+        uint64_t data_offset; /* multiple of sizeof(float) */
+        uint64_t offsets_offset; /* n label offsets, or 0 without labels */
+        uint64_t labels_offset; /* string table of labels */
+        uint64_t labels_size; /* bytes in the string table */
+};
 
-void fill_euclidean_distances(float **matrix, int num_items,
-                              const item_t items[])
-{
-        for (int i = 0; i < num_items; ++i)
-                for (int j = 0; j < num_items; ++j) {
-                        matrix[i][j] =
-                                euclidean_distance(&(items[i].coord),
-                                                   &(items[j].coord));
-                        matrix[j][i] = matrix[i][j];
-                }
-}
+/*
+ * Hierarchy snapshots start with this header, in native byte order,
+ * followed by the arrays of a finished hierarchy at the given file
+ * offsets, each a multiple of VECTOR_ALIGN. Its 2n - 1 nodes are
+ * numbered as the clusters of ahc_merge_t, items first. The members of
+ * a node are the items on the list that starts at its first item and
+ * follows the next items, as many as the node holds.
+ */
+struct snapshot_header_s {
+        char magic[8]; /* SNAPSHOT_MAGIC, without terminating null */
+        uint32_t version; /* SNAPSHOT_VERSION */
+        uint32_t num_dims; /* number of coordinates of each centroid */
+        uint64_t num_items; /* number of items, at least one */
+        uint64_t stride; /* floats between consecutive centroids */
+        uint32_t linkage; /* linkage the items were clustered with */
+        uint32_t unused; /* zero */
+        uint64_t merges_offset; /* n - 1 merges, as ahc_merge_t */
+        uint64_t heights_offset; /* int32_t height of each node */
+        uint64_t first_offset; /* int32_t first item of each node */
+        uint64_t next_offset; /* int32_t item after each item */
+        uint64_t centroids_offset; /* centroid of each node */
+        uint64_t offsets_offset; /* n label offsets */
+        uint64_t labels_offset; /* string table of labels */
+        uint64_t labels_size; /* bytes in the string table */
+};
 
-float **generate_distance_matrix(int num_items, const item_t items[])
-{
-        float **matrix = alloc_mem(num_items, float *);
-        if (matrix) {
-                for (int i = 0; i < num_items; ++i) {
-                        matrix[i] = alloc_mem(num_items, float);
-                        if (!matrix[i]) {
-                                alloc_fail("distance matrix row");
-                                num_items = i;
-                                for (i = 0; i < num_items; ++i)
-                                        free(matrix[i]);
-                                free(matrix);
-                                matrix = NULL;
-                                break;
-                        }
-                }
-                if (matrix)
-                        fill_euclidean_distances(matrix, num_items, items);
-        } else
-                alloc_fail("distance matrix");
-        return matrix;
-}
+#define item_coord(items, i) (&(items)->coords[(size_t) (i) * (items)->stride])
+#define item_label(items, i) (&(items)->labels[(items)->label_offsets[i]])
 
-float single_linkage(float **distances, const int a[],
-                     const int b[], int m, int n)
+double seconds(clockid_t clock)
 {
-        float min = FLT_MAX, d;
-        for (int i = 0; i < m; ++i)
-                for (int j = 0; j < n; ++j) {
-                        d = distances[a[i]][b[j]];
-                        if (d < min)
-                                min = d;
-                }
-        return min;
+        struct timespec t;
+        clock_gettime(clock, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
 }
 
-float complete_linkage(float **distances, const int a[],
-                       const int b[], int m, int n)
+/* the time between start_timing() and stop_timing() adds to the timing */
+void start_timing(ahc_timing_t *timing)
 {
-        float d, max = 0.0 /* assuming distances are positive */;
-        for (int i = 0; i < m; ++i)
-                for (int j = 0; j < n; ++j) {
-                        d = distances[a[i]][b[j]];
-                        if (d > max)
-                                max = d;
-                }
-        return max;
+        timing->wall -= seconds(CLOCK_MONOTONIC);
+        timing->cpu -= seconds(CLOCK_PROCESS_CPUTIME_ID);
 }
 
-float average_linkage(float **distances, const int a[],
-                      const int b[], int m, int n)
+void stop_timing(ahc_timing_t *timing)
 {
-        float total = 0.0;
-        for (int i = 0; i < m; ++i)
-                for (int j = 0; j < n; ++j)
-                        total += distances[a[i]][b[j]];
-        return total / (m * n);
+        timing->wall += seconds(CLOCK_MONOTONIC);
+        timing->cpu += seconds(CLOCK_PROCESS_CPUTIME_ID);
 }
 
-float centroid_linkage(float **distances, const int a[],
-                       const int b[], int m, int n)
+float *alloc_coords(size_t count, int stride)
 {
-        return 0; /* empty function */
+        void *mem;
+        size_t size = (count ? count : 1) * (stride ? stride : 1) *
+                sizeof(float);
+        if (posix_memalign(&mem, VECTOR_ALIGN, size))
+                return NULL;
+        memset(mem, 0, size); /* padding must stay zero for the kernels */
+        return mem;
 }
 
-float get_distance(cluster_t *cluster, int index, int target)
+/* labels_size is the number of bytes in the string table of labels */
+dataset_t *alloc_dataset(size_t num_items, int num_dims, size_t labels_size)
 {
-        /* if both are leaves, just use the distances matrix */
-        if (index < cluster->num_items && target < cluster->num_items)
-                return cluster->distances[index][target];
-        else {
-                cluster_node_t *a = &(cluster->nodes[index]);
-                cluster_node_t *b = &(cluster->nodes[target]);
-                if (distance_fptr == centroid_linkage)
-                        return euclidean_distance(&(a->centroid),
-                                                  &(b->centroid));
-                else return distance_fptr(cluster->distances,
-                                          a->items, b->items,
-                                          a->num_items, b->num_items);
+        dataset_t *items = alloc_mem(1, dataset_t);
+        if (items) {
+                items->num_items = num_items;
+                items->num_dims = num_dims;
+                items->stride = (num_dims + VECTOR_WIDTH - 1) /
+                        VECTOR_WIDTH * VECTOR_WIDTH;
+                items->coords = alloc_coords(num_items, items->stride);
+                items->label_offsets = alloc_mem(num_items ? num_items : 1,
+                                                 uint64_t);
+                items->labels = alloc_mem(labels_size ? labels_size : 1,
+                                          char);
+                if (items->coords && items->label_offsets && items->labels)
+                        return items;
+                free(items->coords);
+                free(items->label_offsets);
+                free(items->labels);
+                free(items);
         }
+        alloc_fail("items array");
+        return NULL;
 }
 
-void free_neighbours(neighbour_t *node)
+void free_dataset(dataset_t *items)
 {
-        neighbour_t *t;
-        while (node) {
-                t = node->next;
-                free(node);
-                node = t;
+        if (items) {
+                if (items->mapped)
+                        munmap(items->mapped, items->mapped_size);
+                else {
+                        free(items->coords);
+                        free(items->label_offsets);
+                        free(items->labels);
+                }
+                free(items);
         }
 }
 
-void free_cluster_nodes(cluster_t *cluster)
+void free_distance_matrix(distance_matrix_t *matrix)
 {
-        for (int i = 0; i < cluster->num_nodes; ++i) {
-                cluster_node_t *node = &(cluster->nodes[i]);
-                if (node->label)
-                        free(node->label);
-                if (node->merged)
-                        free(node->merged);
-                if (node->items)
-                        free(node->items);
-                if (node->neighbours)
-                        free_neighbours(node->neighbours);
-        }
-        free(cluster->nodes);
+        munmap(matrix->mapping, matrix->size);
+        free(matrix);
 }
 
-void free_cluster(cluster_t * cluster)
+/*
+ * Zeroed memory for count elements of the given size. Allocations that
+ * would take more than a quarter of a block get a block of their own,
+ * which is put behind the block being filled.
+ */
+void *arena_alloc(arena_t *arena, size_t count, size_t size)
 {
-        if (cluster) {
-                if (cluster->nodes)
-                        free_cluster_nodes(cluster);
-                if (cluster->distances) {
-                        for (int i = 0; i < cluster->num_items; ++i)
-                                free(cluster->distances[i]);
-                        free(cluster->distances);
+        arena_block_t *block = arena->blocks;
+        if (size && count > (SIZE_MAX - 2 * VECTOR_ALIGN -
+                             sizeof(arena_block_t)) / size)
+                return NULL;
+        size_t bytes = count * size;
+        size_t align = bytes >= VECTOR_ALIGN ? VECTOR_ALIGN : ARENA_ALIGN;
+        bytes = (bytes + align - 1) & ~(align - 1);
+        if (!block || block->free < bytes) {
+                int own_block = bytes > ARENA_BLOCK_SIZE / 4;
+                size_t data_size = own_block ? bytes : ARENA_BLOCK_SIZE;
+                block = calloc(1, sizeof(arena_block_t) + VECTOR_ALIGN +
+                               data_size);
+                if (!block)
+                        return NULL;
+                block->data = (char *) (((uintptr_t) (block + 1) +
+                                         VECTOR_ALIGN - 1) &
+                                        ~(uintptr_t) (VECTOR_ALIGN - 1));
+                block->free = data_size;
+                if (own_block && arena->blocks) {
+                        block->next = arena->blocks->next;
+                        arena->blocks->next = block;
+                } else {
+                        block->next = arena->blocks;
+                        arena->blocks = block;
                 }
-                free(cluster);
+                arena->reserved += data_size;
+                arena->num_blocks++;
         }
+        void *mem = block->data;
+        block->data += bytes;
+        block->free -= bytes;
+        arena->used += bytes;
+        return mem;
 }
 
-void insert_before(neighbour_t *current, neighbour_t *neighbours,
-                   cluster_node_t *node)
+void free_arena(arena_t *arena)
 {
-        neighbours->next = current;
-        if (current->prev) {
-                current->prev->next = neighbours;
-                neighbours->prev = current->prev;
-        } else
-                node->neighbours = neighbours;
-        current->prev = neighbours;
+        while (arena->blocks) {
+                arena_block_t *block = arena->blocks;
+                arena->blocks = block->next;
+                free(block);
+        }
+        arena->used = arena->reserved = 0;
+        arena->num_blocks = 0;
 }
 
-void insert_after(neighbour_t *current, neighbour_t *neighbours)
+/*
+ * Empties the arena for reuse. Its blocks are replaced by one as large as
+ * all of them, which later allocations of no more memory in all are
+ * carved out of without calling calloc().
+ */
+int reset_arena(arena_t *arena)
 {
-        neighbours->prev = current;
-        current->next = neighbours;
+        arena_block_t *block = arena->blocks;
+        size_t size = arena->reserved;
+        if (block && block->next) {
+                free_arena(arena);
+                if (!arena_alloc(arena, size, 1))
+                        return 0;
+                block = arena->blocks;
+                size = arena->reserved;
+        }
+        if (block) {
+                char *data = block->data - (size - block->free);
+                memset(data, 0, size - block->free);
+                block->data = data;
+                block->free = size;
+        }
+        arena->used = 0;
+        return 1;
 }
 
-void insert_sorted(cluster_node_t *node, neighbour_t *neighbours)
+/* the library's working memory, released when the clustering is done */
+void *arena_calloc(size_t count, size_t size, void *arena)
 {
-        neighbour_t *temp = node->neighbours;
-        while (temp->next) {
-                if (temp->distance >= neighbours->distance) {
-                        insert_before(temp, neighbours, node);
-                        return;
-                }
-                temp = temp->next;
-        }
-        if (neighbours->distance < temp->distance)
-                insert_before(temp, neighbours, node);
-        else
-                insert_after(temp, neighbours);
+        return arena_alloc(arena, count, size);
 }
 
-
-neighbour_t *add_neighbour(cluster_t *cluster, int index, int target)
+void arena_release(void *ptr, void *arena)
 {
-        neighbour_t *neighbour = alloc_mem(1, neighbour_t);
-        if (neighbour) {
-                neighbour->target = target;
-                neighbour->distance = get_distance(cluster, index, target);
-                cluster_node_t *node = &(cluster->nodes[index]);
-                if (node->neighbours)
-                        insert_sorted(node, neighbour);
-                else
-                        node->neighbours = neighbour;
-        } else
-                alloc_fail("neighbour node");
-        return neighbour;
 }
 
-cluster_t *update_neighbours(cluster_t *cluster, int index)
+void free_cluster(cluster_t * cluster)
 {
-        cluster_node_t *node = &(cluster->nodes[index]);
-        if (node->type == NOT_USED) {
-                invalid_node(index);
-                cluster = NULL;
-        } else {
-                int root_clusters_seen = 1, target = index;
-                while (root_clusters_seen < cluster->num_clusters) {
-                        cluster_node_t *temp = &(cluster->nodes[--target]);
-                        if (temp->type == NOT_USED) {
-                                invalid_node(index);
-                                cluster = NULL;
-                                break;
-                        }
-                        if (temp->is_root) {
-                                ++root_clusters_seen;
-                                add_neighbour(cluster, index, target);
-                        }
-                }
+        if (cluster) {
+                if (cluster->mapped)
+                        munmap(cluster->mapped, cluster->mapped_size);
+                free_arena(&(cluster->arena));
+                free(cluster);
         }
-        return cluster;
 }
 
-#define init_leaf(cluster, node, item, len)             \
-        do {                                            \
-                strncpy(node->label, item->label, len); \
-                node->centroid = item->coord;           \
-                node->type = LEAF_NODE;                 \
-                node->is_root = 1;                      \
-                node->height = 0;                       \
-                node->num_items = 1;                    \
-                node->items[0] = cluster->num_nodes++;  \
-        } while (0)                                     \
+#define init_leaf(cluster, node, items, i, len)                  \
+        do {                                                    \
+                strncpy(node->label, item_label(items, i), len); \
+                memcpy(node->centroid, item_coord(items, i),    \
+                       items->stride * sizeof(float));          \
+                node->type = LEAF_NODE;                         \
+                node->is_root = 1;                              \
+                node->height = 0;                               \
+                node->num_items = 1;                            \
+                node->first_item = node->last_item =            \
+                        cluster->num_nodes++;                   \
+        } while (0)                                             \
 
-cluster_node_t *add_leaf(cluster_t *cluster, const item_t *item)
+cluster_node_t *add_leaf(cluster_t *cluster, const dataset_t *items, int i)
 {
         cluster_node_t *leaf = &(cluster->nodes[cluster->num_nodes]);
-        int len = strlen(item->label) + 1;
-        leaf->label = alloc_mem(len, char);
+        int len = strlen(item_label(items, i)) + 1;
+        leaf->centroid = &(cluster->centroids[(size_t) cluster->num_nodes *
+                                              cluster->stride]);
+        leaf->label = arena_mem(&(cluster->arena), len, char);
         if (leaf->label) {
-                leaf->items = alloc_mem(1, int);
-                if (leaf->items) {
-                        init_leaf(cluster, leaf, item, len);
-                        cluster->num_clusters++;
-                } else {
-                        alloc_fail("node items");
-                        free(leaf->label);
-                        leaf = NULL;
-                }
+                init_leaf(cluster, leaf, items, i, len);
+                cluster->num_clusters++;
         } else {
                 alloc_fail("node label");
                 leaf = NULL;
@@ -317,28 +505,15 @@ cluster_node_t *add_leaf(cluster_t *cluster, const item_t *item)
 
 #undef init_leaf
 
-cluster_t *add_leaves(cluster_t *cluster, item_t *items)
-{
-        for (int i = 0; i < cluster->num_items; ++i) {
-                if (add_leaf(cluster, &items[i]))
-                        update_neighbours(cluster, i);
-                else {
-                        cluster = NULL;
-                        break;
-                }
-        }
-        return cluster;
-}
-
 void print_cluster_items(cluster_t *cluster, int index)
 {
         cluster_node_t *node = &(cluster->nodes[index]);
+        int item = node->first_item;
         fprintf(stdout, "Items: ");
-        if (node->num_items > 0) {
-                fprintf(stdout, "%s", cluster->nodes[node->items[0]].label);
-                for (int i = 1; i < node->num_items; ++i)
-                        fprintf(stdout, ", %s",
-                                cluster->nodes[node->items[i]].label);
+        for (int i = 0; i < node->num_items; ++i) {
+                fprintf(stdout, i ? ", %s" : "%s",
+                        cluster->nodes[item].label);
+                item = cluster->next_item[item];
         }
         fprintf(stdout, "\n");
 }
@@ -346,21 +521,22 @@ void print_cluster_items(cluster_t *cluster, int index)
 void print_cluster_node(cluster_t *cluster, int index)
 {
         cluster_node_t *node = &(cluster->nodes[index]);
-        fprintf(stdout, "Node %d - height: %d, centroid: (%5.3f, %5.3f)\n",
-                index, node->height, node->centroid.x, node->centroid.y);
+        fprintf(stdout, "Node %d - height: %d", index, node->height);
+        if (cluster->num_dims) {
+                fprintf(stdout, ", centroid: (%5.3f", node->centroid[0]);
+                for (int i = 1; i < cluster->num_dims; ++i)
+                        fprintf(stdout, ", %5.3f", node->centroid[i]);
+                fprintf(stdout, ")");
+        }
+        fprintf(stdout, "\n");
         if (node->label)
                 fprintf(stdout, "\tLeaf: %s\n\t", node->label);
         else
                 fprintf(stdout, "\tMerged: %d, %d\n\t",
                         node->merged[0], node->merged[1]);
         print_cluster_items(cluster, index);
-        fprintf(stdout, "\tNeighbours: ");
-        neighbour_t *t = node->neighbours;
-        while (t) {
-                fprintf(stdout, "\n\t\t%2d: %5.3f", t->target, t->distance);
-                t = t->next;
-        }
-        fprintf(stdout, "\n");
+        if (node->type == A_MERGER)
+                fprintf(stdout, "\tDistance: %5.3f\n", node->distance);
 }
 
 void merge_items(cluster_t *cluster, cluster_node_t *node,
@@ -370,50 +546,39 @@ void merge_items(cluster_t *cluster, cluster_node_t *node,
         node->is_root = 1;
         node->height = -1;
 
-        /* copy leaf indexes from merged clusters */
-        int k = 0, idx;
-        coord_t centroid = { .x = 0.0, .y = 0.0 };
         for (int i = 0; i < 2; ++i) {
                 cluster_node_t *t = to_merge[i];
                 t->is_root = 0; /* no longer root: merged */
                 if (node->height == -1 ||
                     node->height < t->height)
                         node->height = t->height;
-                for (int j = 0; j < t->num_items; ++j) {
-                        idx = t->items[j];
-                        node->items[k++] = idx;
-                }
-                centroid.x += t->num_items * t->centroid.x;
-                centroid.y += t->num_items * t->centroid.y;
         }
+        /*
+         * Splice the list of leaves of the second cluster after that of
+         * the first. Lists of clusters inside them stay intact, as they
+         * are walked by count.
+         */
+        node->num_items = to_merge[0]->num_items + to_merge[1]->num_items;
+        node->first_item = to_merge[0]->first_item;
+        node->last_item = to_merge[1]->last_item;
+        cluster->next_item[to_merge[0]->last_item] = to_merge[1]->first_item;
+
         /* calculate centroid */
-        node->centroid.x = centroid.x / k;
-        node->centroid.y = centroid.y / k;
+        const float *a = to_merge[0]->centroid, *b = to_merge[1]->centroid;
+        float na = to_merge[0]->num_items, nb = to_merge[1]->num_items;
+        for (int i = 0; i < cluster->stride; ++i)
+                node->centroid[i] = (na * a[i] + nb * b[i]) /
+                        node->num_items;
         node->height++;
 }
 
-#define merge_to_one(cluster, to_merge, node, node_idx)         \
-        do {                                                    \
-                node->num_items = to_merge[0]->num_items +      \
-                        to_merge[1]->num_items;                 \
-                node->items = alloc_mem(node->num_items, int);  \
-                if (node->items) {                              \
-                        merge_items(cluster, node, to_merge);   \
-                        cluster->num_nodes++;                   \
-                        cluster->num_clusters--;                \
-                        update_neighbours(cluster, node_idx);   \
-                } else {                                        \
-                        alloc_fail("array of merged items");    \
-                        free(node->merged);                     \
-                        node = NULL;                            \
-                }                                               \
-        } while(0)                                              \
-
 cluster_node_t *merge(cluster_t *cluster, int first, int second)
 {
         int new_idx = cluster->num_nodes;
         cluster_node_t *node = &(cluster->nodes[new_idx]);
-        node->merged = alloc_mem(2, int);
+        node->merged = arena_mem(&(cluster->arena), 2, int);
+        node->centroid = &(cluster->centroids[(size_t) new_idx *
+                                              cluster->stride]);
         if (node->merged) {
                 cluster_node_t *to_merge[2] = {
                         &(cluster->nodes[first]),
@@ -421,7 +586,9 @@ cluster_node_t *merge(cluster_t *cluster, int first, int second)
                 };
                 node->merged[0] = first;
                 node->merged[1] = second;
-                merge_to_one(cluster, to_merge, node, new_idx);
+                merge_items(cluster, node, to_merge);
+                cluster->num_nodes++;
+                cluster->num_clusters--;
         } else {
                 alloc_fail("array of merged nodes");
                 node = NULL;
@@ -429,98 +596,141 @@ cluster_node_t *merge(cluster_t *cluster, int first, int second)
         return node;
 }
 
-#undef merge_to_one
-
-void find_best_distance_neighbour(cluster_node_t *nodes,
-                                  int node_idx,
-                                  neighbour_t *neighbour,
-                                  float *best_distance,
-                                  int *first, int *second)
+/* adds the leaves, and then a merged node for each of the merges */
+cluster_t *build_hierarchy(cluster_t *cluster, const dataset_t *items,
+                           const ahc_merge_t merges[])
 {
-        while (neighbour) {
-                if (nodes[neighbour->target].is_root) {
-                        if (*first == -1 ||
-                            neighbour->distance < *best_distance) {
-                                *first = node_idx;
-                                *second = neighbour->target;
-                                *best_distance = neighbour->distance;
-                        }
-                        break;
-                }
-                neighbour = neighbour->next;
+        for (int i = 0; i < cluster->num_items && cluster; ++i)
+                if (!add_leaf(cluster, items, i))
+                        cluster = NULL;
+        for (int i = 0; cluster && i < cluster->num_items - 1; ++i) {
+                cluster_node_t *node = merge(cluster, merges[i].first,
+                                             merges[i].second);
+                if (node)
+                        node->distance = merges[i].distance;
+                else
+                        cluster = NULL;
         }
+        return cluster;
 }
 
-
-int find_clusters_to_merge(cluster_t *cluster, int *first, int *second)
+/*
+ * Merges the items along the edges from each to its k nearest neighbours,
+ * whose search adds to the time spent on distances.
+ */
+int cluster_graph(ahc_context_t *ctx, arena_t *work, const dataset_t *items,
+                  int k, ahc_merge_t merges[], ahc_timing_t *search)
 {
-        float best_distance = 0.0;
-        int root_clusters_seen = 0;
-        int j = cluster->num_nodes; /* traverse hierarchy top-down */
-        *first = -1;
-        while (root_clusters_seen < cluster->num_clusters) {
-                cluster_node_t *node = &(cluster->nodes[--j]);
-                if (node->type == NOT_USED || !node->is_root)
-                        continue;
-                ++root_clusters_seen;
-                find_best_distance_neighbour(cluster->nodes, j,
-                                             node->neighbours,
-                                             &best_distance,
-                                             first, second);
+        size_t n = items->num_items;
+        int *neighbours = arena_mem(work, n * k, int);
+        size_t *offsets = arena_mem(work, n + 1, size_t);
+        ahc_stats_t stats;
+        if (!neighbours || !offsets) {
+                alloc_fail("nearest neighbours");
+                return 0;
         }
-        return *first;
+        for (size_t i = 0; i <= n; ++i)
+                offsets[i] = i * k;
+        if (!ahc_knn_graph(ctx, items->coords, n, items->num_dims,
+                           items->stride, k, neighbours))
+                return 0;
+        ahc_get_stats(ctx, &stats);
+        *search = stats.distances;
+        return ahc_cluster_graph(ctx, items->coords, n, items->num_dims,
+                                 items->stride, offsets, neighbours, merges);
 }
 
-cluster_t *merge_clusters(cluster_t *cluster)
+/*
+ * Merges the items, with distances computed from their coordinates, or
+ * taken from the given matrix if it is not NULL, which is overwritten.
+ * Given an update, the items after its first are inserted into its
+ * hierarchy instead, and given a number of neighbours, only the items
+ * joined by the graph of their nearest neighbours are merged. The
+ * working memory of the library comes from an arena that is freed as
+ * soon as the merges are known.
+ */
+int cluster_items(ahc_context_t *ctx, cluster_t *cluster,
+                  const dataset_t *items, distance_matrix_t *distances,
+                  update_t *update, int num_neighbours, ahc_merge_t merges[])
 {
-        int first, second;
-        while (cluster->num_clusters > 1) {
-                if (find_clusters_to_merge(cluster, &first, &second) != -1)
-                        merge(cluster, first, second);
-        }
-        return cluster;
+        arena_t work = { NULL };
+        ahc_allocator_t allocator = { arena_calloc, arena_release, &work };
+        ahc_timing_t search = { 0.0, 0.0 };
+        ahc_set_allocator(ctx, &allocator);
+        int ok = num_neighbours ?
+                cluster_graph(ctx, &work, items, num_neighbours, merges,
+                              &search) :
+                distances ?
+                ahc_cluster_matrix(ctx, distances->data, items->num_items,
+                                   distances->square, merges) :
+                update ?
+                ahc_insert(ctx, items->coords, update->num_items,
+                           items->num_items, items->num_dims, items->stride,
+                           update->merges, update->tolerance, merges,
+                           &(update->report)) :
+                ahc_cluster(ctx, items->coords, items->num_items,
+                            items->num_dims, items->stride, merges);
+        ahc_set_allocator(ctx, NULL);
+        ahc_get_stats(ctx, &(cluster->stats));
+        cluster->stats.distances.wall += search.wall;
+        cluster->stats.distances.cpu += search.cpu;
+        cluster->work_reserved = work.reserved;
+        free_arena(&work);
+        return ok;
 }
 
-#define init_cluster(cluster, num_items, items)                         \
-        do {                                                            \
-                cluster->distances =                                    \
-                        generate_distance_matrix(num_items, items);     \
-                if (!cluster->distances)                                \
-                        goto cleanup;                                   \
-                cluster->num_items = num_items;                         \
-                cluster->num_nodes = 0;                                 \
-                cluster->num_clusters = 0;                              \
-                if (add_leaves(cluster, items))                         \
-                        merge_clusters(cluster);                        \
-                else                                                    \
-                        goto cleanup;                                   \
-        } while (0)                                                     \
-
-cluster_t *agglomerate(int num_items, item_t *items)
-{
-        cluster_t *cluster = alloc_mem(1, cluster_t);
-        if (cluster) {
-                cluster->nodes = alloc_mem(2 * num_items - 1, cluster_node_t);
-                if (cluster->nodes)
-                        init_cluster(cluster, num_items, items);
-                else {
-                        alloc_fail("cluster nodes");
-                        goto cleanup;
-                }
-        } else
+/*
+ * Clusters the items, with distances computed from their coordinates,
+ * or taken from the given matrix if it is not NULL, which is then
+ * overwritten, or inserts them into the hierarchy of an update, or
+ * clusters them along the graph of their num_neighbours nearest, if it
+ * is not 0. All nodes are allocated from the arena of the cluster.
+ */
+cluster_t *agglomerate(ahc_context_t *ctx, const dataset_t *items,
+                       distance_matrix_t *distances, update_t *update,
+                       int num_neighbours)
+{
+        cluster_t *cluster = NULL;
+        ahc_merge_t *merges;
+        int n = items->num_items;
+        if (items->num_items > INT_MAX / 2) {
+                fprintf(stderr, "Too many items to cluster.\n");
+                return NULL;
+        }
+        cluster = alloc_mem(1, cluster_t);
+        if (!cluster || !(merges = arena_mem(&(cluster->arena), n,
+                                             ahc_merge_t))) {
                 alloc_fail("cluster");
-        goto done;
+                goto cleanup;
+        }
+        if (!cluster_items(ctx, cluster, items, distances, update,
+                           num_neighbours, merges))
+                goto cleanup;
+        cluster->num_items = n;
+        cluster->num_dims = items->num_dims;
+        cluster->stride = items->stride;
+        cluster->nodes = arena_mem(&(cluster->arena), 2 * n - 1,
+                                   cluster_node_t);
+        cluster->centroids = arena_mem(&(cluster->arena),
+                                       (size_t) (2 * n - 1) *
+                                       items->stride, float);
+        cluster->next_item = arena_mem(&(cluster->arena), n, int);
+        if (!cluster->nodes || !cluster->centroids || !cluster->next_item) {
+                alloc_fail("cluster nodes");
+                goto cleanup;
+        }
+        cluster->merges = merges;
+        start_timing(&(cluster->hierarchy_time));
+        int ok = build_hierarchy(cluster, items, merges) != NULL;
+        stop_timing(&(cluster->hierarchy_time));
+        if (ok)
+                return cluster;
 
 cleanup:
         free_cluster(cluster);
-        cluster = NULL;
-
-done:
-        return cluster;
+        return NULL;
 }
 
-#undef init_cluster
-
 int print_root_children(cluster_t *cluster, int i, int nodes_to_discard)
 {
         cluster_node_t *node = &(cluster->nodes[i]);
@@ -565,94 +775,2234 @@ void print_cluster(cluster_t *cluster)
                 print_cluster_node(cluster, i);
 }
 
-int read_items(int count, item_t *items, FILE *f)
+/* sets the flat cluster of each item, returning the number of clusters */
+int cut_merges(const ahc_merge_t merges[], int n, int k,
+               const options_t *options, int labels[])
 {
-        for (int i = 0; i < count; ++i) {
-                item_t *t = &(items[i]);
-                if (fscanf(f, "%[^|]| %10f %10f\n",
-                           t->label, &(t->coord.x),
-                           &(t->coord.y)))
-                        continue;
-                read_fail("item line");
-                return i;
-        }
-        return count;
+        if (options->cut == 'd')
+                return ahc_cut_distance(merges, n, options->threshold,
+                                        labels);
+        if (options->cut == 'i')
+                return ahc_cut_inconsistent(merges, n, options->threshold,
+                                            INCONSISTENCY_DEPTH, labels);
+        return ahc_cut_count(merges, n, k, labels);
 }
 
-int read_items_from_file(item_t **items, FILE *f)
+/* prints the items of each flat cluster, in the order of their labels */
+int print_flat_clusters(const cluster_t *cluster, const int labels[],
+                        int count)
 {
-        int count, r;
-        r = fscanf(f, "%5d\n", &count);
-        if (r == 0) {
-                read_fail("number of lines");
+        int n = cluster->num_items;
+        int *first = alloc_mem(count, int), *next = alloc_mem(n, int);
+        if (!first || !next) {
+                alloc_fail("flat clusters");
+                free(first);
+                free(next);
                 return 0;
         }
-        if (count) {
-                *items = alloc_mem(count, item_t);
-                if (*items) {
-                        if (read_items(count, *items, f) != count)
-                                free(items);
-                } else
-                        alloc_fail("items array");
+        for (int i = n - 1; i >= 0; --i) {
+                next[i] = first[labels[i]] - 1;
+                first[labels[i]] = i + 1;
         }
-        return count;
+        for (int c = 0; c < count; ++c) {
+                fprintf(stdout, "Items: ");
+                for (int i = first[c] - 1; i >= 0; i = next[i])
+                        fprintf(stdout, i == first[c] - 1 ? "%s" : ", %s",
+                                cluster->nodes[i].label);
+                fprintf(stdout, "\n");
+        }
+        free(first);
+        free(next);
+        return 1;
+}
+
+/* the linkage matrix of SciPy, with the lower numbered cluster first */
+void linkage_row(const ahc_merge_t *merge, double row[4])
+{
+        row[0] = merge->first < merge->second ? merge->first : merge->second;
+        row[1] = merge->first < merge->second ? merge->second : merge->first;
+        row[2] = merge->distance;
+        row[3] = merge->size;
+}
+
+void print_linkage(const ahc_merge_t merges[], int n)
+{
+        double row[4];
+        for (int i = 0; i < n - 1; ++i) {
+                linkage_row(&merges[i], row);
+                fprintf(stdout, "%d,%d,%.9g,%d\n", (int) row[0],
+                        (int) row[1], row[2], (int) row[3]);
+        }
+}
+
+int write_linkage(const ahc_merge_t merges[], int n)
+{
+        double row[4];
+        for (int i = 0; i < n - 1; ++i) {
+                linkage_row(&merges[i], row);
+                if (fwrite(row, sizeof(row), 1, stdout) != 1) {
+                        fprintf(stderr, "Failed to write linkage matrix.\n");
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+void print_labels(const cluster_t *cluster, const int labels[])
+{
+        for (int i = 0; i < cluster->num_items; ++i)
+                fprintf(stdout, "%s,%d\n", cluster->nodes[i].label,
+                        labels[i]);
 }
 
-void set_linkage(char linkage_type)
+/* prints the hierarchy and its flat clusters in the chosen format */
+int print_output(cluster_t *cluster, int k, const options_t *options)
 {
-        switch (linkage_type) {
-        case AVERAGE_LINKAGE:
-                distance_fptr = average_linkage;
-                break;
-        case COMPLETE_LINKAGE:
-                distance_fptr = complete_linkage;
-                break;
-        case CENTROID_LINKAGE:
-                distance_fptr = centroid_linkage;
-                break;
-        case SINGLE_LINKAGE:
-        default: distance_fptr = single_linkage;
+        int count = 0, *labels = NULL, status = 1;
+        if (!strcmp(options->format, "csv")) {
+                print_linkage(cluster->merges, cluster->num_items);
+                return 1;
         }
+        if (!strcmp(options->format, "binary"))
+                return write_linkage(cluster->merges, cluster->num_items);
+        if (options->cut != 'k' || !strcmp(options->format, "labels")) {
+                labels = alloc_mem(cluster->num_items, int);
+                if (!labels) {
+                        alloc_fail("flat clusters");
+                        return 0;
+                }
+                if (!(count = cut_merges(cluster->merges, cluster->num_items,
+                                         k, options, labels))) {
+                        free(labels);
+                        return 0;
+                }
+        }
+        if (!strcmp(options->format, "labels"))
+                print_labels(cluster, labels);
+        else {
+                fprintf(stdout, "CLUSTER HIERARCHY\n"
+                        "--------------------\n");
+                print_cluster(cluster);
+                fprintf(stdout, "\n\n%d CLUSTERS\n"
+                        "--------------------\n", labels ? count : k);
+                if (labels)
+                        status = print_flat_clusters(cluster, labels, count);
+                else
+                        get_k_clusters(cluster, k);
+        }
+        free(labels);
+        return status;
 }
 
-int process_input(item_t **items, const char *fname)
+int count_coords(const char *line)
 {
         int count = 0;
-        FILE *f = fopen(fname, "r");
-        if (f) {
-                count = read_items_from_file(items, f);
-                fclose(f);
-        } else
-                fprintf(stderr, "Failed to open input file %s.\n", fname);
+        const char *p = strchr(line, '|');
+        char *end;
+        if (p)
+                for (++p; strtof(p, &end), end != p; p = end)
+                        ++count;
         return count;
 }
 
-int main(int argc, char **argv)
+/* length of the label of "<label>| <coord> <coord> ...", or 0 */
+size_t label_length(const char *line)
 {
-        if (argc != 4) {
-                fprintf(stderr, "Usage: %s <input file> <num clusters> "
-                        "<linkage type>\n", argv[0]);
-                exit(1);
-        } else {
-                item_t *items = NULL;
-                int num_items = process_input(&items, argv[1]);
-                set_linkage(argv[3][0]);
-                if (num_items) {
-                        cluster_t *cluster = agglomerate(num_items, items);
-                        free(items);
-
-                        if (cluster) {
-                                fprintf(stdout, "CLUSTER HIERARCHY\n"
-                                        "--------------------\n");
-                                print_cluster(cluster);
-
-                                int k = atoi(argv[2]);
-                                fprintf(stdout, "\n\n%d CLUSTERS\n"
-                                        "--------------------\n", k);
-                                get_k_clusters(cluster, k);
-                                free_cluster(cluster);
+        line += strspn(line, " \t");
+        const char *p = strchr(line, '|');
+        return p ? p - line : 0;
+}
+
+int parse_coords(const char *p, float *coord, int num_dims)
+{
+        char *end;
+        for (int k = 0; k < num_dims; ++k, p = end) {
+                coord[k] = strtof(p, &end);
+                if (end == p)
+                        return 0;
+        }
+        return 1;
+}
+
+/* coordinates that are not numbers, or infinite, cannot be clustered */
+int finite_coords(const float *coord, int num_dims, size_t i)
+{
+        for (int k = 0; k < num_dims; ++k)
+                if (!isfinite(coord[k])) {
+                        fprintf(stderr, "Invalid coordinates of item %zu.\n",
+                                i);
+                        return 0;
+                }
+        return 1;
+}
+
+int finite_items(const dataset_t *items)
+{
+        for (size_t i = 0; i < items->num_items; ++i)
+                if (!finite_coords(item_coord(items, i), items->num_dims, i))
+                        return 0;
+        return 1;
+}
+
+/* parses the i-th item, storing its label at the given table offset */
+int parse_item(dataset_t *items, size_t i, uint64_t offset, char *line)
+{
+        char *p = strchr(line, '|');
+        if (!p)
+                return 0;
+        *p++ = '\0';
+        line += strspn(line, " \t");
+        items->label_offsets[i] = offset;
+        strcpy(&(items->labels[offset]), line);
+        return parse_coords(p, item_coord(items, i), items->num_dims);
+}
+
+#define is_blank(line) (!(line)[strspn(line, " \t\r")])
+
+/*
+ * Item lines are parsed in two parallel passes over chunks of whole
+ * lines. The first pass terminates every line with a null, and counts
+ * the items and label bytes of each chunk; the second knows where the
+ * items and labels of each chunk start, and parses them in place.
+ */
+typedef struct parse_task_s {
+        dataset_t *items;
+        int num_chunks; /* chunks of lines, one per thread */
+        char *start[MAX_THREADS + 1]; /* first line of each chunk */
+        size_t lines[MAX_THREADS]; /* items in each chunk */
+        size_t label_bytes[MAX_THREADS]; /* label bytes in each chunk */
+        size_t failed; /* first item that could not be parsed */
+} parse_task_t;
+
+void count_lines(void *arg, int thread, int count)
+{
+        parse_task_t *task = arg;
+        for (int c = thread; c < task->num_chunks; c += count) {
+                size_t lines = 0, label_bytes = 0;
+                char *line = task->start[c], *last = task->start[c + 1];
+                while (line < last) {
+                        char *end = memchr(line, '\n', last - line);
+                        if (end)
+                                *end = '\0';
+                        if (!is_blank(line)) {
+                                ++lines;
+                                label_bytes += label_length(line) + 1;
+                        }
+                        line = end ? end + 1 : last;
+                }
+                task->lines[c] = lines;
+                task->label_bytes[c] = label_bytes;
+        }
+}
+
+/* on entry, lines[] and label_bytes[] hold where each chunk starts */
+void parse_lines(void *arg, int thread, int count)
+{
+        parse_task_t *task = arg;
+        dataset_t *items = task->items;
+        for (int c = thread; c < task->num_chunks; c += count) {
+                size_t i = task->lines[c];
+                uint64_t offset = task->label_bytes[c];
+                char *line = task->start[c], *last = task->start[c + 1];
+                for (char *next; line < last && i < items->num_items;
+                     line = next) {
+                        next = line + strlen(line) + 1;
+                        if (is_blank(line))
+                                continue;
+                        size_t len = label_length(line);
+                        if (!parse_item(items, i, offset, line)) {
+                                size_t failed = task->failed;
+                                while (i < failed &&
+                                       !__atomic_compare_exchange_n(
+                                               &task->failed, &failed, i, 0,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED))
+                                        ;
+                                break;
+                        }
+                        offset += len + 1;
+                        ++i;
+                }
+        }
+}
+
+#undef is_blank
+
+/*
+ * Parses the text format, which is read into memory as a whole. The
+ * first line holds the number of items, optionally followed by the
+ * number of coordinates per item; otherwise, the coordinates on the
+ * first item line are counted.
+ */
+dataset_t *parse_text_items(ahc_context_t *ctx, char *text, size_t size)
+{
+        char *end = text + size, *p;
+        unsigned long long count;
+        int num_dims = 0;
+        dataset_t *items = NULL;
+        parse_task_t *task = alloc_mem(1, parse_task_t);
+        if (!task) {
+                alloc_fail("text parser");
+                return NULL;
+        }
+
+        /* the first line that isn't blank holds the counts */
+        text += strspn(text, " \t\r\n");
+        if ((p = memchr(text, '\n', end - text)))
+                *p = '\0';
+        if (*text < '0' || *text > '9' ||
+            sscanf(text, "%llu %d", &count, &num_dims) < 1 ||
+            count > SIZE_MAX / sizeof(uint64_t)) {
+                read_fail("number of lines");
+                goto done;
+        }
+        text = p ? p + 1 : end;
+        text += strspn(text, " \t\r\n");
+        if (count && num_dims < 1) {
+                if ((p = memchr(text, '\n', end - text)))
+                        *p = '\0';
+                num_dims = count_coords(text);
+                if (p)
+                        *p = '\n';
+        }
+        if (count && num_dims < 1) {
+                read_fail("item coordinates");
+                goto done;
+        }
+
+        /* chunks start at the first line starting inside them */
+        task->num_chunks = ahc_num_threads(ctx);
+        for (int c = 0; c < task->num_chunks; ++c) {
+                p = text + (end - text) * c / task->num_chunks;
+                if (p > text && p[-1] != '\n')
+                        p = (p = memchr(p, '\n', end - p)) ? p + 1 : end;
+                task->start[c] = c && p < task->start[c - 1] ?
+                        task->start[c - 1] : p;
+        }
+        task->start[task->num_chunks] = end;
+        ahc_parallel(ctx, count_lines, task, end - text);
+
+        size_t lines = 0, label_bytes = 0;
+        for (int c = 0; c < task->num_chunks; ++c) {
+                size_t n = task->lines[c], b = task->label_bytes[c];
+                task->lines[c] = lines;
+                task->label_bytes[c] = label_bytes;
+                lines += n;
+                label_bytes += b;
+        }
+        if (lines < count) {
+                read_fail("item line");
+                goto done;
+        }
+        items = alloc_dataset(count, num_dims, label_bytes);
+        if (!items)
+                goto done;
+        task->items = items;
+        task->failed = count;
+        ahc_parallel(ctx, parse_lines, task, end - text);
+        if (task->failed < count) {
+                read_fail("item line");
+                free_dataset(items);
+                items = NULL;
+        } else if (!finite_items(items)) {
+                free_dataset(items);
+                items = NULL;
+        }
+done:
+        free(task);
+        return items;
+}
+
+/* true if count elements of the given width at offset fit in size bytes */
+static inline int fits(uint64_t offset, uint64_t count, uint64_t width,
+                       size_t size)
+{
+        return offset <= size && (!count || count <= (size - offset) / width);
+}
+
+/* checks that the header describes arrays that lie inside the file */
+int valid_header(const binary_header_t *header, size_t size)
+{
+        uint64_t n = header->num_items;
+        uint64_t row = header->stride * sizeof(float);
+        return size >= sizeof(binary_header_t) &&
+                !memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) &&
+                header->version == BINARY_VERSION &&
+                (header->num_dims > 0 || !n) &&
+                header->num_dims <= INT_MAX / 2 &&
+                header->stride == (header->num_dims + VECTOR_WIDTH - 1) /
+                VECTOR_WIDTH * VECTOR_WIDTH &&
+                header->coords_offset % VECTOR_ALIGN == 0 &&
+                fits(header->coords_offset, n, row, size) &&
+                header->offsets_offset % sizeof(uint64_t) == 0 &&
+                header->offsets_offset >= header->coords_offset + n * row &&
+                fits(header->offsets_offset, n, sizeof(uint64_t), size) &&
+                header->labels_offset >= header->offsets_offset +
+                n * sizeof(uint64_t) &&
+                fits(header->labels_offset, header->labels_size, 1, size);
+}
+
+/*
+ * Maps a binary input file, whose arrays are used in place; the pages
+ * are only read from the file as they are first used.
+ */
+dataset_t *map_binary_items(int fd, size_t size)
+{
+        void *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+                read_fail("binary items");
+                return NULL;
+        }
+        const binary_header_t *header = mem;
+        dataset_t *items = NULL;
+        if (!valid_header(header, size)) {
+                read_fail("binary header");
+                goto fail;
+        }
+        items = alloc_mem(1, dataset_t);
+        if (!items) {
+                alloc_fail("items array");
+                goto fail;
+        }
+        items->num_items = header->num_items;
+        items->num_dims = header->num_dims;
+        items->stride = header->stride;
+        items->coords = (float *) ((char *) mem + header->coords_offset);
+        items->label_offsets = (uint64_t *) ((char *) mem +
+                                             header->offsets_offset);
+        items->labels = (char *) mem + header->labels_offset;
+        items->mapped = mem;
+        items->mapped_size = size;
+
+        /* every label must end inside the string table */
+        size_t labels_size = header->labels_size;
+        if (items->num_items &&
+            (!labels_size || items->labels[labels_size - 1])) {
+                read_fail("labels");
+                goto fail;
+        }
+        for (size_t i = 0; i < items->num_items; ++i)
+                if (items->label_offsets[i] >= labels_size) {
+                        read_fail("labels");
+                        goto fail;
+                }
+        if (!finite_items(items))
+                goto fail;
+        return items;
+fail:
+        free(items);
+        munmap(mem, size);
+        return NULL;
+}
+
+/* items without coordinates, labelled with the labels in the table */
+dataset_t *labelled_items(size_t n, const uint64_t *offsets,
+                          const char *labels, size_t labels_size)
+{
+        char number[24];
+        if (!offsets) {
+                labels_size = 0;
+                for (size_t i = 0; i < n; ++i)
+                        labels_size += sprintf(number, "%zu", i) + 1;
+        }
+        dataset_t *items = alloc_dataset(n, 0, labels_size);
+        if (!items)
+                return NULL;
+        uint64_t offset = 0;
+        for (size_t i = 0; i < n; ++i) {
+                const char *label = offsets ? &labels[offsets[i]] : number;
+                if (!offsets)
+                        sprintf(number, "%zu", i);
+                items->label_offsets[i] = offset;
+                strcpy(&(items->labels[offset]), label);
+                offset += strlen(label) + 1;
+        }
+        return items;
+}
+
+/*
+ * Maps a distance matrix file, which becomes the matrix of distances
+ * between the items. The mapping is private, so the clustering may
+ * update the distances in place without changing the file: only the
+ * pages it writes to are copied. Returns the labelled items.
+ */
+dataset_t *map_distance_matrix(int fd, size_t size,
+                               distance_matrix_t **distances)
+{
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+        if (mem == MAP_FAILED) {
+                read_fail("distance matrix");
+                return NULL;
+        }
+        const matrix_header_t *header = mem;
+        dataset_t *items = NULL;
+        distance_matrix_t *matrix = NULL;
+        if (size < sizeof(matrix_header_t) ||
+            header->version != BINARY_VERSION || header->n > INT_MAX / 2) {
+                read_fail("distance matrix header");
+                goto fail;
+        }
+        uint64_t n = header->n;
+        uint64_t entries = header->square ? n * n : n * (n - 1) / 2;
+        if (header->data_offset % sizeof(float) ||
+            !fits(header->data_offset, entries, sizeof(float), size) ||
+            (header->offsets_offset &&
+             (header->offsets_offset % sizeof(uint64_t) ||
+              !fits(header->offsets_offset, n, sizeof(uint64_t), size) ||
+              !fits(header->labels_offset, header->labels_size, 1, size)))) {
+                read_fail("distance matrix header");
+                goto fail;
+        }
+        const uint64_t *offsets = NULL;
+        const char *labels = (char *) mem + header->labels_offset;
+        if (header->offsets_offset) {
+                offsets = (uint64_t *) ((char *) mem + header->offsets_offset);
+                for (size_t i = 0; i < n; ++i)
+                        if (offsets[i] >= header->labels_size) {
+                                read_fail("labels");
+                                goto fail;
                         }
+                if (n && labels[header->labels_size - 1]) {
+                        read_fail("labels");
+                        goto fail;
                 }
         }
-        return 0;
+        items = labelled_items(n, offsets, labels, header->labels_size);
+        matrix = alloc_mem(1, distance_matrix_t);
+        if (!items || !matrix) {
+                alloc_fail("distance matrix");
+                goto fail;
+        }
+        matrix->n = n;
+        matrix->square = header->square != 0;
+        matrix->data = (float *) ((char *) mem + header->data_offset);
+        matrix->mapping = mem;
+        matrix->size = size;
+        *distances = matrix;
+        return items;
+fail:
+        free_dataset(items);
+        free(matrix);
+        munmap(mem, size);
+        return NULL;
+}
+
+/* writes the items in the binary format, returning 0 on failure */
+int write_binary_items(const dataset_t *items, const char *fname)
+{
+        binary_header_t header;
+        size_t n = items->num_items, coords_size, labels_size = 0;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+        for (size_t i = 0; i < n; ++i)
+                labels_size += strlen(item_label(items, i)) + 1;
+        coords_size = n * items->stride * sizeof(float);
+        header.version = BINARY_VERSION;
+        header.num_dims = items->num_dims;
+        header.num_items = n;
+        header.stride = items->stride;
+        header.coords_offset = (sizeof(header) + VECTOR_ALIGN - 1) /
+                VECTOR_ALIGN * VECTOR_ALIGN;
+        header.offsets_offset = header.coords_offset + coords_size;
+        header.labels_offset = header.offsets_offset + n * sizeof(uint64_t);
+        header.labels_size = labels_size;
+
+        FILE *f = fopen(fname, "wb");
+        if (!f) {
+                fprintf(stderr, "Failed to open output file %s.\n", fname);
+                return 0;
+        }
+        char padding[VECTOR_ALIGN] = { 0 };
+        size_t padding_size = header.coords_offset - sizeof(header);
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                fwrite(padding, 1, padding_size, f) == padding_size &&
+                fwrite(items->coords, 1, coords_size, f) == coords_size;
+        uint64_t offset = 0;
+        for (size_t i = 0; i < n && ok; ++i) {
+                ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+                offset += strlen(item_label(items, i)) + 1;
+        }
+        for (size_t i = 0; i < n && ok; ++i) {
+                const char *label = item_label(items, i);
+                ok = fwrite(label, strlen(label) + 1, 1, f) == 1;
+        }
+        if (fclose(f) || !ok) {
+                fprintf(stderr, "Failed to write output file %s.\n", fname);
+                return 0;
+        }
+        return 1;
+}
+
+static inline uint64_t aligned(uint64_t offset)
+{
+        return (offset + VECTOR_ALIGN - 1) / VECTOR_ALIGN * VECTOR_ALIGN;
+}
+
+/* pads the file with zeros up to the offset */
+int pad_file(FILE *f, uint64_t offset)
+{
+        off_t pos = ftello(f);
+        while (pos >= 0 && (uint64_t) pos < offset && fputc(0, f) != EOF)
+                ++pos;
+        return pos >= 0 && (uint64_t) pos == offset;
+}
+
+/* writes the finished hierarchy as a snapshot, returning 0 on failure */
+int write_snapshot(const cluster_t *cluster, const char *fname)
+{
+        snapshot_header_t header;
+        size_t n = cluster->num_items, num_nodes = 2 * n - 1;
+        size_t centroids_size = num_nodes * cluster->stride * sizeof(float);
+        size_t labels_size = 0;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        for (size_t i = 0; i < n; ++i)
+                labels_size += strlen(cluster->nodes[i].label) + 1;
+        header.version = SNAPSHOT_VERSION;
+        header.num_dims = cluster->num_dims;
+        header.num_items = n;
+        header.stride = cluster->stride;
+        header.linkage = cluster->linkage;
+        header.merges_offset = aligned(sizeof(header));
+        header.heights_offset = aligned(header.merges_offset +
+                                        (n - 1) * sizeof(ahc_merge_t));
+        header.first_offset = aligned(header.heights_offset +
+                                      num_nodes * sizeof(int32_t));
+        header.next_offset = aligned(header.first_offset +
+                                     num_nodes * sizeof(int32_t));
+        header.centroids_offset = aligned(header.next_offset +
+                                          n * sizeof(int32_t));
+        header.offsets_offset = aligned(header.centroids_offset +
+                                        centroids_size);
+        header.labels_offset = header.offsets_offset + n * sizeof(uint64_t);
+        header.labels_size = labels_size;
+
+        FILE *f = fopen(fname, "wb");
+        if (!f) {
+                fprintf(stderr, "Failed to open snapshot file %s.\n", fname);
+                return 0;
+        }
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                pad_file(f, header.merges_offset) &&
+                fwrite(cluster->merges, sizeof(ahc_merge_t), n - 1, f) ==
+                n - 1 && pad_file(f, header.heights_offset);
+        for (size_t v = 0; v < num_nodes && ok; ++v) {
+                int32_t height = cluster->nodes[v].height;
+                ok = fwrite(&height, sizeof(height), 1, f) == 1;
+        }
+        ok = ok && pad_file(f, header.first_offset);
+        for (size_t v = 0; v < num_nodes && ok; ++v) {
+                int32_t first = cluster->nodes[v].first_item;
+                ok = fwrite(&first, sizeof(first), 1, f) == 1;
+        }
+        ok = ok && pad_file(f, header.next_offset);
+        for (size_t i = 0; i < n && ok; ++i) {
+                int32_t next = cluster->next_item[i];
+                ok = fwrite(&next, sizeof(next), 1, f) == 1;
+        }
+        ok = ok && pad_file(f, header.centroids_offset) &&
+                fwrite(cluster->centroids, 1, centroids_size, f) ==
+                centroids_size && pad_file(f, header.offsets_offset);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < n && ok; ++i) {
+                ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+                offset += strlen(cluster->nodes[i].label) + 1;
+        }
+        for (size_t i = 0; i < n && ok; ++i) {
+                const char *label = cluster->nodes[i].label;
+                ok = fwrite(label, strlen(label) + 1, 1, f) == 1;
+        }
+        if (fclose(f) || !ok) {
+                fprintf(stderr, "Failed to write snapshot file %s.\n", fname);
+                return 0;
+        }
+        return 1;
+}
+
+int valid_snapshot_header(const snapshot_header_t *header, size_t size)
+{
+        uint64_t n = header->num_items, num_nodes = 2 * n - 1;
+        uint64_t row = header->stride * sizeof(float);
+        return size >= sizeof(snapshot_header_t) &&
+                !memcmp(header->magic, SNAPSHOT_MAGIC,
+                        sizeof(header->magic)) &&
+                header->version == SNAPSHOT_VERSION &&
+                n > 0 && n <= INT_MAX / 2 &&
+                header->num_dims <= INT_MAX / 2 &&
+                header->stride == (header->num_dims + VECTOR_WIDTH - 1) /
+                VECTOR_WIDTH * VECTOR_WIDTH &&
+                header->merges_offset % VECTOR_ALIGN == 0 &&
+                header->heights_offset % VECTOR_ALIGN == 0 &&
+                header->first_offset % VECTOR_ALIGN == 0 &&
+                header->next_offset % VECTOR_ALIGN == 0 &&
+                header->centroids_offset % VECTOR_ALIGN == 0 &&
+                header->offsets_offset % VECTOR_ALIGN == 0 &&
+                fits(header->merges_offset, n - 1, sizeof(ahc_merge_t),
+                     size) &&
+                fits(header->heights_offset, num_nodes, sizeof(int32_t),
+                     size) &&
+                fits(header->first_offset, num_nodes, sizeof(int32_t),
+                     size) &&
+                fits(header->next_offset, n, sizeof(int32_t), size) &&
+                fits(header->centroids_offset, num_nodes, row, size) &&
+                fits(header->offsets_offset, n, sizeof(uint64_t), size) &&
+                fits(header->labels_offset, header->labels_size, 1, size) &&
+                header->labels_size && header->labels_offset +
+                header->labels_size <= size;
+}
+
+/*
+ * Checks that the nodes of a mapped snapshot form a tree: every merge
+ * names two items or nodes that come before it, and every node but the
+ * root is named by exactly one merge, whose size is the sum of theirs.
+ * Every label must end inside the table.
+ */
+int valid_snapshot(const snapshot_header_t *header, const char *mem)
+{
+        int n = header->num_items;
+        const ahc_merge_t *merges = (const ahc_merge_t *)
+                (mem + header->merges_offset);
+        const int32_t *first = (const int32_t *) (mem + header->first_offset);
+        const int32_t *next = (const int32_t *) (mem + header->next_offset);
+        const uint64_t *offsets = (const uint64_t *)
+                (mem + header->offsets_offset);
+        if (mem[header->labels_offset + header->labels_size - 1])
+                return 0;
+        for (int i = 0; i < n; ++i)
+                if (offsets[i] >= header->labels_size ||
+                    next[i] < 0 || next[i] >= n)
+                        return 0;
+        for (int v = 0; v < 2 * n - 1; ++v)
+                if (first[v] < 0 || first[v] >= n)
+                        return 0;
+        char *named = alloc_mem(2 * header->num_items - 1, char);
+        if (!named) {
+                alloc_fail("snapshot check");
+                return 0;
+        }
+        int ok = 1;
+        for (int i = 0; ok && i < n - 1; ++i) {
+                int a = merges[i].first, b = merges[i].second;
+                ok = a >= 0 && a < n + i && b >= 0 && b < n + i &&
+                        !named[a] && !named[b] && a != b &&
+                        merges[i].size ==
+                        (a < n ? 1 : merges[a - n].size) +
+                        (b < n ? 1 : merges[b - n].size);
+                if (ok)
+                        named[a] = named[b] = 1;
+        }
+        for (int v = 0; ok && v < 2 * n - 2; ++v)
+                ok = named[v];
+        free(named);
+        return ok;
+}
+
+/*
+ * Maps a hierarchy snapshot, whose arrays are used in place. Only the
+ * nodes, which point into them, are built, in time linear in the number
+ * of items: no distances or centroids are computed again.
+ */
+cluster_t *map_snapshot(int fd, size_t size)
+{
+        void *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem == MAP_FAILED) {
+                read_fail("snapshot");
+                return NULL;
+        }
+        const snapshot_header_t *header = mem;
+        cluster_t *cluster = NULL;
+        if (!valid_snapshot_header(header, size) ||
+            !valid_snapshot(header, mem)) {
+                read_fail("snapshot");
+                munmap(mem, size);
+                return NULL;
+        }
+        int n = header->num_items;
+        char *base = mem;
+        const int32_t *heights = (int32_t *) (base + header->heights_offset);
+        const int32_t *first = (int32_t *) (base + header->first_offset);
+        const uint64_t *offsets = (uint64_t *) (base +
+                                               header->offsets_offset);
+        cluster = alloc_mem(1, cluster_t);
+        if (!cluster) {
+                alloc_fail("cluster");
+                munmap(mem, size);
+                return NULL;
+        }
+        cluster->mapped = mem;
+        cluster->mapped_size = size;
+        cluster->linkage = header->linkage;
+        cluster->num_items = n;
+        cluster->num_clusters = 1;
+        cluster->num_nodes = 2 * n - 1;
+        cluster->num_dims = header->num_dims;
+        cluster->stride = header->stride;
+        cluster->merges = (ahc_merge_t *) (base + header->merges_offset);
+        cluster->next_item = (int *) (base + header->next_offset);
+        cluster->centroids = (float *) (base + header->centroids_offset);
+        cluster->nodes = arena_mem(&(cluster->arena), 2 * n - 1,
+                                   cluster_node_t);
+        int *merged = arena_mem(&(cluster->arena), 2 * n, int);
+        if (!cluster->nodes || !merged) {
+                alloc_fail("cluster nodes");
+                free_cluster(cluster);
+                return NULL;
+        }
+        for (int v = 0; v < 2 * n - 1; ++v) {
+                cluster_node_t *node = &(cluster->nodes[v]);
+                node->is_root = v == 2 * n - 2;
+                node->height = heights[v];
+                node->centroid = &(cluster->centroids[(size_t) v *
+                                                      cluster->stride]);
+                node->first_item = first[v];
+                if (v < n) {
+                        node->type = LEAF_NODE;
+                        node->label = base + header->labels_offset +
+                                offsets[v];
+                        node->num_items = 1;
+                        continue;
+                }
+                const ahc_merge_t *m = &(cluster->merges[v - n]);
+                node->type = A_MERGER;
+                node->merged = &merged[2 * (v - n)];
+                node->merged[0] = m->first;
+                node->merged[1] = m->second;
+                node->distance = m->distance;
+                node->num_items = m->size;
+        }
+        return cluster;
+}
+
+/* reads the rest of the file into memory, followed by a null */
+char *read_text(int fd, size_t size)
+{
+        char *text = alloc_mem(size + 1, char);
+        if (!text) {
+                alloc_fail("input text");
+                return NULL;
+        }
+        for (size_t done = 0; done < size;) {
+                ssize_t r = read(fd, text + done, size - done);
+                if (r <= 0) {
+                        read_fail("input text");
+                        free(text);
+                        return NULL;
+                }
+                done += r;
+        }
+        return text;
+}
+
+/*
+ * Binary input files are mapped, and text files are parsed. Distance
+ * matrix files are mapped into *distances, and hierarchy snapshots into
+ * *snapshot, which are otherwise NULL.
+ */
+dataset_t *process_input(ahc_context_t *ctx, const char *fname,
+                         distance_matrix_t **distances,
+                         cluster_t **snapshot)
+{
+        dataset_t *items = NULL;
+        char magic[sizeof(BINARY_MAGIC) - 1];
+        struct stat st;
+        int fd = open(fname, O_RDONLY);
+        *distances = NULL;
+        *snapshot = NULL;
+        if (fd < 0 || fstat(fd, &st)) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                goto done;
+        }
+        if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+                magic[0] = '\0';
+        if (!memcmp(magic, BINARY_MAGIC, sizeof(magic)))
+                items = map_binary_items(fd, st.st_size);
+        else if (!memcmp(magic, MATRIX_MAGIC, sizeof(magic)))
+                items = map_distance_matrix(fd, st.st_size, distances);
+        else if (!memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)))
+                *snapshot = map_snapshot(fd, st.st_size);
+        else {
+                char *text = read_text(fd, st.st_size);
+                if (text)
+                        items = parse_text_items(ctx, text, st.st_size);
+                free(text);
+        }
+done:
+        if (fd >= 0)
+                close(fd);
+        return items;
+}
+
+void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [options] <input file> <num clusters> "
+                "<linkage type>\n"
+                "       %s [-j N] -w <binary file> <input file>\n"
+                "       %s -l <socket> <snapshot file>...\n"
+                "       %s [options] -B <manifest or directory> "
+                "<num clusters> <linkage type>\n"
+                "Options:\n"
+                "\t-b B\tsummarise the items into micro-clusters that fit "
+                "in B MiB,\n\t\tcluster those, and print the labels of "
+                "the items\n"
+                "\t-B F\tcluster each file listed in F, or in directory F, "
+                "on its own,\n\t\tand print their labels, or their csv "
+                "linkage matrices\n"
+                "\t-C\tcluster again with a float distance matrix, and "
+                "report on\n\t\tstderr how well the hierarchies agree\n"
+                "\t-d T\tcut the flat clusters at distance T, "
+                "instead of their number\n"
+                "\t-g K\tonly merge clusters joined by the graph of the "
+                "K nearest\n\t\tneighbours of each item\n"
+                "\t-H\tback the distance matrix with huge pages\n"
+                "\t-i T\tcut the flat clusters at inconsistency T\n"
+                "\t-j N\tcluster with N threads\n"
+                "\t-k\tcluster few euclidean coordinates with a k-d tree\n"
+                "\t-l S\tserve queries about the snapshots on the Unix "
+                "socket S\n"
+                "\t-m M\tmetric: euclidean (default), sqeuclidean, "
+                "manhattan,\n\t\tchebyshev, cosine, correlation or "
+                "minkowski\n"
+                "\t-M\treport memory use on stderr\n"
+                "\t-o F\toutput: tree (default), csv or binary linkage "
+                "matrix,\n\t\tor labels of the flat clusters\n"
+                "\t-p P\tpower of the minkowski metric (default 2)\n"
+                "\t-q F\tstore the distance matrix as float (default), "
+                "half, bfloat16,\n\t\tu16 or u8 values\n"
+                "\t-r R\twith -u, cluster again the subtrees under "
+                "merges up to\n\t\t1 + R times as far as the nearest "
+                "item (default 0)\n"
+                "\t-s F\twrite timings and counters as JSON to F, "
+                "or stderr if F is -\n"
+                "\t-S F\tsave the hierarchy to F, which may be given as "
+                "the input file\n\t\tof later runs to cut it again\n"
+                "\t-T D\tkeep the distance matrix in a scratch file "
+                "in directory D\n"
+                "\t-u F\tinsert the items after the first into the "
+                "hierarchy in F,\n\t\twritten by -o binary, and report "
+                "its change on stderr\n"
+                "\t-w F\twrite the items to F in the binary format, "
+                "and exit\n",
+                prog, prog, prog, prog);
+        exit(1);
+}
+
+void close_item_stream(item_stream_t *stream)
+{
+        if (stream) {
+                if (stream->file)
+                        fclose(stream->file);
+                if (!stream->items)
+                        free(stream->coords);
+                free_dataset(stream->items);
+                free(stream->line);
+                free(stream);
+        }
+}
+
+/* next line that isn't blank, or NULL at the end of the file */
+char *read_line(item_stream_t *stream)
+{
+        while (getline(&(stream->line), &(stream->line_size),
+                       stream->file) >= 0)
+                if (stream->line[strspn(stream->line, " \t\r\n")])
+                        return stream->line;
+        return NULL;
+}
+
+/* reads the counts line of a text file, and the first item if needed */
+int read_stream_header(item_stream_t *stream)
+{
+        unsigned long long count;
+        int num_dims = 0;
+        char *line = read_line(stream);
+        line = line ? line + strspn(line, " \t") : NULL;
+        if (!line || *line < '0' || *line > '9' ||
+            sscanf(line, "%llu %d", &count, &num_dims) < 1) {
+                read_fail("number of lines");
+                return 0;
+        }
+        stream->num_items = count;
+        if (count && num_dims < 1) {
+                if (!read_line(stream)) {
+                        read_fail("item line");
+                        return 0;
+                }
+                stream->pending = 1;
+                num_dims = count_coords(stream->line);
+        }
+        if (count && num_dims < 1) {
+                read_fail("item coordinates");
+                return 0;
+        }
+        stream->num_dims = num_dims;
+        return 1;
+}
+
+item_stream_t *open_item_stream(const char *fname)
+{
+        char magic[sizeof(BINARY_MAGIC) - 1];
+        struct stat st;
+        int fd = open(fname, O_RDONLY);
+        item_stream_t *stream = alloc_mem(1, item_stream_t);
+        if (!stream) {
+                alloc_fail("input stream");
+                goto fail;
+        }
+        if (fd < 0 || fstat(fd, &st)) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                goto fail;
+        }
+        if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+                magic[0] = '\0';
+        if (!memcmp(magic, BINARY_MAGIC, sizeof(magic))) {
+                stream->items = map_binary_items(fd, st.st_size);
+                close(fd);
+                fd = -1;
+                if (!stream->items)
+                        goto fail;
+                stream->num_items = stream->items->num_items;
+                stream->num_dims = stream->items->num_dims;
+                return stream;
+        }
+        if (!memcmp(magic, MATRIX_MAGIC, sizeof(magic))) {
+                fprintf(stderr, "Distance matrices cannot be summarised.\n");
+                goto fail;
+        }
+        if (!memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic))) {
+                fprintf(stderr, "Snapshots cannot be summarised.\n");
+                goto fail;
+        }
+        if (!(stream->file = fdopen(fd, "r"))) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                goto fail;
+        }
+        fd = -1;
+        if (!read_stream_header(stream))
+                goto fail;
+        if (!(stream->coords = alloc_mem(stream->num_dims + 1, float))) {
+                alloc_fail("item coordinates");
+                goto fail;
+        }
+        return stream;
+fail:
+        if (fd >= 0)
+                close(fd);
+        close_item_stream(stream);
+        return NULL;
+}
+
+/* reads the next item: returns 1, or 0 after the last one, or -1 */
+int next_item(item_stream_t *stream)
+{
+        char *line, *p;
+        if (stream->next == stream->num_items)
+                return 0;
+        if (stream->items) {
+                stream->coords = item_coord(stream->items, stream->next);
+                stream->label = item_label(stream->items, stream->next++);
+                return 1;
+        }
+        line = stream->pending ? stream->line : read_line(stream);
+        stream->pending = 0;
+        if (!line || !(p = strchr(line, '|'))) {
+                read_fail("item line");
+                return -1;
+        }
+        *p++ = '\0';
+        stream->label = line + strspn(line, " \t");
+        if (!parse_coords(p, stream->coords, stream->num_dims)) {
+                read_fail("item line");
+                return -1;
+        }
+        if (!finite_coords(stream->coords, stream->num_dims, stream->next))
+                return -1;
+        stream->next++;
+        return 1;
+}
+
+/*
+ * Micro-clusters that fit in the memory budget: the distance matrix
+ * between them, and their summaries, centroids and merges.
+ */
+size_t summary_entries(size_t budget, int num_dims)
+{
+        size_t per_entry = 2 * (num_dims + 2) * sizeof(double) +
+                (num_dims + VECTOR_WIDTH) * sizeof(float) +
+                sizeof(ahc_merge_t) + 3 * sizeof(int);
+        size_t m = sqrt(2.0 * budget / sizeof(float)) + 2;
+        while (m > 2 && m * (m - 1) / 2 * sizeof(float) + m * per_entry >
+               budget)
+                --m;
+        return m;
+}
+
+/* labels every item with the flat cluster of its micro-cluster */
+int print_item_clusters(ahc_summary_t *summary, const char *fname,
+                        const int labels[], int count)
+{
+        int r, next = 0, *numbers = alloc_mem(count, int);
+        item_stream_t *stream = open_item_stream(fname);
+        if (!numbers || !stream) {
+                if (!numbers)
+                        alloc_fail("cluster numbers");
+                free(numbers);
+                close_item_stream(stream);
+                return 0;
+        }
+        /* clusters are numbered in the order of their first items */
+        while ((r = next_item(stream)) > 0) {
+                int c = labels[ahc_summary_nearest(summary, stream->coords)];
+                if (!numbers[c])
+                        numbers[c] = ++next;
+                fprintf(stdout, "%s,%d\n", stream->label, numbers[c] - 1);
+        }
+        free(numbers);
+        close_item_stream(stream);
+        return r == 0;
+}
+
+/*
+ * Summarises the items in one pass into as many micro-clusters as the
+ * memory budget allows, clusters their centroids weighted by their
+ * sizes, and labels the items in a second pass.
+ */
+int summarise_input(ahc_context_t *ctx, char **argv, const options_t *options)
+{
+        int r, ok = 0, count, num_dims, stride, *weights = NULL;
+        int *labels = NULL;
+        ahc_summary_t *summary = NULL;
+        ahc_merge_t *merges = NULL;
+        float *centroids = NULL;
+        size_t m;
+        item_stream_t *stream = open_item_stream(argv[0]);
+        ahc_set_linkage(ctx, argv[2][0]);
+        if (!stream)
+                return 1;
+        if (!stream->num_items) {
+                close_item_stream(stream);
+                return 0;
+        }
+        num_dims = stream->num_dims;
+        summary = ahc_create_summary(num_dims, summary_entries(
+                                             options->budget, num_dims));
+        if (!summary)
+                goto done;
+        while ((r = next_item(stream)) > 0)
+                if (!ahc_summary_add(summary, stream->coords))
+                        goto done;
+        if (r < 0)
+                goto done;
+        m = ahc_summary_size(summary);
+        stride = (num_dims + VECTOR_WIDTH - 1) / VECTOR_WIDTH * VECTOR_WIDTH;
+        centroids = alloc_coords(m, stride);
+        weights = alloc_mem(m, int);
+        labels = alloc_mem(m, int);
+        merges = alloc_mem(m, ahc_merge_t);
+        if (!centroids || !weights || !labels || !merges) {
+                alloc_fail("micro-clusters");
+                goto done;
+        }
+        ahc_summary_centroids(summary, centroids, stride, weights);
+        if (!ahc_cluster_weighted(ctx, centroids, weights, m, num_dims,
+                                  stride, merges))
+                goto done;
+        if (!strcmp(options->format, "csv")) {
+                print_linkage(merges, m);
+                ok = 1;
+        } else if (!strcmp(options->format, "binary"))
+                ok = write_linkage(merges, m);
+        else if ((count = cut_merges(merges, m, atoi(argv[1]), options,
+                                     labels)))
+                ok = print_item_clusters(summary, argv[0], labels, count);
+done:
+        close_item_stream(stream);
+        ahc_free_summary(summary);
+        free(centroids);
+        free(weights);
+        free(labels);
+        free(merges);
+        return !ok;
+}
+
+/* bytes allocated for the hierarchy and the clustering, and peak RSS */
+void print_memory_usage(const cluster_t *cluster)
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "Memory: %zu bytes in %d blocks for the hierarchy, "
+                "%zu bytes for clustering, peak RSS %ld KiB.\n",
+                cluster->arena.reserved, cluster->arena.num_blocks,
+                cluster->work_reserved, usage.ru_maxrss);
+}
+
+void print_timing(FILE *f, const char *phase, const ahc_timing_t *timing,
+                  const char *separator)
+{
+        fprintf(f, "    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }%s\n",
+                phase, timing->wall, timing->cpu, separator);
+}
+
+/* writes the time and work of every phase as a JSON object */
+int write_stats(const ahc_context_t *ctx, const cluster_t *cluster,
+                char linkage, const ahc_timing_t *input,
+                const ahc_timing_t *output, const char *file)
+{
+        const ahc_stats_t *stats = &(cluster->stats);
+        FILE *f = strcmp(file, "-") ? fopen(file, "w") : stderr;
+        struct rusage usage;
+        if (!f) {
+                fprintf(stderr, "Failed to open statistics file %s.\n",
+                        file);
+                return 0;
+        }
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(f, "{\n  \"items\": %d,\n  \"dims\": %d,\n"
+                "  \"linkage\": \"%c\",\n  \"threads\": %d,\n"
+                "  \"phases\": {\n", cluster->num_items, cluster->num_dims,
+                linkage, ahc_num_threads(ctx));
+        print_timing(f, "input", input, ",");
+        print_timing(f, "distances", &(stats->distances), ",");
+        print_timing(f, "merge", &(stats->merge), ",");
+        print_timing(f, "numbering", &(stats->numbering), ",");
+        print_timing(f, "hierarchy", &(cluster->hierarchy_time), ",");
+        print_timing(f, "output", output, "");
+        fprintf(f, "  },\n  \"counters\": {\n"
+                "    \"distance_evaluations\": %llu,\n"
+                "    \"distance_updates\": %llu,\n"
+                "    \"neighbour_searches\": %llu,\n"
+                "    \"rows_scanned\": %llu,\n"
+                "    \"chain_links\": %llu,\n"
+                "    \"stale_neighbours\": %llu\n  },\n",
+                stats->distance_evaluations, stats->distance_updates,
+                stats->neighbour_searches, stats->rows_scanned,
+                stats->chain_links, stats->stale_neighbours);
+        fprintf(f, "  \"memory\": {\n"
+                "    \"allocations\": %llu,\n"
+                "    \"allocated_bytes\": %llu,\n"
+                "    \"work_bytes\": %zu,\n"
+                "    \"hierarchy_bytes\": %zu,\n"
+                "    \"peak_rss_kb\": %ld\n  }\n}\n",
+                stats->allocations, stats->allocated_bytes,
+                cluster->work_reserved, cluster->arena.reserved,
+                usage.ru_maxrss);
+        return f == stderr ? 1 : !fclose(f);
+}
+
+/*
+ * Reads a linkage matrix written with -o binary: the hierarchy of its
+ * rows + 1 items, whose higher numbered cluster is put first again.
+ */
+int read_hierarchy(const char *fname, update_t *update)
+{
+        double row[4];
+        size_t count = 0, size = 0;
+        FILE *f = fopen(fname, "rb");
+        if (!f) {
+                fprintf(stderr, "Failed to open hierarchy file %s.\n", fname);
+                return 0;
+        }
+        while (fread(row, sizeof(row), 1, f) == 1) {
+                if (count == size) {
+                        ahc_merge_t *merges = realloc(update->merges,
+                                                      (size = 2 * size + 64) *
+                                                      sizeof(ahc_merge_t));
+                        if (!merges) {
+                                alloc_fail("hierarchy");
+                                fclose(f);
+                                return 0;
+                        }
+                        update->merges = merges;
+                }
+                if (!(row[0] >= 0.0 && row[1] <= INT_MAX)) {
+                        read_fail("hierarchy");
+                        fclose(f);
+                        return 0;
+                }
+                update->merges[count].first = row[1];
+                update->merges[count].second = row[0];
+                update->merges[count].distance = row[2];
+                update->merges[count++].size = row[3];
+        }
+        if (ferror(f) || !feof(f)) {
+                read_fail("hierarchy");
+                fclose(f);
+                return 0;
+        }
+        fclose(f);
+        update->num_items = count + 1;
+        return 1;
+}
+
+void print_update(const update_t *update, size_t num_items)
+{
+        const ahc_update_t *report = &(update->report);
+        fprintf(stderr, "Inserted %zu of %zu items: %zu clustered again, "
+                "%zu merges repaired, %zu inverted, drift %.6g.\n",
+                report->inserted, num_items, report->reclustered,
+                report->repaired, report->inversions, report->drift);
+}
+
+/*
+ * Clusters the items again with a distance matrix of floats, and reports
+ * on stderr how well the cophenetic distances of the two hierarchies
+ * agree, and the time each took to merge.
+ */
+int compare_precision(ahc_context_t *ctx, const dataset_t *items,
+                      const cluster_t *cluster, const char *format)
+{
+        size_t n = items->num_items;
+        ahc_merge_t *merges = alloc_mem(n, ahc_merge_t);
+        ahc_stats_t stats;
+        if (!merges) {
+                alloc_fail("merges at full precision");
+                return 0;
+        }
+        ahc_set_matrix_format(ctx, "float");
+        int ok = ahc_cluster(ctx, items->coords, n, items->num_dims,
+                             items->stride, merges);
+        ahc_set_matrix_format(ctx, format);
+        if (ok) {
+                ahc_get_stats(ctx, &stats);
+                fprintf(stderr, "Cophenetic correlation with a float "
+                        "matrix: %.6f (merged in %.3f s, against %.3f s)\n",
+                        ahc_cophenetic_correlation(cluster->merges, merges,
+                                                   n),
+                        cluster->stats.merge.wall, stats.merge.wall);
+        }
+        free(merges);
+        return ok;
+}
+
+/*
+ * Clusters the items of the input file, or inserts them into a given
+ * hierarchy, and prints the result. Snapshots are printed as they are.
+ */
+int cluster_input(ahc_context_t *ctx, char **argv, const options_t *options)
+{
+        int status = 0;
+        char linkage = argv[2][0];
+        distance_matrix_t *distances = NULL;
+        cluster_t *cluster = NULL;
+        ahc_timing_t input = { 0.0, 0.0 }, output = { 0.0, 0.0 };
+        update_t update = { NULL, 0, options->tolerance };
+        ahc_set_linkage(ctx, linkage);
+        start_timing(&input);
+        dataset_t *items = options->hierarchy_file &&
+                !read_hierarchy(options->hierarchy_file, &update) ? NULL :
+                process_input(ctx, argv[0], &distances, &cluster);
+        stop_timing(&input);
+        if (!items && !cluster) {
+                status = 1;
+                goto done;
+        }
+        if ((distances || cluster) && options->hierarchy_file) {
+                fprintf(stderr, "Only items with coordinates can be "
+                        "inserted into a hierarchy.\n");
+                status = 1;
+                goto done;
+        }
+        if ((distances || cluster || options->hierarchy_file) &&
+            options->num_neighbours) {
+                fprintf(stderr, "Only items with coordinates can be "
+                        "clustered along a graph.\n");
+                status = 1;
+                goto done;
+        }
+        if ((distances || cluster) && options->compare_precision) {
+                fprintf(stderr, "Only items with coordinates can be "
+                        "compared with a float matrix.\n");
+                status = 1;
+                goto done;
+        }
+        if (cluster && cluster->linkage != linkage) {
+                fprintf(stderr, "The snapshot was clustered with linkage "
+                        "'%c'.\n", cluster->linkage);
+                status = 1;
+                goto done;
+        }
+        if (items && items->num_items) {
+                cluster = agglomerate(ctx, items, distances,
+                                      options->hierarchy_file ? &update :
+                                      NULL, options->num_neighbours);
+                if (!cluster) {
+                        status = 1;
+                        goto done;
+                }
+                cluster->linkage = linkage;
+                if (options->hierarchy_file)
+                        print_update(&update, items->num_items);
+                if (options->compare_precision &&
+                    !compare_precision(ctx, items, cluster,
+                                       options->matrix_format)) {
+                        status = 1;
+                        goto done;
+                }
+        }
+        if (cluster) {
+                start_timing(&output);
+                status = !print_output(cluster, atoi(argv[1]), options);
+                fflush(stdout);
+                if (options->snapshot_file &&
+                    !write_snapshot(cluster, options->snapshot_file))
+                        status = 1;
+                stop_timing(&output);
+                if (options->report_memory)
+                        print_memory_usage(cluster);
+                if (options->stats_file &&
+                    !write_stats(ctx, cluster, linkage, &input, &output,
+                                 options->stats_file))
+                        status = 1;
+        }
+done:
+        free_cluster(cluster);
+        if (distances)
+                free_distance_matrix(distances);
+        free_dataset(items);
+        free(update.merges);
+        return status;
+}
+
+/* takes the first job of a range, or the last if stealing, or -1 */
+long take_job(uint64_t *jobs, int steal)
+{
+        uint64_t range = __atomic_load_n(jobs, __ATOMIC_RELAXED);
+        for (;;) {
+                uint32_t first = range >> 32, end = (uint32_t) range;
+                if (first >= end)
+                        return -1;
+                uint64_t rest = steal ? range - 1 :
+                        range + ((uint64_t) 1 << 32);
+                if (__atomic_compare_exchange_n(jobs, &range, rest, 0,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                        return steal ? end - 1 : first;
+        }
+}
+
+/*
+ * Clusters one input of the batch, and writes its lines to stdout in a
+ * single block, so that those of other jobs do not come between them.
+ */
+int run_job(batch_t *batch, batch_worker_t *worker, const char *fname)
+{
+        const options_t *options = batch->options;
+        distance_matrix_t *distances;
+        cluster_t *snapshot;
+        ahc_timing_t search;
+        double row[4];
+        int ok = 0;
+        dataset_t *items = process_input(worker->ctx, fname, &distances,
+                                         &snapshot);
+        if (snapshot || (distances && options->num_neighbours)) {
+                fprintf(stderr, "Only items with coordinates can be "
+                        "clustered in a batch: %s.\n", fname);
+                goto done;
+        }
+        if (!items) {
+                fprintf(stderr, "Failed to read %s.\n", fname);
+                goto done;
+        }
+        size_t n = items->num_items;
+        ahc_merge_t *merges = arena_mem(&worker->work, n, ahc_merge_t);
+        int *labels = arena_mem(&worker->work, n, int);
+        if (n > INT_MAX / 2 || !merges || !labels) {
+                alloc_fail("batch job");
+                goto done;
+        }
+        if (n && !(options->num_neighbours ?
+                   cluster_graph(worker->ctx, &worker->work, items,
+                                 options->num_neighbours, merges, &search) :
+                   distances ?
+                   ahc_cluster_matrix(worker->ctx, distances->data, n,
+                                      distances->square, merges) :
+                   ahc_cluster(worker->ctx, items->coords, n,
+                               items->num_dims, items->stride, merges))) {
+                fprintf(stderr, "Failed to cluster %s.\n", fname);
+                goto done;
+        }
+        rewind(worker->out);
+        if (!strcmp(options->format, "csv"))
+                for (size_t i = 0; i + 1 < n; ++i) {
+                        linkage_row(&merges[i], row);
+                        fprintf(worker->out, "%s,%d,%d,%.9g,%d\n", fname,
+                                (int) row[0], (int) row[1], row[2],
+                                (int) row[3]);
+                }
+        else if (n) {
+                if (!cut_merges(merges, n, batch->k, options, labels))
+                        goto done;
+                for (size_t i = 0; i < n; ++i)
+                        fprintf(worker->out, "%s,%s,%d\n", fname,
+                                item_label(items, i), labels[i]);
+        }
+        off_t length = ftello(worker->out);
+        if (fflush(worker->out) || length < 0) {
+                alloc_fail("batch output");
+                goto done;
+        }
+        ok = fwrite(worker->buffer, 1, length, stdout) == (size_t) length;
+        if (!ok)
+                fprintf(stderr, "Failed to write the clusters of %s.\n",
+                        fname);
+done:
+        free_cluster(snapshot);
+        if (distances)
+                free_distance_matrix(distances);
+        free_dataset(items);
+        return ok;
+}
+
+/* task of each thread of the batch, until no job is left to take */
+void run_batch(void *arg, int thread, int count)
+{
+        batch_t *batch = arg;
+        batch_worker_t *worker = &batch->workers[thread];
+        for (;;) {
+                long job = take_job(&worker->jobs, 0);
+                for (int t = 1; job < 0 && t < batch->num_workers; ++t)
+                        job = take_job(&batch->workers[(thread + t) %
+                                                       batch->num_workers]
+                                       .jobs, 1);
+                if (job < 0)
+                        return;
+                if (run_job(batch, worker, batch->inputs[job]))
+                        __atomic_add_fetch(&batch->done, 1,
+                                           __ATOMIC_RELAXED);
+                if (!reset_arena(&worker->work))
+                        free_arena(&worker->work);
+        }
+}
+
+int add_input(batch_t *batch, size_t *capacity, arena_t *names,
+              const char *dir, const char *name)
+{
+        size_t len = (dir ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+        char *copy = arena_mem(names, len, char);
+        if (batch->num_inputs == *capacity) {
+                size_t size = *capacity ? 2 * *capacity : 64;
+                char **inputs = realloc(batch->inputs,
+                                        size * sizeof(char *));
+                if (!inputs)
+                        copy = NULL;
+                else {
+                        batch->inputs = inputs;
+                        *capacity = size;
+                }
+        }
+        if (!copy) {
+                alloc_fail("input names");
+                return 0;
+        }
+        snprintf(copy, len, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+        batch->inputs[batch->num_inputs++] = copy;
+        return 1;
+}
+
+int compare_names(const void *a, const void *b)
+{
+        return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Lists the inputs of a batch: the regular files in a directory, other
+ * than hidden ones, in sorted order, or the lines of a manifest.
+ */
+int list_inputs(batch_t *batch, arena_t *names, const char *path)
+{
+        size_t capacity = 0, line_size = 0;
+        char *line = NULL;
+        struct stat st;
+        int ok = 1;
+        if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+                DIR *dir = opendir(path);
+                struct dirent *entry;
+                if (!dir) {
+                        fprintf(stderr, "Failed to open directory %s.\n",
+                                path);
+                        return 0;
+                }
+                while (ok && (entry = readdir(dir)))
+                        if (entry->d_name[0] != '.' &&
+                            (ok = add_input(batch, &capacity, names, path,
+                                            entry->d_name)) &&
+                            (stat(batch->inputs[batch->num_inputs - 1],
+                                  &st) || !S_ISREG(st.st_mode)))
+                                --batch->num_inputs;
+                closedir(dir);
+                if (batch->num_inputs)
+                        qsort(batch->inputs, batch->num_inputs,
+                              sizeof(char *), compare_names);
+                return ok;
+        }
+        FILE *manifest = fopen(path, "r");
+        if (!manifest) {
+                fprintf(stderr, "Failed to open manifest %s.\n", path);
+                return 0;
+        }
+        ssize_t len;
+        while (ok && (len = getline(&line, &line_size, manifest)) > 0) {
+                while (len && (line[len - 1] == '\n' ||
+                               line[len - 1] == '\r'))
+                        line[--len] = '\0';
+                if (len)
+                        ok = add_input(batch, &capacity, names, NULL, line);
+        }
+        free(line);
+        fclose(manifest);
+        return ok;
+}
+
+/*
+ * Clusters every input of a manifest or directory on its own, as a job
+ * taken by one thread of the context with a copy of its settings, and
+ * prints the lines of all of them, each led by the name of its input.
+ * Jobs reuse the memory of the last job of their thread.
+ */
+int batch_input(ahc_context_t *ctx, const char *path, char **argv,
+                const options_t *options)
+{
+        batch_t batch = { NULL, 0, atoi(argv[0]), options, NULL, 0, 0 };
+        arena_t names = { NULL };
+        ahc_timing_t timing = { 0.0, 0.0 };
+        int status = 1;
+        if (!ahc_set_linkage(ctx, argv[1][0])) {
+                fprintf(stderr, "Unknown linkage %s.\n", argv[1]);
+                return 1;
+        }
+        start_timing(&timing);
+        if (!list_inputs(&batch, &names, path))
+                goto done;
+        batch.num_workers = ahc_num_threads(ctx);
+        batch.workers = alloc_mem(batch.num_workers, batch_worker_t);
+        if (!batch.workers) {
+                alloc_fail("batch workers");
+                goto done;
+        }
+        for (int t = 0; t < batch.num_workers; ++t) {
+                batch_worker_t *worker = &batch.workers[t];
+                uint64_t first = batch.num_inputs * t / batch.num_workers;
+                uint64_t end = batch.num_inputs * (t + 1) /
+                        batch.num_workers;
+                worker->jobs = first << 32 | end;
+                worker->allocator.alloc = arena_calloc;
+                worker->allocator.free = arena_release;
+                worker->allocator.data = &worker->work;
+                if (!(worker->ctx = ahc_copy_context(ctx)) ||
+                    !(worker->out = open_memstream(&worker->buffer,
+                                                   &worker->size))) {
+                        alloc_fail("batch workers");
+                        goto done;
+                }
+                ahc_set_allocator(worker->ctx, &worker->allocator);
+        }
+        ahc_parallel(ctx, run_batch, &batch, SIZE_MAX);
+        fflush(stdout);
+        stop_timing(&timing);
+        fprintf(stderr, "Clustered %zu of %zu inputs in %.3f s: %.1f jobs "
+                "per second.\n", batch.done, batch.num_inputs, timing.wall,
+                timing.wall > 0.0 ? batch.done / timing.wall : 0.0);
+        status = batch.done < batch.num_inputs;
+done:
+        for (int t = 0; batch.workers && t < batch.num_workers; ++t) {
+                batch_worker_t *worker = &batch.workers[t];
+                ahc_free_context(worker->ctx);
+                if (worker->out)
+                        fclose(worker->out);
+                free(worker->buffer);
+                free_arena(&worker->work);
+        }
+        free(batch.workers);
+        free(batch.inputs);
+        free_arena(&names);
+        return status;
+}
+
+int convert_input(ahc_context_t *ctx, const char *input, const char *output)
+{
+        distance_matrix_t *distances;
+        cluster_t *snapshot;
+        dataset_t *items = process_input(ctx, input, &distances, &snapshot);
+        int ok = items && !distances && write_binary_items(items, output);
+        if (distances || snapshot) {
+                fprintf(stderr, "Only items with coordinates can be "
+                        "written in the binary format.\n");
+                if (distances)
+                        free_distance_matrix(distances);
+                free_cluster(snapshot);
+        }
+        free_dataset(items);
+        return !ok;
+}
+
+/*
+ * Finds the largest cluster above item v whose merges all have a key at
+ * most t: the key of node u is its highest merge distance, or, when
+ * cutting by count, u itself. Keys grow towards the root, so the jump
+ * pointers of a skew-binary tree find it in O(log n) steps: the jump of
+ * a node is its parent, or the jump of the jump of its parent when the
+ * two jumps above the parent span the same depth.
+ */
+int top_ancestor(const served_t *served, int v, double t, int by_count)
+{
+#define key_of(u) (by_count ? (double) (u) : served->key[u])
+        while (served->parent[v] > v && key_of(served->parent[v]) <= t)
+                v = key_of(served->jump[v]) <= t ? served->jump[v] :
+                        served->parent[v];
+#undef key_of
+        return v;
+}
+
+/* FNV-1a */
+size_t hash_label(const char *label)
+{
+        uint64_t h = 14695981039346656037ULL;
+        for (; *label; ++label)
+                h = (h ^ (unsigned char) *label) * 1099511628211ULL;
+        return h;
+}
+
+/* item with the label, or -1; the first of several wins */
+int find_label(const served_t *served, const char *label)
+{
+        size_t slot = hash_label(label) & served->table_mask;
+        for (; served->table[slot]; slot = (slot + 1) & served->table_mask) {
+                int i = served->table[slot] - 1;
+                if (!strcmp(served->cluster->nodes[i].label, label))
+                        return i;
+        }
+        return -1;
+}
+
+void free_served(served_t *served)
+{
+        free_cluster(served->cluster);
+        free(served->parent);
+        free(served->jump);
+        free(served->key);
+        free(served->table);
+        for (int c = 0; c < CUT_CACHE_SIZE; ++c)
+                free(served->cuts[c].response);
+}
+
+/* maps a snapshot, and prepares the arrays that answer its queries */
+int load_served(ahc_context_t *ctx, served_t *served, const char *fname)
+{
+        distance_matrix_t *distances;
+        dataset_t *items = process_input(ctx, fname, &distances,
+                                         &(served->cluster));
+        if (items || distances) {
+                fprintf(stderr, "Only hierarchy snapshots can be served: "
+                        "%s.\n", fname);
+                if (distances)
+                        free_distance_matrix(distances);
+                free_dataset(items);
+                return 0;
+        }
+        if (!served->cluster)
+                return 0;
+        int n = served->cluster->num_items, num_nodes = 2 * n - 1;
+        int *depth = alloc_mem(num_nodes, int);
+        const ahc_merge_t *merges = served->cluster->merges;
+        size_t table_size = 1;
+        while (table_size < 2 * (size_t) n)
+                table_size <<= 1;
+        served->parent = alloc_mem(num_nodes, int);
+        served->jump = alloc_mem(num_nodes, int);
+        served->key = alloc_mem(num_nodes, float);
+        served->table = alloc_mem(table_size, int);
+        served->table_mask = table_size - 1;
+        if (!depth || !served->parent || !served->jump || !served->key ||
+            !served->table) {
+                alloc_fail("served hierarchy");
+                free(depth);
+                return 0;
+        }
+        for (int v = 0; v < n; ++v)
+                served->key[v] = -HUGE_VALF;
+        for (int i = 0; i < n - 1; ++i) {
+                int a = merges[i].first, b = merges[i].second;
+                served->parent[a] = served->parent[b] = n + i;
+                served->key[n + i] = fmaxf(merges[i].distance,
+                                           fmaxf(served->key[a],
+                                                 served->key[b]));
+        }
+        /* parents come after their children, so go down from the root */
+        served->parent[num_nodes - 1] = -1;
+        served->jump[num_nodes - 1] = num_nodes - 1;
+        for (int v = num_nodes - 2; v >= 0; --v) {
+                int p = served->parent[v], j = served->jump[p];
+                depth[v] = depth[p] + 1;
+                served->jump[v] = depth[p] - depth[j] ==
+                        depth[j] - depth[served->jump[j]] ?
+                        served->jump[j] : p;
+        }
+        free(depth);
+        for (int i = 0; i < n; ++i) {
+                const char *label = served->cluster->nodes[i].label;
+                size_t slot = hash_label(label) & served->table_mask;
+                while (served->table[slot])
+                        slot = (slot + 1) & served->table_mask;
+                served->table[slot] = i + 1;
+        }
+        return 1;
+}
+
+/* appends to the responses waiting to be sent to the client */
+int reply(client_t *client, const char *data, size_t length)
+{
+        if (client->out_len + length > client->out_size) {
+                size_t size = 2 * (client->out_len + length);
+                char *out = realloc(client->out, size);
+                if (!out) {
+                        alloc_fail("responses");
+                        return 0;
+                }
+                client->out = out;
+                client->out_size = size;
+        }
+        memcpy(client->out + client->out_len, data, length);
+        client->out_len += length;
+        return 1;
+}
+
+int replyf(client_t *client, const char *format, ...)
+{
+        char line[MAX_REQUEST];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        if (length >= (int) sizeof(line))
+                length = sizeof(line) - 1;
+        return length >= 0 && reply(client, line, length);
+}
+
+/*
+ * Labels of a flat cut, formatted once and kept with the most recent
+ * cuts of the hierarchy, as dashboards ask for the same few cuts.
+ */
+const cut_cache_t *cut_hierarchy(served_t *served, char cut, double value)
+{
+        cut_cache_t *entry = &(served->cuts[0]);
+        options_t options = { .cut = cut, .threshold = value };
+        int n = served->cluster->num_items, count, *labels;
+        ++served->clock;
+        for (int c = 0; c < CUT_CACHE_SIZE; ++c) {
+                cut_cache_t *e = &(served->cuts[c]);
+                if (e->cut == cut && e->value == value) {
+                        e->used = served->clock;
+                        return e;
+                }
+                if (e->used < entry->used)
+                        entry = e;
+        }
+        if (!(labels = alloc_mem(n, int))) {
+                alloc_fail("flat clusters");
+                return NULL;
+        }
+        count = cut_merges(served->cluster->merges, n, value, &options,
+                           labels);
+        free(entry->response);
+        entry->cut = 0;
+        entry->response = NULL;
+        FILE *f = open_memstream(&(entry->response), &(entry->length));
+        if (f && count) {
+                fprintf(f, "ok %d", count);
+                for (int i = 0; i < n; ++i)
+                        fprintf(f, " %d", labels[i]);
+                fputc('\n', f);
+        }
+        free(labels);
+        if (!f || fclose(f) || !count) {
+                if (!f)
+                        alloc_fail("flat clusters");
+                free(entry->response);
+                entry->response = NULL;
+                entry->used = 0;
+                return NULL;
+        }
+        entry->cut = cut;
+        entry->value = value;
+        entry->used = served->clock;
+        return entry;
+}
+
+/* whole clusters to cut into, at most n, or 0 for less than one */
+double cut_count(double value, int n)
+{
+        return value >= 1.0 ? floor(fmin(value, n)) : 0.0;
+}
+
+/* answers one request line of the protocol described in README.md */
+int answer(served_t served[], int num_served, client_t *client, char *line)
+{
+        char command[16], cut;
+        int h, v, length = 0;
+        double value;
+        if (sscanf(line, "%15s %n", command, &length) != 1)
+                return replyf(client, "error empty request\n");
+        line += length;
+        if (strcmp(command, "info") && strcmp(command, "cut") &&
+            strcmp(command, "find") && strcmp(command, "node") &&
+            strcmp(command, "label") && strcmp(command, "members"))
+                return replyf(client, "error unknown command\n");
+        if (!strcmp(command, "info") && !*line)
+                return replyf(client, "ok %d\n", num_served);
+        if (sscanf(line, "%d %n", &h, &length) != 1 || h < 0 ||
+            h >= num_served)
+                return replyf(client, "error unknown hierarchy\n");
+        served_t *s = &served[h];
+        const cluster_t *cluster = s->cluster;
+        int n = cluster->num_items;
+        line += length;
+        if (!strcmp(command, "info"))
+                return replyf(client, "ok %d %d %c\n", n, cluster->num_dims,
+                              cluster->linkage);
+        if (!strcmp(command, "cut")) {
+                if (sscanf(line, "%c %lf %n", &cut, &value, &length) != 2 ||
+                    line[length] || !strchr("kdi", cut))
+                        return replyf(client, "error usage: cut H k|d|i "
+                                      "VALUE\n");
+                if (cut == 'k' && !(value = cut_count(value, n)))
+                        return replyf(client, "error invalid count\n");
+                const cut_cache_t *entry = cut_hierarchy(s, cut, value);
+                return entry ? reply(client, entry->response, entry->length) :
+                        replyf(client, "error cut failed\n");
+        }
+        if (!strcmp(command, "find")) {
+                if (sscanf(line, "%c %lf %n", &cut, &value, &length) != 2 ||
+                    !line[length] || !strchr("kd", cut))
+                        return replyf(client, "error usage: find H k|d "
+                                      "VALUE LABEL\n");
+                if (cut == 'k' && !(value = cut_count(value, n)))
+                        return replyf(client, "error invalid count\n");
+                if ((v = find_label(s, line + length)) < 0)
+                        return replyf(client, "error unknown label\n");
+                /* the first n - k merges leave k clusters */
+                v = cut == 'k' ? top_ancestor(s, v, 2.0 * n - value - 1, 1) :
+                        top_ancestor(s, v, value, 0);
+                return replyf(client, "ok %d %d %.9g\n", v,
+                              cluster->nodes[v].num_items,
+                              v < n ? 0.0 : cluster->nodes[v].distance);
+        }
+        if (sscanf(line, "%d %n", &v, &length) != 1 || line[length] ||
+            v < 0 || v >= cluster->num_nodes)
+                return replyf(client, "error unknown node\n");
+        const cluster_node_t *node = &(cluster->nodes[v]);
+        if (!strcmp(command, "node"))
+                return v < n ?
+                        replyf(client, "ok %d -1 -1 1 0\n", s->parent[v]) :
+                        replyf(client, "ok %d %d %d %d %.9g\n", s->parent[v],
+                               node->merged[0], node->merged[1],
+                               node->num_items, node->distance);
+        if (!strcmp(command, "label"))
+                return v < n ? replyf(client, "ok %s\n", node->label) :
+                        replyf(client, "error not an item\n");
+        int ok = replyf(client, "ok %d", node->num_items);
+        for (int i = 0, item = node->first_item; ok && i < node->num_items;
+             ++i, item = cluster->next_item[item])
+                ok = replyf(client, " %d", item);
+        return ok && reply(client, "\n", 1);
+}
+
+/* sends what the socket takes of the responses to the client */
+void send_replies(client_t *client)
+{
+        while (client->out_sent < client->out_len) {
+                ssize_t sent = send(client->fd,
+                                    client->out + client->out_sent,
+                                    client->out_len - client->out_sent,
+                                    MSG_NOSIGNAL);
+                if (sent < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                client->closing = 1;
+                        if (client->closing)
+                                client->out_len = client->out_sent = 0;
+                        return;
+                }
+                client->out_sent += sent;
+        }
+        client->out_len = client->out_sent = 0;
+}
+
+/*
+ * Answers every whole request line received from the client, in order,
+ * so that clients may send many requests before reading the responses.
+ */
+void receive_requests(served_t served[], int num_served, client_t *client)
+{
+        ssize_t received = recv(client->fd, client->in + client->in_len,
+                                MAX_REQUEST - client->in_len, 0);
+        if (received <= 0) {
+                if (!received || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                  errno != EINTR))
+                        client->closing = 1;
+                return;
+        }
+        client->in_len += received;
+        char *line = client->in, *end;
+        while ((end = memchr(line, '\n', client->in + client->in_len -
+                             line))) {
+                *end = '\0';
+                if (end > line && end[-1] == '\r')
+                        end[-1] = '\0';
+                if (!answer(served, num_served, client, line))
+                        client->closing = 1;
+                line = end + 1;
+        }
+        client->in_len -= line - client->in;
+        memmove(client->in, line, client->in_len);
+        if (client->in_len == MAX_REQUEST) {
+                replyf(client, "error request too long\n");
+                client->closing = 1;
+        }
+}
+
+void close_client(client_t *client)
+{
+        close(client->fd);
+        free(client->out);
+        memset(client, 0, sizeof(*client));
+        client->fd = -1;
+}
+
+volatile sig_atomic_t stop_serving = 0;
+
+void request_stop(int signal)
+{
+        stop_serving = 1;
+}
+
+/* listens on a new socket at the path, replacing a stale one */
+int listen_socket(const char *path)
+{
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        struct stat st;
+        int fd;
+        if (strlen(path) >= sizeof(address.sun_path)) {
+                fprintf(stderr, "Socket path %s is too long.\n", path);
+                return -1;
+        }
+        strcpy(address.sun_path, path);
+        if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+                unlink(path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+            bind(fd, (struct sockaddr *) &address, sizeof(address)) ||
+            listen(fd, MAX_CLIENTS)) {
+                fprintf(stderr, "Failed to listen on socket %s: %s.\n",
+                        path, strerror(errno));
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+/*
+ * Serves queries about the snapshots on a Unix domain socket until
+ * interrupted. One thread polls the socket and every client, so the
+ * queries of one client are answered in order, and a slow client
+ * holds up no other.
+ */
+int serve(ahc_context_t *ctx, const char *path, char **files, int count)
+{
+        served_t *served = alloc_mem(count, served_t);
+        client_t *clients = alloc_mem(MAX_CLIENTS, client_t);
+        struct pollfd fds[MAX_CLIENTS + 1];
+        struct sigaction stop = { .sa_handler = request_stop };
+        int fd = -1, status = 1;
+        if (!served || !clients) {
+                alloc_fail("server");
+                goto done;
+        }
+        for (int h = 0; h < count; ++h)
+                if (!load_served(ctx, &served[h], files[h]))
+                        goto done;
+        for (int c = 0; c < MAX_CLIENTS; ++c)
+                clients[c].fd = -1;
+        if ((fd = listen_socket(path)) < 0)
+                goto done;
+        sigaction(SIGINT, &stop, NULL);
+        sigaction(SIGTERM, &stop, NULL);
+        status = 0;
+        while (!stop_serving) {
+                int num_clients = 0;
+                for (int c = 0; c < MAX_CLIENTS; ++c) {
+                        num_clients += clients[c].fd >= 0;
+                        fds[c + 1].fd = clients[c].fd;
+                        fds[c + 1].events = clients[c].out_len ? POLLOUT :
+                                POLLIN;
+                }
+                /* leave new connections waiting while all slots are taken */
+                fds[0].fd = num_clients < MAX_CLIENTS ? fd : -1;
+                fds[0].events = POLLIN;
+                if (poll(fds, MAX_CLIENTS + 1, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("poll");
+                        status = 1;
+                        break;
+                }
+                for (int c = 0; fds[0].revents & POLLIN && c < MAX_CLIENTS;
+                     ++c)
+                        if (clients[c].fd < 0) {
+                                clients[c].fd = accept4(fd, NULL, NULL,
+                                                        SOCK_NONBLOCK);
+                                break;
+                        }
+                for (int c = 0; c < MAX_CLIENTS; ++c) {
+                        client_t *client = &clients[c];
+                        short events = fds[c + 1].revents;
+                        if (client->fd < 0 || fds[c + 1].fd < 0)
+                                continue;
+                        if (events & (POLLIN | POLLHUP | POLLERR))
+                                receive_requests(served, count, client);
+                        send_replies(client);
+                        if (client->closing && !client->out_len)
+                                close_client(client);
+                }
+        }
+done:
+        if (fd >= 0) {
+                close(fd);
+                unlink(path);
+        }
+        for (int c = 0; clients && c < MAX_CLIENTS; ++c)
+                if (clients[c].fd >= 0)
+                        close_client(&clients[c]);
+        for (int h = 0; served && h < count; ++h)
+                free_served(&served[h]);
+        free(clients);
+        free(served);
+        return status;
+}
+
+int main(int argc, char **argv)
+{
+        int opt, status, use_huge_pages = 0, use_kd_tree = 0;
+        int num_threads = 1;
+        options_t options = {
+                "tree", 'k', 0.0, 0, NULL, 0, NULL, NULL, 0.0, "float", 0, 0
+        };
+        float minkowski_p = 2.0;
+        const char *metric_name = "euclidean", *binary_file = NULL;
+        const char *scratch_dir = NULL, *socket_path = NULL;
+        const char *batch = NULL;
+        while ((opt = getopt(argc, argv,
+                             "b:B:Cd:g:Hi:j:kl:m:Mo:p:q:r:s:S:T:u:w:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        options.budget = (size_t) atol(optarg) << 20;
+                        if (!options.budget)
+                                usage(argv[0]);
+                        break;
+                case 'B':
+                        batch = optarg;
+                        break;
+                case 'C':
+                        options.compare_precision = 1;
+                        break;
+                case 'd':
+                case 'i':
+                        options.cut = opt;
+                        options.threshold = atof(optarg);
+                        break;
+                case 'g':
+                        options.num_neighbours = atoi(optarg);
+                        if (options.num_neighbours < 1)
+                                usage(argv[0]);
+                        break;
+                case 'H':
+                        use_huge_pages = 1;
+                        break;
+                case 'k':
+                        use_kd_tree = 1;
+                        break;
+                case 'l':
+                        socket_path = optarg;
+                        break;
+                case 'M':
+                        options.report_memory = 1;
+                        break;
+                case 'o':
+                        options.format = optarg;
+                        if (strcmp(optarg, "tree") && strcmp(optarg, "csv") &&
+                            strcmp(optarg, "binary") &&
+                            strcmp(optarg, "labels"))
+                                usage(argv[0]);
+                        break;
+                case 'j':
+                        num_threads = atoi(optarg);
+                        break;
+                case 'm':
+                        metric_name = optarg;
+                        break;
+                case 'p':
+                        minkowski_p = atof(optarg);
+                        if (minkowski_p <= 0.0)
+                                usage(argv[0]);
+                        break;
+                case 'q':
+                        options.matrix_format = optarg;
+                        break;
+                case 'r':
+                        options.tolerance = atof(optarg);
+                        if (!(options.tolerance >= 0.0))
+                                usage(argv[0]);
+                        break;
+                case 's':
+                        options.stats_file = optarg;
+                        break;
+                case 'S':
+                        options.snapshot_file = optarg;
+                        break;
+                case 'T':
+                        scratch_dir = optarg;
+                        break;
+                case 'u':
+                        options.hierarchy_file = optarg;
+                        break;
+                case 'w':
+                        binary_file = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (socket_path ? optind == argc :
+            argc - optind != (binary_file ? 1 : batch ? 2 : 3))
+                usage(argv[0]);
+        if (batch && (socket_path || binary_file || options.budget ||
+                      options.compare_precision || options.report_memory ||
+                      options.stats_file || options.snapshot_file ||
+                      options.hierarchy_file ||
+                      !strcmp(options.format, "binary")))
+                usage(argv[0]);
+        ahc_context_t *ctx = ahc_create_context();
+        if (!ctx)
+                return 1;
+        if (!ahc_set_metric(ctx, metric_name, minkowski_p)) {
+                ahc_free_context(ctx);
+                usage(argv[0]);
+        }
+        if (!ahc_set_matrix_format(ctx, options.matrix_format)) {
+                ahc_free_context(ctx);
+                usage(argv[0]);
+        }
+        ahc_set_huge_pages(ctx, use_huge_pages);
+        ahc_set_spatial_index(ctx, use_kd_tree);
+        if (!ahc_set_scratch_dir(ctx, scratch_dir)) {
+                ahc_free_context(ctx);
+                return 1;
+        }
+        ahc_set_threads(ctx, num_threads);
+        argv += optind;
+        status = batch ? batch_input(ctx, batch, argv, &options) :
+                socket_path ? serve(ctx, socket_path, argv, argc - optind) :
+                binary_file ? convert_input(ctx, argv[0], binary_file) :
+                options.budget ? summarise_input(ctx, argv, &options) :
+                cluster_input(ctx, argv, &options);
+        ahc_free_context(ctx);
+        return status;
 }
@@ -0,0 +1,4625 @@
+/**
+ * Copyright 2014 Gagarine Yaikhom (MIT License)
+ *
+ * Implements Agglomerative Hierarchical Clustering algorithm.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define X86_KERNELS /* build SSE, AVX2 and AVX-512 distance kernels */
+#endif
+
+#define HUGE_PAGE_SIZE (2 << 20)
+#define VECTOR_WIDTH AHC_VECTOR_WIDTH
+#define VECTOR_ALIGN AHC_VECTOR_ALIGN
+#define MAX_THREADS AHC_MAX_THREADS
+#define KD_MAX_DIMS AHC_SPATIAL_MAX_DIMS
+#define PARALLEL_MIN_WORK 16384 /* smaller loops are not worth splitting */
+#define ROW_BLOCK 16 /* distance matrix rows filled per task */
+#define TILE_SIDE 32 /* rows and columns of a scratch matrix tile */
+#define COLUMN_BLOCK_BYTES (64 << 10) /* coordinates kept in cache */
+#define CF_CAPACITY 16 /* entries in each node of a summary tree */
+#define KD_LEAF_SIZE 8 /* slots in each leaf of a k-d tree */
+
+#define alloc_mem(N, T) (T *) calloc(N, sizeof(T))
+#define alloc_fail(M) fprintf(stderr,                                   \
+                              "Failed to allocate memory for %s.\n", M)
+
+/* working memory, from the allocator of the context */
+#define alloc_work(ctx, N, T) (T *) work_alloc(ctx, N, sizeof(T))
+#define free_work(ctx, P) (ctx)->allocator.free(P, (ctx)->allocator.data)
+
+typedef struct points_s points_t;
+typedef struct distance_matrix_s distance_matrix_t;
+typedef struct merge_s merge_t;
+typedef struct heap_s heap_t;
+typedef struct metric_s metric_t;
+typedef struct thread_pool_s thread_pool_t;
+typedef struct active_rows_s active_rows_t;
+typedef struct cf_node_s cf_node_t;
+typedef struct kd_node_s kd_node_t;
+typedef struct kd_tree_s kd_tree_t;
+typedef struct matrix_format_s matrix_format_t;
+
+typedef void (*kernel_t)(const float *x, const float *y, int count,
+                         int stride, float p, float *out);
+
+struct ahc_context_s {
+        /* task that applies the Lance-Williams update of the linkage */
+        void (*update_distances)(void *arg, int thread, int count);
+        const metric_t *metric; /* metric of distances between items */
+        float minkowski_p; /* power of the minkowski metric */
+        int squared_distances; /* matrix holds squared euclidean distances */
+        int reducible_linkage; /* linkage can use nearest-neighbour chains */
+        int use_huge_pages; /* back the distance matrix with huge pages */
+        int spatial_index; /* cluster few coordinates by a k-d tree */
+        char *scratch_dir; /* where distance matrices are kept, or NULL */
+        int matrix_format; /* entries of matrices computed from points */
+        int kernel_level; /* best kernels the processor supports */
+        /* partial distances from point x to count points at y */
+        kernel_t distance_kernel;
+        double kernel_bound; /* largest output of the kernel */
+        void (*finish_distances)(float *d, int count, float p);
+        ahc_allocator_t allocator; /* working memory */
+        thread_pool_t *thread_pool; /* workers, if there is more than one */
+        ahc_stats_t stats; /* of the last clustering */
+        const int *weights; /* items in each point clustered, or NULL */
+};
+
+/* coordinates of the points that distances are computed between */
+struct points_s {
+        int num_items; /* number of points */
+        int num_dims; /* number of coordinates of each point */
+        int stride; /* floats between consecutive points */
+        const float *coords; /* row-major block, padded with zeros */
+};
+
+struct distance_matrix_s {
+        int n; /* number of rows in the square matrix being represented */
+        int square; /* true if data holds all n * n entries, row by row */
+        void *data; /* condensed upper triangle, n(n - 1) / 2 entries */
+        int format; /* of the entries, FLOAT_ENTRIES unless reduced */
+        float *scale; /* of the entries of each row, if reduced */
+        void *mapping; /* mmap()ed region holding data, if any */
+        size_t size; /* number of bytes allocated or mapped */
+        int tiled; /* entries are grouped in tiles, as in scratch files */
+        int num_tiles; /* tiles in each row of tiles */
+        float *tile_min; /* no active entry of a tile is smaller */
+        const int *items; /* item of each row, if reordered, or NULL */
+};
+
+/*
+ * Entries of reduced precision hold distances divided by the scale of
+ * their row, which is chosen when the row is filled or merged so that
+ * its largest distance is stored as fit.
+ */
+struct matrix_format_s {
+        const char *name; /* name used to choose the format */
+        int size; /* bytes per entry */
+        float fit; /* largest entry of a row, once scaled */
+        float top; /* largest entry that can be stored */
+};
+
+struct merge_s {
+        int first, second; /* leaves inside the clusters to merge */
+        float distance; /* distance between the clusters */
+};
+
+struct metric_s {
+        const char *name; /* name used to choose the metric */
+        kernel_t kernels[4]; /* scalar, SSE, AVX2 and AVX-512 kernels */
+        /* kernel output to distances */
+        void (*finish)(float *d, int count, float p);
+        int centre; /* points are centred on their mean coordinate */
+        int normalise; /* points are scaled to unit length */
+};
+
+struct heap_s {
+        int size; /* number of rows in the heap */
+        int *rows; /* rows of the distance matrix in heap order */
+        int *pos; /* position of each row inside the heap, or -1 */
+        float *key; /* distance from each row to its nearest neighbour */
+};
+
+/* workers wait for tasks, which are run by all threads together */
+struct thread_pool_s {
+        int num_threads; /* workers, plus the thread that runs tasks */
+        pthread_t *threads; /* the workers */
+        pthread_mutex_t lock; /* guards sleeping on wake */
+        pthread_cond_t wake; /* signalled when a task is posted */
+        void (*task)(void *, int, int); /* task to run: arg, thread, count */
+        void *arg; /* argument passed to the task */
+        unsigned generation; /* incremented for each task posted */
+        int pending; /* workers still running the task */
+        int quit; /* set when workers should exit */
+};
+
+struct active_rows_s {
+        ahc_context_t *ctx; /* context of the clustering */
+        distance_matrix_t *matrix; /* distances between clusters */
+        int *rows; /* matrix rows of the active clusters, sorted */
+        int count; /* number of active clusters */
+        int *size; /* number of leaves in the cluster of each row */
+        int row, other, from; /* arguments to the parallel steps */
+        float dab; /* distance between the clusters being merged */
+        float *merged; /* distances from a merged row, if reduced */
+        float *best; /* per thread nearest distance found */
+        int *best_row; /* per thread nearest row found */
+};
+
+static void *work_alloc(ahc_context_t *ctx, size_t count, size_t size)
+{
+        ctx->stats.allocations++;
+        ctx->stats.allocated_bytes += count * size;
+        return ctx->allocator.alloc(count, size, ctx->allocator.data);
+}
+
+static double seconds(clockid_t clock)
+{
+        struct timespec t;
+        clock_gettime(clock, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* the time between start_timing() and stop_timing() adds to the timing */
+static void start_timing(ahc_timing_t *timing)
+{
+        timing->wall -= seconds(CLOCK_MONOTONIC);
+        timing->cpu -= seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void stop_timing(ahc_timing_t *timing)
+{
+        timing->wall += seconds(CLOCK_MONOTONIC);
+        timing->cpu += seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+#define point_coord(points, i)                                          \
+        (&(points)->coords[(size_t) (i) * (points)->stride])
+
+static float *alloc_coords(size_t count, int stride)
+{
+        void *mem;
+        size_t size = (count ? count : 1) * (stride ? stride : 1) *
+                sizeof(float);
+        if (posix_memalign(&mem, VECTOR_ALIGN, size))
+                return NULL;
+        memset(mem, 0, size); /* padding must stay zero for the kernels */
+        return mem;
+}
+/*
+ * Each metric is split into a kernel, which accumulates a partial
+ * distance over the coordinates of a point, and a finishing step, such
+ * as a square root, that is applied to a whole row of kernel output. The
+ * kernels are generated from the accumulation step of their metric, so
+ * that the step is inlined into the innermost loop. Padding coordinates
+ * are zero, and leave every accumulation unchanged. Kernels are passed
+ * the power p of the minkowski metric, which the others ignore.
+ */
+#define sqeuclidean_step(acc, a, b) ((acc) + ((a) - (b)) * ((a) - (b)))
+#define manhattan_step(acc, a, b) ((acc) + fabsf((a) - (b)))
+#define chebyshev_step(acc, a, b)                                       \
+        ((acc) > fabsf((a) - (b)) ? (acc) : fabsf((a) - (b)))
+#define dot_step(acc, a, b) ((acc) + (a) * (b))
+#define minkowski_step(acc, a, b)                                       \
+        ((acc) + powf(fabsf((a) - (b)), p))
+
+#define define_scalar_kernel(name)                                      \
+        static void name##_scalar(const float *x, const float *y,      \
+                                  int count, int stride, float p,       \
+                                  float *out)                           \
+        {                                                               \
+                for (int j = 0; j < count; ++j, y += stride) {          \
+                        float acc = 0.0;                                \
+                        for (int k = 0; k < stride; ++k)                \
+                                acc = name##_step(acc, x[k], y[k]);     \
+                        out[j] = acc;                                   \
+                }                                                       \
+        }
+
+define_scalar_kernel(sqeuclidean)
+define_scalar_kernel(manhattan)
+define_scalar_kernel(chebyshev)
+define_scalar_kernel(dot)
+define_scalar_kernel(minkowski)
+
+#undef define_scalar_kernel
+
+#ifdef X86_KERNELS
+
+#define sqeuclidean_sse_step(acc, v, w)                                 \
+        _mm_add_ps(acc, _mm_mul_ps(_mm_sub_ps(v, w), _mm_sub_ps(v, w)))
+#define manhattan_sse_step(acc, v, w)                                   \
+        _mm_add_ps(acc, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(v, w)))
+#define chebyshev_sse_step(acc, v, w)                                   \
+        _mm_max_ps(acc, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(v, w)))
+#define dot_sse_step(acc, v, w) _mm_add_ps(acc, _mm_mul_ps(v, w))
+
+#define sqeuclidean_avx2_step(acc, v, w)                                \
+        _mm256_fmadd_ps(_mm256_sub_ps(v, w), _mm256_sub_ps(v, w), acc)
+#define manhattan_avx2_step(acc, v, w)                                  \
+        _mm256_add_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.0f),      \
+                                            _mm256_sub_ps(v, w)))
+#define chebyshev_avx2_step(acc, v, w)                                  \
+        _mm256_max_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.0f),      \
+                                            _mm256_sub_ps(v, w)))
+#define dot_avx2_step(acc, v, w) _mm256_fmadd_ps(v, w, acc)
+
+#define sqeuclidean_avx512_step(acc, v, w)                              \
+        _mm512_fmadd_ps(_mm512_sub_ps(v, w), _mm512_sub_ps(v, w), acc)
+#define manhattan_avx512_step(acc, v, w)                                \
+        _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(v, w)))
+#define chebyshev_avx512_step(acc, v, w)                                \
+        _mm512_max_ps(acc, _mm512_abs_ps(_mm512_sub_ps(v, w)))
+#define dot_avx512_step(acc, v, w) _mm512_fmadd_ps(v, w, acc)
+
+/*
+ * The vector kernels compute a tile of four points at a time, keeping
+ * one accumulator per point, which are combined with the given add or
+ * max operation at the end. Strides are multiples of VECTOR_WIDTH, and
+ * the padding is zero, so only whole vectors are ever loaded.
+ */
+#define define_sse_kernel(name, combine)                                \
+        __attribute__((target("sse2")))                                 \
+        static void name##_sse(const float *x, const float *y,         \
+                               int count, int stride, float p,          \
+                               float *out)                              \
+        {                                                               \
+                int j = 0;                                              \
+                for (; j + 4 <= count; j += 4, y += 4 * stride) {       \
+                        __m128 a[4];                                    \
+                        for (int r = 0; r < 4; ++r)                     \
+                                a[r] = _mm_setzero_ps();                \
+                        for (int k = 0; k < stride; k += 4) {           \
+                                __m128 v = _mm_loadu_ps(x + k);         \
+                                for (int r = 0; r < 4; ++r) {           \
+                                        __m128 w = _mm_loadu_ps(y +     \
+                                                r * stride + k);        \
+                                        a[r] = name##_sse_step(         \
+                                                a[r], v, w);            \
+                                }                                       \
+                        }                                               \
+                        _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);      \
+                        _mm_storeu_ps(out + j,                          \
+                                      combine(combine(a[0], a[1]),      \
+                                              combine(a[2], a[3])));    \
+                }                                                       \
+                name##_scalar(x, y, count - j, stride, p, out + j);     \
+        }
+
+/* strides may end in half a vector, which is loaded masked */
+#define define_avx2_kernel(name, combine)                               \
+        __attribute__((target("avx2,fma")))                             \
+        static void name##_avx2(const float *x, const float *y,        \
+                                int count, int stride, float p,         \
+                                float *out)                             \
+        {                                                               \
+                int tail = stride % 8;                                  \
+                __m256i mask = _mm256_setr_epi32(-1, -1, -1, -1,        \
+                                                 0, 0, 0, 0);           \
+                int j = 0;                                              \
+                for (; j + 4 <= count; j += 4, y += 4 * stride) {       \
+                        __m256 a[4];                                    \
+                        for (int r = 0; r < 4; ++r)                     \
+                                a[r] = _mm256_setzero_ps();             \
+                        int k = 0;                                      \
+                        for (; k + 8 <= stride; k += 8) {               \
+                                __m256 v = _mm256_loadu_ps(x + k);      \
+                                for (int r = 0; r < 4; ++r) {           \
+                                        __m256 w = _mm256_loadu_ps(y +  \
+                                                r * stride + k);        \
+                                        a[r] = name##_avx2_step(        \
+                                                a[r], v, w);            \
+                                }                                       \
+                        }                                               \
+                        if (tail) {                                     \
+                                __m256 v = _mm256_maskload_ps(x + k,    \
+                                                              mask);    \
+                                for (int r = 0; r < 4; ++r) {           \
+                                        __m256 w = _mm256_maskload_ps(  \
+                                                y + r * stride + k,     \
+                                                mask);                  \
+                                        a[r] = name##_avx2_step(        \
+                                                a[r], v, w);            \
+                                }                                       \
+                        }                                               \
+                        __m128 s[4];                                    \
+                        for (int r = 0; r < 4; ++r)                     \
+                                s[r] = combine(                         \
+                                        _mm256_castps256_ps128(a[r]),   \
+                                        _mm256_extractf128_ps(a[r], 1)); \
+                        _MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);      \
+                        _mm_storeu_ps(out + j,                          \
+                                      combine(combine(s[0], s[1]),      \
+                                              combine(s[2], s[3])));    \
+                }                                                       \
+                name##_scalar(x, y, count - j, stride, p, out + j);     \
+        }
+
+#define define_avx512_kernel(name, reduce)                              \
+        __attribute__((target("avx512f")))                              \
+        static void name##_avx512(const float *x, const float *y,      \
+                                  int count, int stride, float p,       \
+                                  float *out)                           \
+        {                                                               \
+                __mmask16 mask = (1 << (stride % 16)) - 1;              \
+                int j = 0;                                              \
+                for (; j + 4 <= count; j += 4, y += 4 * stride) {       \
+                        __m512 a[4];                                    \
+                        for (int r = 0; r < 4; ++r)                     \
+                                a[r] = _mm512_setzero_ps();             \
+                        int k = 0;                                      \
+                        for (; k + 16 <= stride; k += 16) {             \
+                                __m512 v = _mm512_loadu_ps(x + k);      \
+                                for (int r = 0; r < 4; ++r) {           \
+                                        __m512 w = _mm512_loadu_ps(y +  \
+                                                r * stride + k);        \
+                                        a[r] = name##_avx512_step(      \
+                                                a[r], v, w);            \
+                                }                                       \
+                        }                                               \
+                        if (mask) {                                     \
+                                __m512 v = _mm512_maskz_loadu_ps(mask,  \
+                                                                 x + k); \
+                                for (int r = 0; r < 4; ++r) {           \
+                                        __m512 w = _mm512_maskz_loadu_ps( \
+                                                mask,                   \
+                                                y + r * stride + k);    \
+                                        a[r] = name##_avx512_step(      \
+                                                a[r], v, w);            \
+                                }                                       \
+                        }                                               \
+                        for (int r = 0; r < 4; ++r)                     \
+                                out[j + r] = reduce(a[r]);              \
+                }                                                       \
+                name##_scalar(x, y, count - j, stride, p, out + j);     \
+        }
+
+#define define_vector_kernels(name, combine, reduce)                    \
+        define_sse_kernel(name, combine)                                \
+        define_avx2_kernel(name, combine)                               \
+        define_avx512_kernel(name, reduce)
+
+define_vector_kernels(sqeuclidean, _mm_add_ps, _mm512_reduce_add_ps)
+define_vector_kernels(manhattan, _mm_add_ps, _mm512_reduce_add_ps)
+define_vector_kernels(chebyshev, _mm_max_ps, _mm512_reduce_max_ps)
+define_vector_kernels(dot, _mm_add_ps, _mm512_reduce_add_ps)
+
+#undef define_vector_kernels
+#undef define_avx512_kernel
+#undef define_avx2_kernel
+#undef define_sse_kernel
+
+#define metric_kernels(name)                                            \
+        { name##_scalar, name##_sse, name##_avx2, name##_avx512 }
+#else
+#define metric_kernels(name) { name##_scalar }
+#endif
+
+static void finish_euclidean(float *d, int count, float p)
+{
+        for (int j = 0; j < count; ++j)
+                d[j] = sqrtf(d[j]);
+}
+
+/* points have unit length, so the kernel gives the cosine of the angle */
+static void finish_cosine(float *d, int count, float p)
+{
+        for (int j = 0; j < count; ++j)
+                d[j] = d[j] < 1.0 ? 1.0 - d[j] : 0.0;
+}
+
+static void finish_minkowski(float *d, int count, float p)
+{
+        float power = 1.0 / p;
+        for (int j = 0; j < count; ++j)
+                d[j] = powf(d[j], power);
+}
+
+/* euclidean, the default, comes first */
+static const metric_t metrics[] = {
+        { "euclidean", metric_kernels(sqeuclidean), finish_euclidean, 0, 0 },
+        { "sqeuclidean", metric_kernels(sqeuclidean), NULL, 0, 0 },
+        { "manhattan", metric_kernels(manhattan), NULL, 0, 0 },
+        { "chebyshev", metric_kernels(chebyshev), NULL, 0, 0 },
+        { "cosine", metric_kernels(dot), finish_cosine, 0, 1 },
+        { "correlation", metric_kernels(dot), finish_cosine, 1, 1 },
+        { "minkowski", { minkowski_scalar }, finish_minkowski, 0, 0 },
+        { NULL }
+};
+
+#undef metric_kernels
+
+static int cpu_kernel_level(void)
+{
+        int level = 0;
+#ifdef X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+                level = 3;
+        else if (__builtin_cpu_supports("avx2") &&
+                 __builtin_cpu_supports("fma"))
+                level = 2;
+        else if (__builtin_cpu_supports("sse2"))
+                level = 1;
+#endif
+        return level;
+}
+
+/* adds the difference d of a coordinate to the kernel output acc */
+static inline double accumulate(const ahc_context_t *ctx, double acc,
+                                double d)
+{
+        const metric_t *metric = ctx->metric;
+        if (metric == &metrics[2]) /* manhattan */
+                return acc + d;
+        if (metric == &metrics[3]) /* chebyshev */
+                return fmax(acc, d);
+        if (metric == &metrics[6]) /* minkowski */
+                return acc + pow(d, ctx->minkowski_p);
+        return acc + d * d;
+}
+
+/*
+ * Kernels accumulate in floats, which overflow once points are about
+ * 1e19 apart under euclidean distances. The kernel output is bounded by
+ * that over the sides of the bounding box of the points, and only when
+ * the bound is too large for a float is the output checked at all.
+ */
+static int select_distance_kernel(ahc_context_t *ctx,
+                                  const points_t *points)
+{
+        int level = ctx->kernel_level, num_dims = points->num_dims;
+        while (!ctx->metric->kernels[level])
+                --level;
+        ctx->distance_kernel = ctx->metric->kernels[level];
+        ctx->finish_distances = ctx->squared_distances ? NULL :
+                ctx->metric->finish;
+        ctx->kernel_bound = 1.0; /* points of unit length */
+        if (ctx->metric->normalise)
+                return 1;
+        double *lo = alloc_work(ctx, 2 * (size_t) num_dims, double);
+        if (!lo) {
+                alloc_fail("bounding box");
+                return 0;
+        }
+        double *hi = lo + num_dims, bound = 0.0;
+        for (int k = 0; k < num_dims; ++k) {
+                lo[k] = INFINITY;
+                hi[k] = -INFINITY;
+        }
+        for (int i = 0; i < points->num_items; ++i) {
+                const float *x = point_coord(points, i);
+                for (int k = 0; k < num_dims; ++k) {
+                        lo[k] = fmin(lo[k], x[k]);
+                        hi[k] = fmax(hi[k], x[k]);
+                }
+        }
+        for (int k = 0; k < num_dims && points->num_items; ++k)
+                bound = accumulate(ctx, bound, hi[k] - lo[k]);
+        free_work(ctx, lo);
+        ctx->kernel_bound = bound;
+        return 1;
+}
+
+/*
+ * Distance from x to y computed in double precision, for the points
+ * whose kernel output overflowed a float. Distances still beyond
+ * FLT_MAX saturate at it.
+ */
+static float exact_distance(const ahc_context_t *ctx, const float *x,
+                            const float *y, int stride)
+{
+        double acc = 0.0;
+        for (int k = 0; k < stride; ++k)
+                acc = accumulate(ctx, acc, fabs((double) x[k] - y[k]));
+        if (ctx->finish_distances == finish_euclidean)
+                acc = sqrt(acc);
+        else if (ctx->finish_distances == finish_minkowski)
+                acc = pow(acc, 1.0 / ctx->minkowski_p);
+        return acc < FLT_MAX ? acc : FLT_MAX;
+}
+
+/* distances under the chosen metric from point x to count points at y */
+static inline void compute_distances(const ahc_context_t *ctx,
+                                     const float *x, const float *y,
+                                     int count, int stride, float *out)
+{
+        ctx->distance_kernel(x, y, count, stride, ctx->minkowski_p, out);
+        if (ctx->finish_distances)
+                ctx->finish_distances(out, count, ctx->minkowski_p);
+        /* the margin covers the rounding of the kernel */
+        if (ctx->kernel_bound > FLT_MAX / 2)
+                for (int j = 0; j < count; ++j)
+                        if (out[j] > FLT_MAX)
+                                out[j] = exact_distance(
+                                        ctx, x, y + (size_t) j * stride,
+                                        stride);
+}
+
+/*
+ * Only the strictly upper triangle (i < j) of the symmetric distance
+ * matrix is stored, row after row, in a single contiguous block. Square
+ * matrices given by the caller are used in place, through their upper
+ * triangle.
+ */
+static inline size_t condensed_index(int n, int i, int j)
+{
+        return (size_t) i * (2 * (size_t) n - i - 1) / 2 + (j - i - 1);
+}
+
+/*
+ * Tiled matrices keep the tiles of the upper triangle, those on the
+ * diagonal included, row after row, and the entries of each tile row
+ * after row.
+ */
+static inline size_t tile_index(const distance_matrix_t *matrix,
+                                int i, int j)
+{
+        size_t ti = i / TILE_SIDE, tj = j / TILE_SIDE;
+        return ti * (2 * (size_t) matrix->num_tiles - ti + 1) / 2 + tj - ti;
+}
+
+static inline size_t matrix_index(const distance_matrix_t *matrix,
+                                  int i, int j)
+{
+        if (matrix->tiled)
+                return tile_index(matrix, i, j) * TILE_SIDE * TILE_SIDE +
+                        i % TILE_SIDE * TILE_SIDE + j % TILE_SIDE;
+        return matrix->square ? (size_t) i * matrix->n + j :
+                condensed_index(matrix->n, i, j);
+}
+
+/* the tile holding d(i, j) */
+static inline float *tile_min(distance_matrix_t *matrix, int i, int j)
+{
+        return i < j ? &(matrix->tile_min[tile_index(matrix, i, j)]) :
+                &(matrix->tile_min[tile_index(matrix, j, i)]);
+}
+
+/* entries of matrices that hold floats */
+static inline float *matrix_entry(distance_matrix_t *matrix, int i, int j)
+{
+        float *data = matrix->data;
+        return i < j ? &(data[matrix_index(matrix, i, j)]) :
+                &(data[matrix_index(matrix, j, i)]);
+}
+
+#define FLOAT_ENTRIES 0
+#define HALF_ENTRIES 1
+#define BFLOAT16_ENTRIES 2
+#define U16_ENTRIES 3
+#define U8_ENTRIES 4
+
+/* float, the default, comes first, and formats are in this order */
+static const matrix_format_t matrix_formats[] = {
+        { "float", sizeof(float), 1.0f, FLT_MAX },
+        { "half", sizeof(uint16_t), 1.0f, 65504.0f },
+        { "bfloat16", sizeof(uint16_t), 1.0f, FLT_MAX },
+        { "u16", sizeof(uint16_t), 65535.0f, 65535.0f },
+        { "u8", sizeof(uint8_t), 255.0f, 255.0f },
+        { NULL }
+};
+
+/*
+ * Conversions between floats and IEEE half precision numbers, rounding
+ * to nearest even, and bfloat16 numbers, which are the top half of a
+ * float. They work on the bits, and are inlined into the loops over
+ * rows, which the compiler vectorises where it can.
+ */
+static inline uint16_t float_to_half(float f)
+{
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        uint32_t sign = x >> 16 & 0x8000;
+        x &= 0x7fffffff;
+        if (x >= 0x47800000) /* too large, infinite or not a number */
+                return sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+        if (x < 0x38800000) /* subnormal, in units of 2^-24 */
+                return sign | (uint16_t) (fabsf(f) * 0x1p24f + 0.5f);
+        x += 0xfff + (x >> 13 & 1);
+        return sign | (x - 0x38000000) >> 13;
+}
+
+static inline float half_to_float(uint16_t h)
+{
+        uint32_t x = (uint32_t) (h & 0x8000) << 16;
+        float f;
+        if ((h & 0x7c00) == 0) {
+                f = (h & 0x3ff) * 0x1p-24f;
+                return x ? -f : f;
+        }
+        x |= (h & 0x7c00) == 0x7c00 ? 0x7f800000 | (h & 0x3ff) << 13 :
+                ((uint32_t) (h & 0x7fff) << 13) + 0x38000000;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+}
+
+static inline uint16_t float_to_bfloat16(float f)
+{
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        x += 0x7fff + (x >> 16 & 1);
+        return x >> 16;
+}
+
+static inline float bfloat16_to_float(uint16_t h)
+{
+        uint32_t x = (uint32_t) h << 16;
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+}
+
+/* entry k of a reduced matrix, before it is scaled by its row */
+static inline float decode_entry(const distance_matrix_t *matrix, size_t k)
+{
+        const uint16_t *codes = matrix->data;
+        switch (matrix->format) {
+        case HALF_ENTRIES:
+                return half_to_float(codes[k]);
+        case BFLOAT16_ENTRIES:
+                return bfloat16_to_float(codes[k]);
+        case U16_ENTRIES:
+                return codes[k];
+        default:
+                return ((const uint8_t *) matrix->data)[k];
+        }
+}
+
+/* stores y, at most the top of the format, as entry k of the matrix */
+static inline void encode_entry(distance_matrix_t *matrix, size_t k,
+                                float y)
+{
+        uint16_t *codes = matrix->data;
+        switch (matrix->format) {
+        case HALF_ENTRIES:
+                codes[k] = float_to_half(y);
+                break;
+        case BFLOAT16_ENTRIES:
+                codes[k] = float_to_bfloat16(y);
+                break;
+        case U16_ENTRIES:
+                codes[k] = y > 0.0f ? (uint16_t) (y + 0.5f) : 0;
+                break;
+        default:
+                ((uint8_t *) matrix->data)[k] = y > 0.0f ?
+                        (uint8_t) (y + 0.5f) : 0;
+        }
+}
+
+static inline float matrix_get(const distance_matrix_t *matrix, int i, int j)
+{
+        if (i > j) {
+                int t = i;
+                i = j;
+                j = t;
+        }
+        size_t k = matrix_index(matrix, i, j);
+        if (matrix->format == FLOAT_ENTRIES)
+                return ((const float *) matrix->data)[k];
+        return decode_entry(matrix, k) * matrix->scale[i];
+}
+
+/* lowers *m to d, which other threads may be lowering at the same time */
+static void lower_minimum(float *m, float d)
+{
+        float seen;
+        __atomic_load(m, &seen, __ATOMIC_RELAXED);
+        while (d < seen && !__atomic_compare_exchange(m, &seen, &d, 0,
+                                                      __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED))
+                ;
+}
+
+/*
+ * Scales row i of a reduced matrix up to fit distance d: by at least
+ * two, so that a row is only rescaled a few times while merging. Its
+ * entries are rounded again, which may take them below the minima of
+ * their tiles.
+ */
+static void rescale_row(distance_matrix_t *matrix, int i, float d)
+{
+        const matrix_format_t *format = &matrix_formats[matrix->format];
+        float old = matrix->scale[i], scale = d / format->fit;
+        if (scale < 2.0f * old)
+                scale = 2.0f * old;
+        matrix->scale[i] = scale;
+        for (int j = i + 1; j < matrix->n; ++j) {
+                size_t k = matrix_index(matrix, i, j);
+                encode_entry(matrix, k, decode_entry(matrix, k) * old /
+                             scale);
+                if (matrix->tiled)
+                        lower_minimum(tile_min(matrix, i, j),
+                                      decode_entry(matrix, k) * scale);
+        }
+}
+
+/*
+ * Stores d(i, j). Only the thread that owns row min(i, j) may store
+ * entries of reduced matrices, which rescale that row if d does not fit.
+ */
+static inline void matrix_set(distance_matrix_t *matrix, int i, int j,
+                              float d)
+{
+        if (i > j) {
+                int t = i;
+                i = j;
+                j = t;
+        }
+        size_t k = matrix_index(matrix, i, j);
+        if (matrix->format == FLOAT_ENTRIES) {
+                ((float *) matrix->data)[k] = d;
+                return;
+        }
+        if (d > matrix_formats[matrix->format].top * matrix->scale[i])
+                rescale_row(matrix, i, d);
+        encode_entry(matrix, k, d / matrix->scale[i]);
+}
+
+/* scale of a row of a reduced matrix whose largest distance is d */
+static inline float row_scale(const distance_matrix_t *matrix, float d)
+{
+        return (d > 0.0f ? d : 1.0f) / matrix_formats[matrix->format].fit;
+}
+
+static void cpu_relax(int *spins)
+{
+        if (++*spins < 1024) {
+#ifdef X86_KERNELS
+                __builtin_ia32_pause();
+#endif
+        } else
+                sched_yield();
+}
+
+typedef struct worker_s {
+        thread_pool_t *pool;
+        int id;
+} worker_t;
+
+static void *pool_worker(void *arg)
+{
+        worker_t *worker = arg;
+        thread_pool_t *pool = worker->pool;
+        unsigned seen = 0;
+        for (;;) {
+                int spins = 0;
+                while (__atomic_load_n(&pool->generation,
+                                       __ATOMIC_ACQUIRE) == seen) {
+                        if (spins < 1024) {
+                                cpu_relax(&spins);
+                                continue;
+                        }
+                        pthread_mutex_lock(&pool->lock);
+                        while (__atomic_load_n(&pool->generation,
+                                               __ATOMIC_ACQUIRE) == seen)
+                                pthread_cond_wait(&pool->wake, &pool->lock);
+                        pthread_mutex_unlock(&pool->lock);
+                }
+                seen = pool->generation;
+                if (pool->quit)
+                        break;
+                pool->task(pool->arg, worker->id, pool->num_threads);
+                __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+        }
+        free(worker);
+        return NULL;
+}
+
+static void post_task(thread_pool_t *pool, void (*task)(void *, int, int),
+                      void *arg)
+{
+        pool->task = task;
+        pool->arg = arg;
+        __atomic_store_n(&pool->pending, pool->num_threads - 1,
+                         __ATOMIC_RELAXED);
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static void free_thread_pool(thread_pool_t *pool)
+{
+        if (pool) {
+                pool->quit = 1;
+                post_task(pool, NULL, NULL);
+                for (int i = 1; i < pool->num_threads; ++i)
+                        pthread_join(pool->threads[i - 1], NULL);
+                pthread_mutex_destroy(&pool->lock);
+                pthread_cond_destroy(&pool->wake);
+                free(pool->threads);
+                free(pool);
+        }
+}
+
+static thread_pool_t *create_thread_pool(int count)
+{
+        thread_pool_t *pool = alloc_mem(1, thread_pool_t);
+        if (!pool || !(pool->threads = alloc_mem(count, pthread_t))) {
+                alloc_fail("thread pool");
+                free(pool);
+                return NULL;
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pool->num_threads = 1;
+        for (int i = 1; i < count; ++i) {
+                worker_t *worker = alloc_mem(1, worker_t);
+                if (!worker)
+                        break;
+                worker->pool = pool;
+                worker->id = i;
+                if (pthread_create(&(pool->threads[i - 1]), NULL,
+                                   pool_worker, worker)) {
+                        free(worker);
+                        break;
+                }
+                pool->num_threads++;
+        }
+        return pool;
+}
+
+int ahc_parallel(ahc_context_t *ctx, void (*task)(void *, int, int),
+                 void *arg, size_t work)
+{
+        thread_pool_t *pool = ctx->thread_pool;
+        if (!pool || pool->num_threads < 2 || work < PARALLEL_MIN_WORK) {
+                task(arg, 0, 1);
+                return 1;
+        }
+        post_task(pool, task, arg);
+        task(arg, 0, pool->num_threads);
+        int spins = 0;
+        while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE))
+                cpu_relax(&spins);
+        return pool->num_threads;
+}
+
+/* the part of [0, count) that thread of num_threads should work on */
+static void split_range(int count, int thread, int num_threads,
+                        int *begin, int *end)
+{
+        *begin = (long long) count * thread / num_threads;
+        *end = (long long) count * (thread + 1) / num_threads;
+}
+
+typedef struct fill_task_s {
+        const ahc_context_t *ctx;
+        distance_matrix_t *matrix;
+        const points_t *points;
+        int next_row; /* first row of the next block to fill */
+        float *rows; /* block of n distances per row per thread, if reduced */
+} fill_task_t;
+
+/*
+ * Fills d(i, j) to d(i, end - 1), one tile at a time if tiled, or the
+ * same part of the row of distances of a reduced matrix.
+ */
+static void fill_segment(const fill_task_t *task, int i, int j, int end,
+                         float *row)
+{
+        distance_matrix_t *matrix = task->matrix;
+        const points_t *points = task->points;
+        if (row) {
+                compute_distances(task->ctx, point_coord(points, i),
+                                  point_coord(points, j), end - j,
+                                  points->stride, &row[j]);
+                return;
+        }
+        while (j < end) {
+                int next = matrix->tiled ?
+                        (j / TILE_SIDE + 1) * TILE_SIDE : end;
+                if (next > end)
+                        next = end;
+                float *d = matrix_entry(matrix, i, j);
+                compute_distances(task->ctx, point_coord(points, i),
+                                  point_coord(points, j), next - j,
+                                  points->stride, d);
+                if (matrix->tiled) {
+                        float *m = tile_min(matrix, i, j);
+                        for (int k = 0; k < next - j; ++k)
+                                if (d[k] < *m)
+                                        *m = d[k];
+                }
+                j = next;
+        }
+}
+
+/* stores count distances d, divided by scale, from entry k onwards */
+static void encode_entries(distance_matrix_t *matrix, size_t k,
+                           const float *d, int count, float scale)
+{
+        uint16_t *codes = (uint16_t *) matrix->data + k;
+        uint8_t *bytes = (uint8_t *) matrix->data + k;
+        float r = 1.0f / scale;
+        switch (matrix->format) {
+        case HALF_ENTRIES:
+                for (int t = 0; t < count; ++t)
+                        codes[t] = float_to_half(d[t] * r);
+                break;
+        case BFLOAT16_ENTRIES:
+                for (int t = 0; t < count; ++t)
+                        codes[t] = float_to_bfloat16(d[t] * r);
+                break;
+        case U16_ENTRIES:
+                for (int t = 0; t < count; ++t)
+                        codes[t] = d[t] > 0.0f ?
+                                (uint16_t) (d[t] * r + 0.5f) : 0;
+                break;
+        default:
+                for (int t = 0; t < count; ++t)
+                        bytes[t] = d[t] > 0.0f ?
+                                (uint8_t) (d[t] * r + 0.5f) : 0;
+        }
+}
+
+/*
+ * Scales row i of a reduced matrix by its largest distance, and stores
+ * its distances d[i + 1] to d[n - 1], a tile at a time if tiled.
+ */
+static void store_row(distance_matrix_t *matrix, int i, const float *d)
+{
+        float top = 0.0f;
+        for (int j = i + 1; j < matrix->n; ++j)
+                if (d[j] > top)
+                        top = d[j];
+        float scale = matrix->scale[i] = row_scale(matrix, top);
+        for (int j = i + 1, next; j < matrix->n; j = next) {
+                next = matrix->tiled ? (j / TILE_SIDE + 1) * TILE_SIDE :
+                        matrix->n;
+                if (next > matrix->n)
+                        next = matrix->n;
+                size_t k = matrix_index(matrix, i, j);
+                encode_entries(matrix, k, &d[j], next - j, scale);
+                if (matrix->tiled) {
+                        float *m = tile_min(matrix, i, j);
+                        for (int t = 0; t < next - j; ++t)
+                                if (decode_entry(matrix, k + t) * scale < *m)
+                                        *m = decode_entry(matrix, k + t) *
+                                                scale;
+                }
+        }
+}
+
+/*
+ * Threads take blocks of ROW_BLOCK rows in turn. Each block is filled in
+ * column tiles that fit in the cache, so every tile of coordinates is
+ * loaded from memory once per block of rows. Tiled matrices are filled
+ * a row of tiles at a time, so that each tile minimum has one writer.
+ * Reduced matrices are filled through rows of floats, as the scale of a
+ * row is only known once all its distances are.
+ */
+static void fill_rows(void *arg, int thread, int count)
+{
+        fill_task_t *task = arg;
+        const points_t *points = task->points;
+        int n = points->num_items;
+        int block = task->matrix->tiled ? TILE_SIDE : ROW_BLOCK;
+        int tile = COLUMN_BLOCK_BYTES / (points->stride * sizeof(float));
+        float *rows = task->rows ?
+                &(task->rows[(size_t) thread * block * n]) : NULL;
+        if (tile < 1)
+                tile = 1;
+        for (;;) {
+                int first = __atomic_fetch_add(&task->next_row, block,
+                                               __ATOMIC_RELAXED);
+                if (first >= n)
+                        break;
+                int last = first + block < n ? first + block : n;
+                for (int col = first + 1; col < n; col += tile) {
+                        int end = col + tile < n ? col + tile : n;
+                        for (int i = first; i < last && i + 1 < end; ++i)
+                                fill_segment(task, i,
+                                             col > i + 1 ? col : i + 1, end,
+                                             rows ? &rows[(size_t)
+                                                          (i - first) * n] :
+                                             NULL);
+                }
+                for (int i = first; rows && i < last; ++i)
+                        store_row(task->matrix, i,
+                                  &rows[(size_t) (i - first) * n]);
+        }
+}
+
+static int fill_distances(ahc_context_t *ctx, distance_matrix_t *matrix,
+                          const points_t *points)
+{
+        fill_task_t task = { .ctx = ctx, .matrix = matrix,
+                             .points = points };
+        size_t n = points->num_items;
+        if (matrix->format != FLOAT_ENTRIES) {
+                size_t block = matrix->tiled ? TILE_SIDE : ROW_BLOCK;
+                task.rows = alloc_work(ctx, ahc_num_threads(ctx) * block * n,
+                                       float);
+                if (!task.rows) {
+                        alloc_fail("rows of distances");
+                        return 0;
+                }
+        }
+        start_timing(&(ctx->stats.distances));
+        ahc_parallel(ctx, fill_rows, &task, n * (n - 1) / 2);
+        stop_timing(&(ctx->stats.distances));
+        ctx->stats.distance_evaluations += n * (n - 1) / 2;
+        if (task.rows)
+                free_work(ctx, task.rows);
+        return 1;
+}
+
+static void *alloc_huge_pages(size_t *size)
+{
+        void *mem = MAP_FAILED;
+        size_t rounded = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)
+                (HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (mem == MAP_FAILED) {
+                /* no reserved huge pages: ask for transparent ones */
+                mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED)
+                        return NULL;
+#ifdef MADV_HUGEPAGE
+                madvise(mem, rounded, MADV_HUGEPAGE);
+#endif
+        }
+        *size = rounded;
+        return mem;
+}
+
+/*
+ * Distance matrices larger than memory are kept in a scratch file, which
+ * is unlinked at once and mapped into memory. Its tiles are one page
+ * each, so that a row of the matrix touches one page per tile whichever
+ * part of the triangle it lies in, and the minima of the tiles are kept
+ * in memory, so that nearest-neighbour searches pass over the tiles
+ * that cannot hold a nearer neighbour without reading them.
+ */
+static int map_scratch_matrix(ahc_context_t *ctx, distance_matrix_t *matrix)
+{
+        int num_tiles = (matrix->n + TILE_SIDE - 1) / TILE_SIDE, fd, error;
+        size_t count = (size_t) num_tiles * (num_tiles + 1) / 2;
+        char *path = alloc_mem(strlen(ctx->scratch_dir) +
+                               sizeof("/ahc-XXXXXX"), char);
+        if (!path) {
+                alloc_fail("scratch file name");
+                return 0;
+        }
+        sprintf(path, "%s/ahc-XXXXXX", ctx->scratch_dir);
+        if ((fd = mkstemp(path)) < 0) {
+                fprintf(stderr, "Failed to create a scratch file in %s.\n",
+                        ctx->scratch_dir);
+                free(path);
+                return 0;
+        }
+        unlink(path);
+        free(path);
+        matrix->tiled = 1;
+        matrix->num_tiles = num_tiles;
+        matrix->size = count * TILE_SIDE * TILE_SIDE *
+                matrix_formats[matrix->format].size;
+        /* reserve the blocks now, rather than fault on a full disk */
+        if ((error = posix_fallocate(fd, 0, matrix->size))) {
+                fprintf(stderr, "Failed to reserve %zu bytes of scratch "
+                        "space: %s.\n", matrix->size, strerror(error));
+                close(fd);
+                return 0;
+        }
+        matrix->mapping = mmap(NULL, matrix->size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+        close(fd);
+        if (matrix->mapping == MAP_FAILED) {
+                matrix->mapping = NULL;
+                fprintf(stderr, "Failed to map the scratch file.\n");
+                return 0;
+        }
+        matrix->data = matrix->mapping;
+        matrix->tile_min = alloc_work(ctx, count, float);
+        if (!matrix->tile_min) {
+                alloc_fail("tile minima");
+                return 0;
+        }
+        for (size_t t = 0; t < count; ++t)
+                matrix->tile_min[t] = FLT_MAX;
+#ifdef MADV_SEQUENTIAL
+        madvise(matrix->mapping, matrix->size, MADV_SEQUENTIAL);
+#endif
+        return 1;
+}
+
+static void free_distance_matrix(ahc_context_t *ctx,
+                                 distance_matrix_t *matrix)
+{
+        if (matrix->mapping)
+                munmap(matrix->mapping, matrix->size);
+        else
+                free_work(ctx, matrix->data);
+        free_work(ctx, matrix->tile_min);
+        free_work(ctx, matrix->scale);
+        free_work(ctx, matrix);
+}
+
+static distance_matrix_t *generate_distance_matrix(ahc_context_t *ctx,
+                                                   const points_t *points)
+{
+        int num_items = points->num_items;
+        distance_matrix_t *matrix = alloc_work(ctx, 1, distance_matrix_t);
+        if (!matrix) {
+                alloc_fail("distance matrix");
+                return NULL;
+        }
+        matrix->n = num_items;
+        matrix->format = ctx->matrix_format;
+        if (matrix->format != FLOAT_ENTRIES &&
+            !(matrix->scale = alloc_work(ctx, num_items, float))) {
+                alloc_fail("row scales");
+                free_work(ctx, matrix);
+                return NULL;
+        }
+        if (ctx->scratch_dir) {
+                if (!map_scratch_matrix(ctx, matrix) ||
+                    !fill_distances(ctx, matrix, points)) {
+                        free_distance_matrix(ctx, matrix);
+                        return NULL;
+                }
+#ifdef MADV_RANDOM
+                /* tiles are read one by one from now on */
+                madvise(matrix->mapping, matrix->size, MADV_RANDOM);
+#endif
+                return matrix;
+        }
+        size_t count = (size_t) num_items * (num_items - 1) / 2;
+        size_t size = matrix_formats[matrix->format].size;
+        matrix->size = (count ? count : 1) * size;
+        if (ctx->use_huge_pages) {
+                matrix->data = alloc_huge_pages(&(matrix->size));
+                matrix->mapping = matrix->data;
+        }
+        if (!matrix->data)
+                matrix->data = work_alloc(ctx, count ? count : 1, size);
+        if (!matrix->data)
+                alloc_fail("distance matrix");
+        if (!matrix->data || !fill_distances(ctx, matrix, points)) {
+                free_distance_matrix(ctx, matrix);
+                matrix = NULL;
+        }
+        return matrix;
+}
+
+/*
+ * Distance between the merger of clusters i and j and another cluster k,
+ * given the distances d(i, k), d(j, k) and d(i, j) prior to the merger:
+ *
+ *     d(ij, k) = ai d(i, k) + aj d(j, k) + b d(i, j) + c |d(i, k) - d(j, k)|
+ *
+ * Evaluated in double precision, so that min/max are reproduced exactly.
+ * Updates beyond FLT_MAX, or of distances that are not numbers, give
+ * FLT_MAX.
+ */
+static inline float lance_williams(double ai, double aj, double b,
+                                  double c, float dik, float djk, float dij)
+{
+        double d = ai * dik + aj * djk + b * dij +
+                c * fabs((double) dik - djk);
+        return d < FLT_MAX ? d : FLT_MAX;
+}
+
+static inline float single_linkage(float dik, float djk, float dij,
+                                   int ni, int nj, int nk)
+{
+        return lance_williams(0.5, 0.5, 0.0, -0.5, dik, djk, dij);
+}
+
+static inline float complete_linkage(float dik, float djk, float dij,
+                                     int ni, int nj, int nk)
+{
+        return lance_williams(0.5, 0.5, 0.0, 0.5, dik, djk, dij);
+}
+
+static inline float average_linkage(float dik, float djk, float dij,
+                                    int ni, int nj, int nk)
+{
+        double n = ni + nj;
+        return lance_williams(ni / n, nj / n, 0.0, 0.0, dik, djk, dij);
+}
+
+static inline float weighted_linkage(float dik, float djk, float dij,
+                                     int ni, int nj, int nk)
+{
+        return lance_williams(0.5, 0.5, 0.0, 0.0, dik, djk, dij);
+}
+
+/* centroid, median and ward operate on squared euclidean distances */
+static inline float centroid_linkage(float dik, float djk, float dij,
+                                     int ni, int nj, int nk)
+{
+        double n = ni + nj;
+        return lance_williams(ni / n, nj / n, -(ni / n) * (nj / n), 0.0,
+                              dik, djk, dij);
+}
+
+static inline float median_linkage(float dik, float djk, float dij,
+                                   int ni, int nj, int nk)
+{
+        return lance_williams(0.5, 0.5, -0.25, 0.0, dik, djk, dij);
+}
+
+static inline float ward_linkage(float dik, float djk, float dij,
+                                 int ni, int nj, int nk)
+{
+        double n = ni + nj + nk;
+        return lance_williams((ni + nk) / n, (nj + nk) / n, -nk / n, 0.0,
+                              dik, djk, dij);
+}
+
+
+/*
+ * SLINK (R. Sibson, 1973): builds the pointer representation of the
+ * single linkage hierarchy in O(n^2) time and O(n) memory, computing
+ * distances on the fly. Item i joins the cluster of the item pi[i] at
+ * distance lambda[i]; m is a scratch row of num_items distances.
+ */
+typedef struct row_task_s {
+        const ahc_context_t *ctx;
+        const points_t *points;
+        int row; /* distances from this item to the ones before it */
+        float *out;
+} row_task_t;
+
+static void distances_to_row(void *arg, int thread, int count)
+{
+        row_task_t *task = arg;
+        int begin, end;
+        split_range(task->row, thread, count, &begin, &end);
+        compute_distances(task->ctx, point_coord(task->points, task->row),
+                          point_coord(task->points, begin), end - begin,
+                          task->points->stride, task->out + begin);
+}
+
+static void slink(ahc_context_t *ctx, const points_t *points, int *pi,
+                  float *lambda, float *m)
+{
+        row_task_t task = { .ctx = ctx, .points = points, .out = m };
+        for (int i = 0; i < points->num_items; ++i) {
+                pi[i] = i;
+                lambda[i] = FLT_MAX;
+                task.row = i;
+                ahc_parallel(ctx, distances_to_row, &task,
+                             (size_t) i * points->stride);
+                ctx->stats.distance_evaluations += i;
+                for (int j = 0; j < i; ++j) {
+                        int p = pi[j];
+                        if (lambda[j] >= m[j]) {
+                                if (lambda[j] < m[p])
+                                        m[p] = lambda[j];
+                                lambda[j] = m[j];
+                                pi[j] = i;
+                        } else if (m[j] < m[p])
+                                m[p] = m[j];
+                }
+                for (int j = 0; j < i; ++j)
+                        if (lambda[j] >= lambda[pi[j]])
+                                pi[j] = i;
+        }
+}
+
+/*
+ * Stable sort of merges by distance, so that a merge never precedes the
+ * merges that formed its clusters when their distances are equal.
+ */
+static merge_t *sort_merges(ahc_context_t *ctx, merge_t merges[], int n)
+{
+        merge_t *temp = alloc_work(ctx, n ? n : 1, merge_t);
+        if (!temp) {
+                alloc_fail("array of merges");
+                return NULL;
+        }
+        for (int width = 1; width < n; width *= 2) {
+                for (int lo = 0; lo < n; lo += 2 * width) {
+                        int mid = lo + width < n ? lo + width : n;
+                        int hi = lo + 2 * width < n ? lo + 2 * width : n;
+                        int i = lo, j = mid, k = lo;
+                        while (i < mid && j < hi)
+                                temp[k++] = merges[j].distance <
+                                        merges[i].distance ?
+                                        merges[j++] : merges[i++];
+                        while (i < mid)
+                                temp[k++] = merges[i++];
+                        while (j < hi)
+                                temp[k++] = merges[j++];
+                }
+                memcpy(merges, temp, n * sizeof(merge_t));
+        }
+        free_work(ctx, temp);
+        return merges;
+}
+
+static int find_set(int *parent, int i)
+{
+        while (parent[i] != i)
+                i = parent[i] = parent[parent[i]];
+        return i;
+}
+
+/*
+ * Numbers the clusters of merges listed in the order they are made, as
+ * in ahc_merge_t.
+ * Each merge names one leaf from each of the clusters, which are located
+ * by keeping the leaves of every root cluster in a disjoint-set forest.
+ */
+static int number_merges(ahc_context_t *ctx, const merge_t merges[], int n,
+                         ahc_merge_t out[])
+{
+        int *parent = alloc_work(ctx, n, int);
+        int *root = alloc_work(ctx, n, int);
+        int *size = alloc_work(ctx, n, int);
+        int ok = parent && root && size;
+        if (!ok) {
+                alloc_fail("disjoint-set forest");
+                goto done;
+        }
+        for (int i = 0; i < n; ++i) {
+                parent[i] = root[i] = i;
+                size[i] = ctx->weights ? ctx->weights[i] : 1;
+        }
+        for (int i = 0; i < n - 1; ++i) {
+                int a = find_set(parent, merges[i].first);
+                int b = find_set(parent, merges[i].second);
+                /* newest root goes first */
+                out[i].first = root[a] > root[b] ? root[a] : root[b];
+                out[i].second = root[a] > root[b] ? root[b] : root[a];
+                out[i].distance = merges[i].distance;
+                out[i].size = size[a] + size[b];
+                parent[b] = a;
+                root[a] = n + i;
+                size[a] += size[b];
+        }
+done:
+        free_work(ctx, parent);
+        free_work(ctx, root);
+        free_work(ctx, size);
+        return ok;
+}
+
+static int single_linkage_merges(ahc_context_t *ctx, const points_t *points,
+                                 ahc_merge_t out[])
+{
+        int n = points->num_items, ok = 0;
+        int *pi = alloc_work(ctx, n, int);
+        float *lambda = alloc_work(ctx, n, float);
+        float *m = alloc_work(ctx, n, float);
+        merge_t *merges = alloc_work(ctx, n, merge_t);
+        if (!pi || !lambda || !m || !merges) {
+                alloc_fail("pointer representation");
+                goto done;
+        }
+        start_timing(&(ctx->stats.merge));
+        slink(ctx, points, pi, lambda, m);
+        stop_timing(&(ctx->stats.merge));
+        start_timing(&(ctx->stats.numbering));
+        for (int i = 0; i < n - 1; ++i) {
+                merges[i].first = i;
+                merges[i].second = pi[i];
+                merges[i].distance = lambda[i];
+        }
+        ok = sort_merges(ctx, merges, n - 1) &&
+                number_merges(ctx, merges, n, out);
+        stop_timing(&(ctx->stats.numbering));
+done:
+        free_work(ctx, pi);
+        free_work(ctx, lambda);
+        free_work(ctx, m);
+        free_work(ctx, merges);
+        return ok;
+}
+
+/* items the point in a row of the matrix stands for */
+static inline int row_weight(const ahc_context_t *ctx,
+                             const distance_matrix_t *matrix, int row)
+{
+        if (!ctx->weights)
+                return 1;
+        return ctx->weights[matrix->items ? matrix->items[row] : row];
+}
+
+static void free_active_rows(active_rows_t *active)
+{
+        if (active) {
+                ahc_context_t *ctx = active->ctx;
+                free_work(ctx, active->rows);
+                free_work(ctx, active->size);
+                free_work(ctx, active->merged);
+                free_work(ctx, active->best);
+                free_work(ctx, active->best_row);
+                free_work(ctx, active);
+        }
+}
+
+static active_rows_t *alloc_active_rows(ahc_context_t *ctx,
+                                        distance_matrix_t *matrix)
+{
+        int n = matrix->n;
+        active_rows_t *active = alloc_work(ctx, 1, active_rows_t);
+        if (active) {
+                active->ctx = ctx;
+                active->matrix = matrix;
+                active->count = n;
+                active->rows = alloc_work(ctx, n, int);
+                active->size = alloc_work(ctx, n, int);
+                active->best = alloc_work(ctx, MAX_THREADS, float);
+                active->best_row = alloc_work(ctx, MAX_THREADS, int);
+                if (matrix->format != FLOAT_ENTRIES)
+                        active->merged = alloc_work(ctx, n, float);
+                if (active->rows && active->size && active->best &&
+                    active->best_row && (active->merged ||
+                                         matrix->format == FLOAT_ENTRIES)) {
+                        for (int i = 0; i < n; ++i) {
+                                active->rows[i] = i;
+                                active->size[i] =
+                                        row_weight(ctx, matrix, i);
+                        }
+                        return active;
+                }
+                free_active_rows(active);
+        }
+        alloc_fail("active clusters");
+        return NULL;
+}
+
+/* position of an active row inside the sorted array of active rows */
+static int active_position(const active_rows_t *active, int row)
+{
+        int lo = 0, hi = active->count - 1;
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (active->rows[mid] < row)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+static void remove_active(active_rows_t *active, int row)
+{
+        int k = active_position(active, row);
+        memmove(&(active->rows[k]), &(active->rows[k + 1]),
+                (active->count - k - 1) * sizeof(int));
+        active->count--;
+        active->size[row] = 0;
+}
+
+static void nearest_in_range(void *arg, int thread, int count)
+{
+        active_rows_t *active = arg;
+        int begin, end, row = active->row, best_row = -1, tile = -1;
+        int reduced = active->matrix->format != FLOAT_ENTRIES;
+        float best = FLT_MAX;
+        split_range(active->count - active->from, thread, count, &begin, &end);
+        for (int k = active->from + begin; k < active->from + end; ++k) {
+                int x = active->rows[k];
+                if (x == row)
+                        continue;
+                /* pass over tiles holding nothing nearer */
+                if (active->matrix->tiled && x / TILE_SIDE != tile) {
+                        tile = x / TILE_SIDE;
+                        if (best_row >= 0 &&
+                            *tile_min(active->matrix, row, x) >= best) {
+                                while (k + 1 < active->from + end &&
+                                       active->rows[k + 1] / TILE_SIDE ==
+                                       tile)
+                                        ++k;
+                                continue;
+                        }
+                }
+                float d = reduced ? matrix_get(active->matrix, row, x) :
+                        *matrix_entry(active->matrix, row, x);
+                if (best_row < 0 || d < best) {
+                        best = d;
+                        best_row = x;
+                }
+        }
+        active->best[thread] = best;
+        active->best_row[thread] = best_row;
+}
+
+/*
+ * Nearest active row to the given row, among the active rows from the
+ * given position onwards. Threads scan consecutive parts of the rows
+ * and the first closest row wins, so the result does not depend on the
+ * number of threads. Returns -1 if there are no other rows.
+ */
+static int nearest_active(active_rows_t *active, int row, int from,
+                          float *distance)
+{
+        int best_row = -1;
+        active->row = row;
+        active->from = from;
+        active->ctx->stats.neighbour_searches++;
+        active->ctx->stats.rows_scanned += active->count - from;
+        int count = ahc_parallel(active->ctx, nearest_in_range, active,
+                                 active->count - from);
+        for (int t = 0; t < count; ++t) {
+                if (active->best_row[t] < 0)
+                        continue;
+                if (best_row < 0 || active->best[t] < *distance) {
+                        *distance = active->best[t];
+                        best_row = active->best_row[t];
+                }
+        }
+        return best_row;
+}
+
+/*
+ * Every linkage has its own copy of the task that updates the distances
+ * to the merged cluster, with its Lance-Williams update inlined. Rows of
+ * reduced matrices have one writer each: the distances in row b are kept
+ * in a row of floats, with the largest of them found by each thread, and
+ * are stored once its new scale is known.
+ */
+#define define_update(linkage)                                          \
+        static void update_##linkage(void *arg, int thread, int count)  \
+        {                                                               \
+                active_rows_t *active = arg;                            \
+                distance_matrix_t *matrix = active->matrix;             \
+                int begin, end, a = active->row, b = active->other;     \
+                float top = 0.0f;                                       \
+                split_range(active->count, thread, count, &begin, &end); \
+                for (int k = begin; k < end; ++k) {                     \
+                        int x = active->rows[k];                        \
+                        if (x == b)                                     \
+                                continue;                               \
+                        if (matrix->format == FLOAT_ENTRIES) {          \
+                                float *dbx = matrix_entry(matrix, b, x); \
+                                *dbx = linkage##_linkage(               \
+                                        *matrix_entry(matrix, a, x),    \
+                                        *dbx, active->dab,              \
+                                        active->size[a],                \
+                                        active->size[b],                \
+                                        active->size[x]);               \
+                                continue;                               \
+                        }                                               \
+                        float d = linkage##_linkage(                    \
+                                matrix_get(matrix, a, x),               \
+                                matrix_get(matrix, b, x), active->dab,  \
+                                active->size[a], active->size[b],       \
+                                active->size[x]);                       \
+                        if (x < b)                                      \
+                                matrix_set(matrix, x, b, d);            \
+                        else if ((active->merged[x] = d) > top)         \
+                                top = d;                                \
+                }                                                       \
+                active->best[thread] = top;                             \
+        }
+
+define_update(single)
+define_update(complete)
+define_update(average)
+define_update(weighted)
+define_update(centroid)
+define_update(median)
+define_update(ward)
+
+#undef define_update
+
+/* stores the distances from row b of a reduced matrix to the rows after */
+static void store_merged_row(void *arg, int thread, int count)
+{
+        active_rows_t *active = arg;
+        distance_matrix_t *matrix = active->matrix;
+        int begin, end, b = active->other;
+        float scale = matrix->scale[b];
+        split_range(active->count, thread, count, &begin, &end);
+        for (int k = begin; k < end; ++k) {
+                int x = active->rows[k];
+                if (x > b)
+                        encode_entry(matrix, matrix_index(matrix, b, x),
+                                     active->merged[x] / scale);
+        }
+}
+
+/*
+ * Updated distances from row b may fall below the minima of their tiles.
+ * Larger ones, and those of merged rows, leave the minima lower bounds.
+ */
+static void lower_tile_minima(active_rows_t *active, int b)
+{
+        for (int k = 0; k < active->count; ++k) {
+                int x = active->rows[k];
+                if (x == b)
+                        continue;
+                float d = matrix_get(active->matrix, b, x);
+                float *m = tile_min(active->matrix, b, x);
+                if (d < *m)
+                        *m = d;
+        }
+}
+
+/*
+ * Merges the cluster in row a into the cluster in row b, updating the
+ * distances from row b to the remaining active rows in parallel.
+ */
+static void merge_active(active_rows_t *active, int a, int b, float dab)
+{
+        ahc_context_t *ctx = active->ctx;
+        int size = active->size[a];
+        remove_active(active, a);
+        active->size[a] = size;
+        active->row = a;
+        active->other = b;
+        active->dab = dab;
+        int count = ahc_parallel(ctx, ctx->update_distances, active,
+                                 active->count);
+        if (active->matrix->format != FLOAT_ENTRIES) {
+                float top = 0.0f;
+                for (int t = 0; t < count; ++t)
+                        if (active->best[t] > top)
+                                top = active->best[t];
+                active->matrix->scale[b] = row_scale(active->matrix, top);
+                ahc_parallel(ctx, store_merged_row, active, active->count);
+        }
+        ctx->stats.distance_updates += active->count - 1;
+        active->size[b] += size;
+        active->size[a] = 0;
+        if (active->matrix->tiled)
+                lower_tile_minima(active, b);
+}
+
+/*
+ * Nearest-neighbour chain (F. Murtagh, 1983): follows a chain of nearest
+ * neighbours until it ends in a pair of reciprocal nearest neighbours,
+ * which for reducible linkages can be merged right away. This takes
+ * O(n^2) time and O(n) memory besides the distance matrix, which is
+ * overwritten with distances between the clusters. Each merge records
+ * the matrix rows of the two clusters, which are also leaves inside them.
+ */
+static int nn_chain(ahc_context_t *ctx, distance_matrix_t *matrix,
+                    merge_t merges[])
+{
+        int n = matrix->n, num_merges = 0, len = 0;
+        int *chain = alloc_work(ctx, n, int);
+        active_rows_t *active = alloc_active_rows(ctx, matrix);
+        if (!chain || !active) {
+                alloc_fail("nearest-neighbour chain");
+                num_merges = -1;
+                goto done;
+        }
+        while (num_merges < n - 1) {
+                int a, b, c;
+                if (len == 0)
+                        chain[len++] = active->rows[0];
+                for (;;) {
+                        float best;
+                        a = chain[len - 1];
+                        b = len > 1 ? chain[len - 2] : -1;
+                        c = nearest_active(active, a, 0, &best);
+                        /* prefer the previous link on ties, to terminate */
+                        if (b >= 0 && matrix_get(matrix, a, b) <= best)
+                                break;
+                        /* only distances that are not numbers get here */
+                        if (len == n) {
+                                fprintf(stderr, "Invalid distances between "
+                                        "the items.\n");
+                                num_merges = -1;
+                                goto done;
+                        }
+                        chain[len++] = c;
+                        ctx->stats.chain_links++;
+                }
+                len -= 2;
+
+                float dab = matrix_get(matrix, a, b);
+                merges[num_merges].first = a;
+                merges[num_merges].second = b;
+                merges[num_merges++].distance =
+                        ctx->squared_distances ? sqrtf(dab) : dab;
+
+                /* the merged cluster takes over the row of b */
+                merge_active(active, a, b, dab);
+        }
+done:
+        free_work(ctx, chain);
+        free_active_rows(active);
+        return num_merges;
+}
+
+static void free_heap(ahc_context_t *ctx, heap_t *heap)
+{
+        if (heap) {
+                free_work(ctx, heap->rows);
+                free_work(ctx, heap->pos);
+                free_work(ctx, heap->key);
+                free_work(ctx, heap);
+        }
+}
+
+static heap_t *alloc_heap(ahc_context_t *ctx, int n)
+{
+        heap_t *heap = alloc_work(ctx, 1, heap_t);
+        if (heap) {
+                heap->rows = alloc_work(ctx, n, int);
+                heap->pos = alloc_work(ctx, n, int);
+                heap->key = alloc_work(ctx, n, float);
+                if (heap->rows && heap->pos && heap->key) {
+                        for (int i = 0; i < n; ++i)
+                                heap->pos[i] = -1;
+                        return heap;
+                }
+                free_heap(ctx, heap);
+        }
+        alloc_fail("priority queue");
+        return NULL;
+}
+
+/* ties are broken in favour of the lower row, to stay deterministic */
+#define heap_less(heap, a, b)                                           \
+        ((heap)->key[a] < (heap)->key[b] ||                             \
+         ((heap)->key[a] == (heap)->key[b] && (a) < (b)))
+
+static void heap_place(heap_t *heap, int k, int row)
+{
+        heap->rows[k] = row;
+        heap->pos[row] = k;
+}
+
+static void sift_up(heap_t *heap, int k)
+{
+        int row = heap->rows[k];
+        while (k > 0) {
+                int parent = (k - 1) / 2;
+                if (!heap_less(heap, row, heap->rows[parent]))
+                        break;
+                heap_place(heap, k, heap->rows[parent]);
+                k = parent;
+        }
+        heap_place(heap, k, row);
+}
+
+static void sift_down(heap_t *heap, int k)
+{
+        int row = heap->rows[k];
+        for (;;) {
+                int child = 2 * k + 1;
+                if (child >= heap->size)
+                        break;
+                if (child + 1 < heap->size &&
+                    heap_less(heap, heap->rows[child + 1],
+                              heap->rows[child]))
+                        ++child;
+                if (!heap_less(heap, heap->rows[child], row))
+                        break;
+                heap_place(heap, k, heap->rows[child]);
+                k = child;
+        }
+        heap_place(heap, k, row);
+}
+
+/* inserts the row, or changes its key when it is already in the heap */
+static void heap_update(heap_t *heap, int row, float key)
+{
+        int k = heap->pos[row];
+        heap->key[row] = key;
+        if (k < 0) {
+                k = heap->size++;
+                heap_place(heap, k, row);
+        }
+        sift_up(heap, k);
+        sift_down(heap, heap->pos[row]);
+}
+
+static void heap_remove(heap_t *heap, int row)
+{
+        int k = heap->pos[row];
+        if (k < 0)
+                return;
+        heap->pos[row] = -1;
+        if (k == --heap->size)
+                return;
+        int last = heap->rows[heap->size];
+        heap_place(heap, k, last);
+        sift_up(heap, k);
+        sift_down(heap, heap->pos[last]);
+}
+
+#undef heap_less
+
+/*
+ * Finds the nearest neighbour of row i among the active rows after it,
+ * and queues the row with that distance. The last active row is dropped.
+ */
+static void find_nearest_neighbour(active_rows_t *active, heap_t *heap,
+                            int nn[], int i)
+{
+        float best;
+        int x = nearest_active(active, i, active_position(active, i) + 1,
+                               &best);
+        if (x < 0)
+                heap_remove(heap, i);
+        else {
+                nn[i] = x;
+                heap_update(heap, i, best);
+        }
+}
+
+/*
+ * Generic algorithm (D. Mullner, 2011) for linkages that are not
+ * reducible: every active row remembers its nearest neighbour among the
+ * rows after it, and rows are kept in an indexed min-heap by that
+ * distance, so the closest pair is always at the top. Neighbours that
+ * became stale through merging are only recomputed once they reach the
+ * top. Merges are recorded in the order they are made.
+ */
+static int generic_linkage(ahc_context_t *ctx, distance_matrix_t *matrix,
+                           merge_t merges[])
+{
+        int n = matrix->n, num_merges = 0;
+        int *nn = alloc_work(ctx, n, int);
+        active_rows_t *active = alloc_active_rows(ctx, matrix);
+        heap_t *heap = alloc_heap(ctx, n);
+        if (!nn || !active || !heap) {
+                alloc_fail("generic linkage");
+                num_merges = -1;
+                goto done;
+        }
+        for (int i = 0; i < n; ++i)
+                find_nearest_neighbour(active, heap, nn, i);
+
+        while (num_merges < n - 1) {
+                int a = heap->rows[0], b = nn[a];
+                float dab = matrix_get(matrix, a, b);
+                /* a NaN key, which equals nothing, is not stale either */
+                if (active->size[b] == 0 ||
+                    (dab != heap->key[a] &&
+                     !(isnan(dab) && isnan(heap->key[a])))) {
+                        find_nearest_neighbour(active, heap, nn, a);
+                        ctx->stats.stale_neighbours++;
+                        continue;
+                }
+                merges[num_merges].first = a;
+                merges[num_merges].second = b;
+                merges[num_merges++].distance =
+                        ctx->squared_distances ? sqrtf(dab) : dab;
+
+                /* the merged cluster takes over the row of b, after a */
+                heap_remove(heap, a);
+                merge_active(active, a, b, dab);
+                for (int k = 0; k < active->count; ++k) {
+                        int x = active->rows[k];
+                        if (x >= b)
+                                break;
+                        float dbx = matrix_get(matrix, b, x);
+                        if (x < a && nn[x] == a)
+                                nn[x] = b;
+                        if (dbx < heap->key[x]) {
+                                nn[x] = b;
+                                heap_update(heap, x, dbx);
+                        }
+                }
+                find_nearest_neighbour(active, heap, nn, b);
+        }
+done:
+        free_work(ctx, nn);
+        free_active_rows(active);
+        free_heap(ctx, heap);
+        return num_merges;
+}
+
+/*
+ * Copy of the points that the cosine and correlation metrics compute
+ * distances between: centred on their mean coordinate for correlation,
+ * and scaled to unit length. Points at the origin stay there. Other
+ * metrics get a plain copy, with the stride rounded up to a multiple of
+ * VECTOR_WIDTH.
+ */
+static float *copy_points(const ahc_context_t *ctx, points_t *points)
+{
+        int stride = (points->num_dims + VECTOR_WIDTH - 1) / VECTOR_WIDTH *
+                VECTOR_WIDTH;
+        float *coords = alloc_coords(points->num_items, stride);
+        if (!coords) {
+                alloc_fail("points");
+                return NULL;
+        }
+        for (int i = 0; i < points->num_items; ++i) {
+                const float *x = point_coord(points, i);
+                float *p = &coords[(size_t) i * stride];
+                double mean = 0.0, norm = 0.0;
+                memcpy(p, x, points->num_dims * sizeof(float));
+                if (!ctx->metric->normalise)
+                        continue;
+                if (ctx->metric->centre) {
+                        for (int k = 0; k < points->num_dims; ++k)
+                                mean += x[k];
+                        mean /= points->num_dims;
+                }
+                for (int k = 0; k < points->num_dims; ++k) {
+                        p[k] = x[k] - mean;
+                        norm += (double) p[k] * p[k];
+                }
+                if (norm > 0.0)
+                        for (int k = 0; k < points->num_dims; ++k)
+                                p[k] /= sqrt(norm);
+        }
+        points->coords = coords;
+        points->stride = stride;
+        return coords;
+}
+
+/*
+ * Merges the clusters of the distance matrix, which is overwritten with
+ * distances between clusters.
+ */
+static int linkage_merges(ahc_context_t *ctx, distance_matrix_t *matrix,
+                          ahc_merge_t out[])
+{
+        int n = matrix->n, ok;
+        merge_t *merges = alloc_work(ctx, n, merge_t);
+        if (!merges) {
+                alloc_fail("array of merges");
+                return 0;
+        }
+        start_timing(&(ctx->stats.merge));
+        ok = ctx->reducible_linkage ? nn_chain(ctx, matrix, merges) >= 0 :
+                generic_linkage(ctx, matrix, merges) >= 0;
+        stop_timing(&(ctx->stats.merge));
+        start_timing(&(ctx->stats.numbering));
+        for (int i = 0; ok && matrix->items && i < n - 1; ++i) {
+                merges[i].first = matrix->items[merges[i].first];
+                merges[i].second = matrix->items[merges[i].second];
+        }
+        ok = ok && (!ctx->reducible_linkage ||
+                    sort_merges(ctx, merges, n - 1)) &&
+                number_merges(ctx, merges, n, out);
+        stop_timing(&(ctx->stats.numbering));
+        free_work(ctx, merges);
+        return ok;
+}
+
+/*
+ * Few coordinates may be clustered without a distance matrix, through a
+ * k-d tree over slots that each hold the position of an active cluster:
+ * its centroid, or median, or in single linkage the point itself. Nodes
+ * keep the bounding box of the positions below them, which only grows
+ * as merged clusters move, and a bound on the keys below them.
+ */
+struct kd_node_s {
+        int begin, end; /* slots of the node in the order array */
+        int left, right; /* children, or -1 in leaves */
+        int parent; /* or -1 at the root */
+        int count; /* active slots below */
+        int component; /* single linkage: of every slot below, or -1 */
+        double max_key; /* no active slot below has a larger key */
+};
+
+struct kd_tree_s {
+        int n; /* number of slots */
+        int num_dims;
+        int num_nodes; /* the root comes first */
+        kd_node_t *nodes;
+        double *boxes; /* lower then upper bounds of each node */
+        double *coords; /* position of each slot */
+        int *order; /* slots, grouped by leaf */
+        int *leaf; /* leaf node of each slot */
+        char *active; /* slot holds a cluster */
+};
+
+#define kd_box(tree, id) (&((tree)->boxes[2 * (size_t) (id) *          \
+                                          (tree)->num_dims]))
+#define kd_coord(tree, slot) (&((tree)->coords[(size_t) (slot) *        \
+                                               (tree)->num_dims]))
+
+/* widens the box of lower and upper bounds to hold the point x */
+static void widen_box(int num_dims, double *box, const double *x)
+{
+        for (int i = 0; i < num_dims; ++i) {
+                if (x[i] < box[i])
+                        box[i] = x[i];
+                if (x[i] > box[num_dims + i])
+                        box[num_dims + i] = x[i];
+        }
+}
+
+/* squared distance from x to the nearest point of the box */
+static double box_distance(int num_dims, const double *box, const double *x)
+{
+        double d = 0.0;
+        for (int i = 0; i < num_dims; ++i) {
+                double t = x[i] < box[i] ? box[i] - x[i] :
+                        x[i] > box[num_dims + i] ? x[i] - box[num_dims + i] :
+                        0.0;
+                d += t * t;
+        }
+        return d;
+}
+
+static double squared_distance(int num_dims, const double *x, const double *y)
+{
+        double d = 0.0;
+        for (int i = 0; i < num_dims; ++i)
+                d += (x[i] - y[i]) * (x[i] - y[i]);
+        return d;
+}
+
+static void free_kd_tree(ahc_context_t *ctx, kd_tree_t *tree)
+{
+        if (tree) {
+                free_work(ctx, tree->nodes);
+                free_work(ctx, tree->boxes);
+                free_work(ctx, tree->coords);
+                free_work(ctx, tree->order);
+                free_work(ctx, tree->leaf);
+                free_work(ctx, tree->active);
+                free_work(ctx, tree);
+        }
+}
+
+/* reorders the slots from begin to end so that the k-th is in place */
+static void select_slots(kd_tree_t *tree, int begin, int end, int k, int dim)
+{
+        int *order = tree->order;
+        while (end - begin > 1) {
+                double pivot = kd_coord(tree, order[(begin + end) / 2])[dim];
+                int i = begin, j = end - 1;
+                while (i <= j) {
+                        while (kd_coord(tree, order[i])[dim] < pivot)
+                                ++i;
+                        while (kd_coord(tree, order[j])[dim] > pivot)
+                                --j;
+                        if (i <= j) {
+                                int t = order[i];
+                                order[i++] = order[j];
+                                order[j--] = t;
+                        }
+                }
+                if (k <= j)
+                        end = j + 1;
+                else if (k >= i)
+                        begin = i;
+                else
+                        return;
+        }
+}
+
+/* splits the slots at the median of their widest coordinate */
+static int build_kd_node(kd_tree_t *tree, int begin, int end, int parent)
+{
+        int id = tree->num_nodes++, num_dims = tree->num_dims;
+        kd_node_t *node = &(tree->nodes[id]);
+        double *box = kd_box(tree, id);
+        node->begin = begin;
+        node->end = end;
+        node->left = node->right = -1;
+        node->parent = parent;
+        node->count = end - begin;
+        node->component = -1;
+        for (int i = 0; i < num_dims; ++i) {
+                box[i] = DBL_MAX;
+                box[num_dims + i] = -DBL_MAX;
+        }
+        for (int k = begin; k < end; ++k)
+                widen_box(num_dims, box, kd_coord(tree, tree->order[k]));
+        if (end - begin <= KD_LEAF_SIZE) {
+                for (int k = begin; k < end; ++k)
+                        tree->leaf[tree->order[k]] = id;
+                return id;
+        }
+        int dim = 0, mid = begin + (end - begin) / 2;
+        for (int i = 1; i < num_dims; ++i)
+                if (box[num_dims + i] - box[i] >
+                    box[num_dims + dim] - box[dim])
+                        dim = i;
+        select_slots(tree, begin, end, mid, dim);
+        node->left = build_kd_node(tree, begin, mid, id);
+        node->right = build_kd_node(tree, mid, end, id);
+        return id;
+}
+
+static kd_tree_t *create_kd_tree(ahc_context_t *ctx, const points_t *points)
+{
+        int n = points->num_items, num_dims = points->num_dims;
+        /* leaves hold at least half of KD_LEAF_SIZE slots */
+        int max_nodes = 2 * (n / (KD_LEAF_SIZE / 2) + 1);
+        kd_tree_t *tree = alloc_work(ctx, 1, kd_tree_t);
+        if (!tree) {
+                alloc_fail("k-d tree");
+                return NULL;
+        }
+        tree->n = n;
+        tree->num_dims = num_dims;
+        tree->nodes = alloc_work(ctx, max_nodes, kd_node_t);
+        tree->boxes = alloc_work(ctx, 2 * (size_t) max_nodes * num_dims,
+                                 double);
+        tree->coords = alloc_work(ctx, (size_t) n * num_dims, double);
+        tree->order = alloc_work(ctx, n, int);
+        tree->leaf = alloc_work(ctx, n, int);
+        tree->active = alloc_work(ctx, n, char);
+        if (!tree->nodes || !tree->boxes || !tree->coords || !tree->order ||
+            !tree->leaf || !tree->active) {
+                alloc_fail("k-d tree");
+                free_kd_tree(ctx, tree);
+                return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+                const float *x = point_coord(points, i);
+                for (int j = 0; j < num_dims; ++j) {
+                        if (!isfinite(x[j])) {
+                                fprintf(stderr, "Invalid coordinates of "
+                                        "item %d.\n", i);
+                                free_kd_tree(ctx, tree);
+                                return NULL;
+                        }
+                        kd_coord(tree, i)[j] = x[j];
+                }
+                tree->order[i] = i;
+                tree->active[i] = 1;
+        }
+        build_kd_node(tree, 0, n, -1);
+        return tree;
+}
+
+static void kd_remove(kd_tree_t *tree, int slot)
+{
+        tree->active[slot] = 0;
+        for (int id = tree->leaf[slot]; id >= 0; id = tree->nodes[id].parent)
+                tree->nodes[id].count--;
+}
+
+static void kd_move(kd_tree_t *tree, int slot, const double *x)
+{
+        memcpy(kd_coord(tree, slot), x, tree->num_dims * sizeof(double));
+        for (int id = tree->leaf[slot]; id >= 0; id = tree->nodes[id].parent)
+                widen_box(tree->num_dims, kd_box(tree, id), x);
+}
+
+static void kd_raise_key(kd_tree_t *tree, int slot, double key)
+{
+        for (int id = tree->leaf[slot];
+             id >= 0 && tree->nodes[id].max_key < key;
+             id = tree->nodes[id].parent)
+                tree->nodes[id].max_key = key;
+}
+
+/*
+ * Search for the active slot nearest to x, other than its own, the lowest
+ * of those equally near. If components is not NULL, slots of the same
+ * component as x are skipped, and so are nodes wholly within it.
+ */
+typedef struct kd_query_s {
+        const double *x;
+        int self; /* slot of x */
+        int component; /* of x */
+        const int *components; /* of every slot, or NULL */
+        double best; /* squared distance to the nearest slot found */
+        int nearest; /* or -1 */
+        unsigned long long scanned; /* distances computed */
+} kd_query_t;
+
+/* d is the squared distance from x to the box of the node */
+static void kd_nearest(const kd_tree_t *tree, int id, double d,
+                       kd_query_t *query)
+{
+        const kd_node_t *node = &(tree->nodes[id]);
+        if (!node->count || d > query->best ||
+            (query->components && node->component == query->component))
+                return;
+        if (node->left < 0) {
+                for (int k = node->begin; k < node->end; ++k) {
+                        int slot = tree->order[k];
+                        if (!tree->active[slot] || slot == query->self ||
+                            (query->components &&
+                             query->components[slot] == query->component))
+                                continue;
+                        d = squared_distance(tree->num_dims, query->x,
+                                             kd_coord(tree, slot));
+                        query->scanned++;
+                        if (d < query->best ||
+                            (d == query->best && slot < query->nearest)) {
+                                query->best = d;
+                                query->nearest = slot;
+                        }
+                }
+                return;
+        }
+        double dl = box_distance(tree->num_dims, kd_box(tree, node->left),
+                                 query->x);
+        double dr = box_distance(tree->num_dims, kd_box(tree, node->right),
+                                 query->x);
+        if (dl <= dr) {
+                kd_nearest(tree, node->left, dl, query);
+                kd_nearest(tree, node->right, dr, query);
+        } else {
+                kd_nearest(tree, node->right, dr, query);
+                kd_nearest(tree, node->left, dl, query);
+        }
+}
+
+/* marks the nodes whose slots all belong to one component */
+static int label_kd_components(kd_tree_t *tree, int id, const int *components)
+{
+        kd_node_t *node = &(tree->nodes[id]);
+        int c;
+        if (node->left < 0) {
+                c = components[tree->order[node->begin]];
+                for (int k = node->begin + 1; k < node->end && c >= 0; ++k)
+                        if (components[tree->order[k]] != c)
+                                c = -1;
+        } else {
+                int a = label_kd_components(tree, node->left, components);
+                int b = label_kd_components(tree, node->right, components);
+                c = a == b ? a : -1;
+        }
+        return node->component = c;
+}
+
+/*
+ * Single linkage merges are the edges of a minimum spanning tree, built
+ * by Borůvka's algorithm: each round joins every component to the point
+ * of another that is nearest to one of its own. The searches of a round
+ * skip nodes wholly within the component, and nodes farther away than
+ * the nearest point found for the component so far. Components only
+ * grow, so the distance from a point to the nearest of another
+ * component never falls: the nearest found in an earlier round is still
+ * nearest while it lies in another component, and otherwise its
+ * distance bounds that of the next, as does the bound of a search that
+ * found nothing.
+ */
+static int kd_single_linkage(ahc_context_t *ctx, kd_tree_t *tree,
+                             merge_t merges[])
+{
+        int n = tree->n, num_merges = 0, ok = 0;
+        int squared = ctx->metric != metrics;
+        int *parent = alloc_work(ctx, n, int);
+        int *components = alloc_work(ctx, n, int);
+        int *nearest = alloc_work(ctx, n, int);
+        double *gap = alloc_work(ctx, n, double);
+        int *from = alloc_work(ctx, n, int);
+        int *to = alloc_work(ctx, n, int);
+        double *best = alloc_work(ctx, n, double);
+        if (!parent || !components || !nearest || !gap || !from || !to ||
+            !best) {
+                alloc_fail("spanning forest");
+                goto done;
+        }
+        for (int i = 0; i < n; ++i) {
+                parent[i] = components[i] = i;
+                nearest[i] = -1;
+                gap[i] = 0.0;
+        }
+        while (num_merges < n - 1) {
+                label_kd_components(tree, 0, components);
+                for (int i = 0; i < n; ++i)
+                        best[i] = DBL_MAX;
+                /* in the order of the leaves, for locality */
+                for (int k = 0; k < n; ++k) {
+                        int i = tree->order[k], c = components[i];
+                        if (nearest[i] < 0 ||
+                            components[nearest[i]] == c) {
+                                if (gap[i] >= best[c])
+                                        continue;
+                                kd_query_t query = {
+                                        kd_coord(tree, i), i, c, components,
+                                        best[c], -1, 0
+                                };
+                                kd_nearest(tree, 0, 0.0, &query);
+                                ctx->stats.neighbour_searches++;
+                                ctx->stats.rows_scanned += query.scanned;
+                                ctx->stats.distance_evaluations +=
+                                        query.scanned;
+                                nearest[i] = query.nearest;
+                                gap[i] = query.best;
+                                if (nearest[i] < 0)
+                                        continue;
+                        }
+                        if (gap[i] < best[c]) {
+                                best[c] = gap[i];
+                                from[c] = i;
+                                to[c] = nearest[i];
+                        }
+                }
+                for (int c = 0; c < n; ++c) {
+                        if (best[c] == DBL_MAX)
+                                continue;
+                        int a = find_set(parent, from[c]);
+                        int b = find_set(parent, to[c]);
+                        if (a == b)
+                                continue;
+                        parent[b] = a;
+                        merges[num_merges].first = from[c];
+                        merges[num_merges].second = to[c];
+                        merges[num_merges].distance =
+                                squared ? best[c] : sqrt(best[c]);
+                        num_merges++;
+                }
+                for (int i = 0; i < n; ++i)
+                        components[i] = find_set(parent, i);
+        }
+        ok = 1;
+done:
+        free_work(ctx, parent);
+        free_work(ctx, components);
+        free_work(ctx, nearest);
+        free_work(ctx, gap);
+        free_work(ctx, from);
+        free_work(ctx, to);
+        free_work(ctx, best);
+        return ok;
+}
+
+/*
+ * Active clusters of centroid or median linkage, keyed in the heap by
+ * the squared distance to their nearest neighbour, which is stale once
+ * that neighbour has been merged. A merged cluster takes the slot of
+ * one of its parts, whose version is then bumped.
+ */
+typedef struct kd_clusters_s {
+        ahc_context_t *ctx;
+        kd_tree_t *tree;
+        heap_t *heap;
+        int *nearest; /* slot of the nearest neighbour */
+        int *seen; /* version of that slot when it was found */
+        int *version; /* of each slot */
+        int *size; /* items in each cluster */
+        double *position; /* of the next merged cluster */
+} kd_clusters_t;
+
+static void free_kd_clusters(kd_clusters_t *clusters)
+{
+        ahc_context_t *ctx = clusters->ctx;
+        free_heap(ctx, clusters->heap);
+        free_work(ctx, clusters->nearest);
+        free_work(ctx, clusters->seen);
+        free_work(ctx, clusters->version);
+        free_work(ctx, clusters->size);
+        free_work(ctx, clusters->position);
+}
+
+static void find_kd_neighbour(kd_clusters_t *clusters, int slot)
+{
+        kd_tree_t *tree = clusters->tree;
+        kd_query_t query = {
+                kd_coord(tree, slot), slot, -1, NULL, DBL_MAX, -1, 0
+        };
+        kd_nearest(tree, 0, 0.0, &query);
+        clusters->ctx->stats.neighbour_searches++;
+        clusters->ctx->stats.rows_scanned += query.scanned;
+        clusters->ctx->stats.distance_evaluations += query.scanned;
+        clusters->nearest[slot] = query.nearest;
+        clusters->seen[slot] = clusters->version[query.nearest];
+        heap_update(clusters->heap, slot, query.best);
+        kd_raise_key(tree, slot, clusters->heap->key[slot]);
+}
+
+/*
+ * Makes the cluster in the slot the nearest neighbour of those it is
+ * nearer to than their keys, skipping nodes whose keys are all nearer.
+ * Keys only fall here, so the bounds of the nodes still hold.
+ */
+static void claim_kd_neighbours(kd_clusters_t *clusters, int id, int slot)
+{
+        kd_tree_t *tree = clusters->tree;
+        const kd_node_t *node = &(tree->nodes[id]);
+        const double *x = kd_coord(tree, slot);
+        if (!node->count ||
+            box_distance(tree->num_dims, kd_box(tree, id), x) >=
+            node->max_key)
+                return;
+        if (node->left >= 0) {
+                claim_kd_neighbours(clusters, node->left, slot);
+                claim_kd_neighbours(clusters, node->right, slot);
+                return;
+        }
+        for (int k = node->begin; k < node->end; ++k) {
+                int other = tree->order[k];
+                if (!tree->active[other] || other == slot)
+                        continue;
+                float d = squared_distance(tree->num_dims, x,
+                                           kd_coord(tree, other));
+                clusters->ctx->stats.distance_evaluations++;
+                if (d < clusters->heap->key[other]) {
+                        heap_update(clusters->heap, other, d);
+                        clusters->nearest[other] = slot;
+                        clusters->seen[other] = clusters->version[slot];
+                }
+        }
+}
+
+/*
+ * The generic algorithm of Müllner, as in generic_linkage(), finding
+ * nearest neighbours through the tree instead of scanning matrix rows.
+ * Distances are computed between the positions of the clusters, which
+ * agree with the Lance-Williams updates up to rounding.
+ */
+static int kd_generic_linkage(ahc_context_t *ctx, kd_tree_t *tree,
+                              merge_t merges[])
+{
+        int n = tree->n, num_dims = tree->num_dims, ok = 0;
+        int median = ctx->update_distances == update_median;
+        kd_clusters_t clusters = {
+                ctx, tree, alloc_heap(ctx, n),
+                alloc_work(ctx, n, int), alloc_work(ctx, n, int),
+                alloc_work(ctx, n, int), alloc_work(ctx, n, int),
+                alloc_work(ctx, num_dims, double)
+        };
+        heap_t *heap = clusters.heap;
+        if (!heap || !clusters.nearest || !clusters.seen ||
+            !clusters.version || !clusters.size || !clusters.position) {
+                alloc_fail("nearest neighbours");
+                goto done;
+        }
+        for (int i = 0; i < n; ++i)
+                clusters.size[i] = ctx->weights ? ctx->weights[i] : 1;
+        for (int k = 0; k < n; ++k)
+                find_kd_neighbour(&clusters, tree->order[k]);
+        for (int i = 0; i < n - 1;) {
+                int a = heap->rows[0], b = clusters.nearest[a];
+                if (!tree->active[b] ||
+                    clusters.seen[a] != clusters.version[b]) {
+                        ctx->stats.stale_neighbours++;
+                        find_kd_neighbour(&clusters, a);
+                        continue;
+                }
+                merges[i].first = a;
+                merges[i].second = b;
+                merges[i].distance = sqrtf(heap->key[a]);
+                if (++i == n - 1)
+                        break;
+                const double *x = kd_coord(tree, a), *y = kd_coord(tree, b);
+                double wa = median ? 1.0 : clusters.size[a];
+                double wb = median ? 1.0 : clusters.size[b];
+                for (int j = 0; j < num_dims; ++j)
+                        clusters.position[j] =
+                                (wa * x[j] + wb * y[j]) / (wa + wb);
+                heap_remove(heap, a);
+                kd_remove(tree, a);
+                kd_move(tree, b, clusters.position);
+                clusters.size[b] += clusters.size[a];
+                clusters.version[b]++;
+                claim_kd_neighbours(&clusters, 0, b);
+                find_kd_neighbour(&clusters, b);
+        }
+        ok = 1;
+done:
+        free_kd_clusters(&clusters);
+        return ok;
+}
+
+/* few coordinates under euclidean distances are clustered by a k-d tree */
+static int use_kd_tree(const ahc_context_t *ctx, int num_dims)
+{
+        if (!ctx->spatial_index || num_dims > KD_MAX_DIMS)
+                return 0;
+        if (ctx->update_distances == update_single)
+                return ctx->metric == metrics || ctx->metric == metrics + 1;
+        return ctx->update_distances == update_centroid ||
+                ctx->update_distances == update_median;
+}
+
+static int kd_tree_merges(ahc_context_t *ctx, const points_t *points,
+                          ahc_merge_t out[])
+{
+        int n = points->num_items, ok = 0;
+        int single = ctx->update_distances == update_single;
+        merge_t *merges = alloc_work(ctx, n, merge_t);
+        kd_tree_t *tree = NULL;
+        if (!merges) {
+                alloc_fail("array of merges");
+                return 0;
+        }
+        start_timing(&(ctx->stats.merge));
+        tree = create_kd_tree(ctx, points);
+        ok = tree && (single ? kd_single_linkage(ctx, tree, merges) :
+                      kd_generic_linkage(ctx, tree, merges));
+        stop_timing(&(ctx->stats.merge));
+        start_timing(&(ctx->stats.numbering));
+        ok = ok && (!single || sort_merges(ctx, merges, n - 1)) &&
+                number_merges(ctx, merges, n, out);
+        stop_timing(&(ctx->stats.numbering));
+        free_kd_tree(ctx, tree);
+        free_work(ctx, merges);
+        return ok;
+}
+
+/*
+ * Points whose distances go to a scratch matrix are reordered along the
+ * leaves of a k-d tree, so that each tile holds the distances between
+ * two compact groups of items, and the tiles far from an item have
+ * minima large enough to be passed over. Returns the item of each
+ * point, or NULL, and replaces the copy of the points.
+ */
+static int *order_points(ahc_context_t *ctx, points_t *points, float **copy)
+{
+        int n = points->num_items, stride = points->stride;
+        kd_tree_t *tree = create_kd_tree(ctx, points);
+        int *items = alloc_work(ctx, n, int);
+        float *coords = alloc_coords(n, stride);
+        if (!tree || !items || !coords) {
+                if (tree)
+                        alloc_fail("reordered items");
+                free_kd_tree(ctx, tree);
+                free_work(ctx, items);
+                free(coords);
+                return NULL;
+        }
+        for (int i = 0; i < n; ++i) {
+                items[i] = tree->order[i];
+                memcpy(&(coords[(size_t) i * stride]),
+                       point_coord(points, items[i]), stride * sizeof(float));
+        }
+        free_kd_tree(ctx, tree);
+        free(*copy);
+        *copy = coords;
+        points->coords = coords;
+        return items;
+}
+
+/*
+ * Ward distances between clusters of wi and wj items start at
+ * 2 wi wj / (wi + wj) times the squared distance between their centroids,
+ * which is the squared distance itself between single items.
+ */
+static void weigh_ward_distances(const ahc_context_t *ctx,
+                                 distance_matrix_t *matrix)
+{
+        /* weights are at least 1, so no entry falls below its tile minimum */
+        for (int i = 0; i < matrix->n; ++i) {
+                double wi = row_weight(ctx, matrix, i);
+                for (int j = i + 1; j < matrix->n; ++j) {
+                        double wj = row_weight(ctx, matrix, j);
+                        double d = matrix_get(matrix, i, j) * 2.0 * wi *
+                                wj / (wi + wj);
+                        matrix_set(matrix, i, j, d < FLT_MAX ? d : FLT_MAX);
+                }
+        }
+}
+
+/*
+ * Squared distances fit a float while the bounding box of the points has
+ * a diagonal of at most about 1.8e19, beyond which centroid, median and
+ * Ward linkage cannot cluster them.
+ */
+static int fits_squared(const ahc_context_t *ctx)
+{
+        if (ctx->kernel_bound <= FLT_MAX)
+                return 1;
+        fprintf(stderr, "The items are too far apart for squared "
+                "distances in single precision.\n");
+        return 0;
+}
+
+/*
+ * Clusters points ready for the distance kernel, whose copy, if any, may
+ * be replaced.
+ */
+static int cluster_points(ahc_context_t *ctx, points_t *points,
+                          float **copy, ahc_merge_t merges[])
+{
+        int ok = 0;
+        if (ctx->squared_distances && !fits_squared(ctx))
+                return 0;
+        if (use_kd_tree(ctx, points->num_dims))
+                return kd_tree_merges(ctx, points, merges);
+        if (ctx->update_distances == update_single)
+                return single_linkage_merges(ctx, points, merges);
+        distance_matrix_t *matrix = NULL;
+        int *items = NULL;
+        if (!ctx->scratch_dir || (items = order_points(ctx, points, copy)))
+                matrix = generate_distance_matrix(ctx, points);
+        if (matrix) {
+                matrix->items = items;
+                if (ctx->weights && ctx->update_distances == update_ward)
+                        weigh_ward_distances(ctx, matrix);
+                ok = linkage_merges(ctx, matrix, merges);
+                free_distance_matrix(ctx, matrix);
+        }
+        free_work(ctx, items);
+        return ok;
+}
+
+static int valid_points(size_t n, int num_dims, size_t stride)
+{
+        if (n > INT_MAX / 2) {
+                fprintf(stderr, "Too many items to cluster.\n");
+                return 0;
+        }
+        if (num_dims < 1 || stride < num_dims || stride > INT_MAX / 2) {
+                fprintf(stderr, "Invalid number of coordinates.\n");
+                return 0;
+        }
+        return 1;
+}
+
+/* coordinates that are not numbers, or infinite, have no distances */
+static int finite_points(const points_t *points)
+{
+        for (int i = 0; i < points->num_items; ++i) {
+                const float *x = point_coord(points, i);
+                for (int k = 0; k < points->num_dims; ++k)
+                        if (!isfinite(x[k])) {
+                                fprintf(stderr, "Invalid coordinates of "
+                                        "item %d.\n", i);
+                                return 0;
+                        }
+        }
+        return 1;
+}
+
+/* the upper triangle of the distances, which is all that is used */
+static int finite_distances(const distance_matrix_t *matrix)
+{
+        const float *d = matrix->data;
+        for (int i = 0; i < (int) matrix->n - 1; ++i) {
+                const float *row = d + matrix_index(matrix, i, i + 1);
+                for (int j = i + 1; j < (int) matrix->n; ++j)
+                        if (!isfinite(row[j - i - 1])) {
+                                fprintf(stderr, "Invalid distance between "
+                                        "items %d and %d.\n", i, j);
+                                return 0;
+                        }
+        }
+        return 1;
+}
+
+int ahc_distances(ahc_context_t *ctx, const float *coords, size_t n,
+                  int num_dims, size_t stride, float distances[])
+{
+        points_t points = { n, num_dims, stride, coords };
+        distance_matrix_t matrix = { .n = n, .data = distances };
+        float *copy = NULL;
+        int squared = ctx->squared_distances;
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        if (!valid_points(n, num_dims, stride))
+                return 0;
+        if (n < 2)
+                return 1;
+        if ((stride % VECTOR_WIDTH || ctx->metric->normalise) &&
+            !(copy = copy_points(ctx, &points)))
+                return 0;
+        ctx->squared_distances = 0;
+        int ok = select_distance_kernel(ctx, &points);
+        if (ok)
+                fill_distances(ctx, &matrix, &points);
+        ctx->squared_distances = squared;
+        free(copy);
+        return ok;
+}
+
+int ahc_cluster(ahc_context_t *ctx, const float *coords, size_t n,
+                int num_dims, size_t stride, ahc_merge_t merges[])
+{
+        return ahc_cluster_weighted(ctx, coords, NULL, n, num_dims, stride,
+                                    merges);
+}
+
+int ahc_cluster_weighted(ahc_context_t *ctx, const float *coords,
+                         const int weights[], size_t n, int num_dims,
+                         size_t stride, ahc_merge_t merges[])
+{
+        points_t points = { n, num_dims, stride, coords };
+        float *copy = NULL;
+        int ok = 0;
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        if (!valid_points(n, num_dims, stride))
+                return 0;
+        for (size_t i = 0; weights && i < n; ++i)
+                if (weights[i] < 1) {
+                        fprintf(stderr, "Invalid weight of point %zu.\n", i);
+                        return 0;
+                }
+        if (!finite_points(&points))
+                return 0;
+        if (ctx->squared_distances && ctx->metric != metrics) {
+                fprintf(stderr, "Centroid, median and Ward linkage "
+                        "need the euclidean metric.\n");
+                return 0;
+        }
+        if (n < 2)
+                return 1;
+        if ((stride % VECTOR_WIDTH || ctx->metric->normalise) &&
+            !(copy = copy_points(ctx, &points)))
+                return 0;
+        if (!select_distance_kernel(ctx, &points)) {
+                free(copy);
+                return 0;
+        }
+        ctx->weights = weights;
+        ok = cluster_points(ctx, &points, &copy, merges);
+        ctx->weights = NULL;
+        free(copy);
+        return ok;
+}
+
+int ahc_cluster_matrix(ahc_context_t *ctx, float *distances, size_t n,
+                       int square, ahc_merge_t merges[])
+{
+        distance_matrix_t matrix = {
+                .n = n, .square = square != 0, .data = distances
+        };
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        if (n > INT_MAX / 2) {
+                fprintf(stderr, "Too many items to cluster.\n");
+                return 0;
+        }
+        if (ctx->squared_distances) {
+                fprintf(stderr, "Centroid, median and Ward linkage "
+                        "need coordinates, not a distance matrix.\n");
+                return 0;
+        }
+        return n < 2 || (finite_distances(&matrix) &&
+                         linkage_merges(ctx, &matrix, merges));
+}
+
+/*
+ * Nearest k items to each item, nearest first. Few coordinates under
+ * euclidean distances are searched for through a k-d tree, and others
+ * by computing the distances to every item, a row at a time.
+ */
+typedef struct knn_task_s {
+        const ahc_context_t *ctx;
+        const points_t *points;
+        const kd_tree_t *tree; /* or NULL */
+        int k;
+        int *neighbours; /* k per item */
+        double *best; /* k distances per thread */
+        float *rows; /* n distances per thread, without a tree */
+} knn_task_t;
+
+/* inserts slot at distance d among the count nearest, nearest first */
+static void insert_neighbour(double best[], int nearest[], int *count,
+                             int k, double d, int slot)
+{
+        if (*count == k && (d > best[k - 1] ||
+                            (d == best[k - 1] && slot > nearest[k - 1])))
+                return;
+        int i = *count < k ? (*count)++ : k - 1;
+        for (; i > 0 && (best[i - 1] > d ||
+                         (best[i - 1] == d && nearest[i - 1] > slot)); --i) {
+                best[i] = best[i - 1];
+                nearest[i] = nearest[i - 1];
+        }
+        best[i] = d;
+        nearest[i] = slot;
+}
+
+typedef struct kd_knn_s {
+        const double *x;
+        int self; /* slot of x */
+        int k, count; /* wanted and found */
+        double *best; /* squared distances, nearest first */
+        int *nearest; /* slots found */
+        unsigned long long scanned; /* distances computed */
+} kd_knn_t;
+
+/* d is the squared distance from x to the box of the node */
+static void kd_k_nearest(const kd_tree_t *tree, int id, double d,
+                         kd_knn_t *query)
+{
+        const kd_node_t *node = &(tree->nodes[id]);
+        if (query->count == query->k && d > query->best[query->k - 1])
+                return;
+        if (node->left < 0) {
+                for (int k = node->begin; k < node->end; ++k) {
+                        int slot = tree->order[k];
+                        if (slot == query->self)
+                                continue;
+                        insert_neighbour(query->best, query->nearest,
+                                         &(query->count), query->k,
+                                         squared_distance(tree->num_dims,
+                                                          query->x,
+                                                          kd_coord(tree,
+                                                                   slot)),
+                                         slot);
+                        query->scanned++;
+                }
+                return;
+        }
+        double dl = box_distance(tree->num_dims, kd_box(tree, node->left),
+                                 query->x);
+        double dr = box_distance(tree->num_dims, kd_box(tree, node->right),
+                                 query->x);
+        if (dl <= dr) {
+                kd_k_nearest(tree, node->left, dl, query);
+                kd_k_nearest(tree, node->right, dr, query);
+        } else {
+                kd_k_nearest(tree, node->right, dr, query);
+                kd_k_nearest(tree, node->left, dl, query);
+        }
+}
+
+static void find_neighbours(void *arg, int thread, int count)
+{
+        knn_task_t *task = arg;
+        const points_t *points = task->points;
+        int n = points->num_items, k = task->k, begin, end;
+        double *best = &(task->best[(size_t) thread * k]);
+        split_range(n, thread, count, &begin, &end);
+        for (int i = begin; i < end; ++i) {
+                int *nearest = &(task->neighbours[(size_t) i * k]);
+                int found = 0;
+                if (task->tree) {
+                        kd_knn_t query = {
+                                kd_coord(task->tree, i), i, k, 0, best,
+                                nearest, 0
+                        };
+                        kd_k_nearest(task->tree, 0, 0.0, &query);
+                        found = query.count;
+                } else {
+                        float *row = &(task->rows[(size_t) thread * n]);
+                        compute_distances(task->ctx, point_coord(points, i),
+                                          points->coords, n, points->stride,
+                                          row);
+                        for (int j = 0; j < n; ++j)
+                                if (j != i)
+                                        insert_neighbour(best, nearest,
+                                                         &found, k, row[j],
+                                                         j);
+                }
+                for (int t = found; t < k; ++t)
+                        nearest[t] = -1;
+        }
+}
+
+int ahc_knn_graph(ahc_context_t *ctx, const float *coords, size_t n,
+                  int num_dims, size_t stride, int k, int neighbours[])
+{
+        points_t points = { n, num_dims, stride, coords };
+        knn_task_t task = { ctx, &points, NULL, k, neighbours };
+        float *copy = NULL;
+        int ok = 0, threads = ahc_num_threads(ctx);
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        if (!valid_points(n, num_dims, stride))
+                return 0;
+        if (k < 1) {
+                fprintf(stderr, "Invalid number of neighbours.\n");
+                return 0;
+        }
+        if ((stride % VECTOR_WIDTH || ctx->metric->normalise) &&
+            !(copy = copy_points(ctx, &points)))
+                return 0;
+        if (!select_distance_kernel(ctx, &points)) {
+                free(copy);
+                return 0;
+        }
+        start_timing(&(ctx->stats.distances));
+        if (num_dims <= KD_MAX_DIMS &&
+            (ctx->metric == metrics || ctx->metric == metrics + 1) &&
+            !(task.tree = create_kd_tree(ctx, &points)))
+                goto done;
+        task.best = alloc_work(ctx, (size_t) threads * k, double);
+        if (!task.tree)
+                task.rows = alloc_work(ctx, (size_t) threads * n, float);
+        if (!task.best || (!task.tree && !task.rows)) {
+                alloc_fail("nearest neighbours");
+                goto done;
+        }
+        ahc_parallel(ctx, find_neighbours, &task,
+                     task.tree ? n * (size_t) k : n * n);
+        ctx->stats.neighbour_searches += n;
+        ok = 1;
+done:
+        stop_timing(&(ctx->stats.distances));
+        free_kd_tree(ctx, (kd_tree_t *) task.tree);
+        free_work(ctx, task.best);
+        free_work(ctx, task.rows);
+        free(copy);
+        return ok;
+}
+
+/*
+ * Clusters joined by the edges of a connectivity graph each keep a list
+ * of their neighbours, sorted by cluster. Clusters are numbered as in
+ * ahc_merge_t, so a merged cluster comes after all others, and is added
+ * to the end of the lists of its neighbours, in place of the clusters
+ * merged into it. The lists lie in a pool in the order of their
+ * clusters, and merged lists are added at its end; as merging never
+ * lengthens other lists, compacting the pool when it fills leaves it
+ * at most half full.
+ */
+typedef struct graph_entry_s {
+        int node; /* neighbouring cluster */
+        int edges; /* edges of the graph between the two clusters */
+        double value; /* distance, or sum of edge distances if average */
+} graph_entry_t;
+
+typedef struct graph_s {
+        ahc_context_t *ctx;
+        int n; /* items */
+        int num_dims; /* of positions */
+        graph_entry_t *pool;
+        size_t capacity, used; /* entries in the pool */
+        size_t *first; /* entry of the list of each cluster */
+        int *degree; /* length of that list, or -1 once merged */
+        int *size; /* items in each cluster */
+        int *leaf; /* an item in each cluster */
+        int *nn; /* nearest neighbour of each cluster */
+        double *pos; /* centroid or median, for squared distances */
+        heap_t *heap; /* clusters by the distance to their neighbour */
+} graph_t;
+
+#define graph_list(graph, c) (&((graph)->pool[(graph)->first[c]]))
+#define graph_pos(graph, c) (&((graph)->pos[(size_t) (c) *            \
+                                             (graph)->num_dims]))
+
+static void free_graph(graph_t *graph)
+{
+        ahc_context_t *ctx = graph->ctx;
+        free_work(ctx, graph->pool);
+        free_work(ctx, graph->first);
+        free_work(ctx, graph->degree);
+        free_work(ctx, graph->size);
+        free_work(ctx, graph->leaf);
+        free_work(ctx, graph->nn);
+        free_work(ctx, graph->pos);
+        free_heap(ctx, graph->heap);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+        const graph_entry_t *x = a, *y = b;
+        return (x->node > y->node) - (x->node < y->node);
+}
+
+static inline double entry_distance(const graph_t *graph,
+                                    const graph_entry_t *entry)
+{
+        return graph->ctx->update_distances == update_average ?
+                entry->value / entry->edges : entry->value;
+}
+
+/*
+ * Sorts the lists of the items, read from the edges of the graph in
+ * either direction, drops repeated edges and loops, and computes the
+ * distances along the edges.
+ */
+typedef struct edge_task_s {
+        graph_t *graph;
+        const points_t *points;
+} edge_task_t;
+
+static void edge_distances(void *arg, int thread, int count)
+{
+        edge_task_t *task = arg;
+        graph_t *graph = task->graph;
+        const points_t *points = task->points;
+        int begin, end;
+        split_range(graph->n, thread, count, &begin, &end);
+        for (int i = begin; i < end; ++i) {
+                graph_entry_t *list = graph_list(graph, i);
+                int degree = 0;
+                qsort(list, graph->degree[i], sizeof(graph_entry_t),
+                      compare_entries);
+                for (int t = 0; t < graph->degree[i]; ++t) {
+                        if (list[t].node == i || (degree &&
+                            list[t].node == list[degree - 1].node))
+                                continue;
+                        float d;
+                        compute_distances(graph->ctx, point_coord(points, i),
+                                          point_coord(points, list[t].node),
+                                          1, points->stride, &d);
+                        list[degree].node = list[t].node;
+                        list[degree].edges = 1;
+                        list[degree++].value = d;
+                }
+                graph->degree[i] = degree;
+        }
+}
+
+static int load_graph(graph_t *graph, const points_t *points,
+                      const size_t offsets[], const int adjacent[])
+{
+        ahc_context_t *ctx = graph->ctx;
+        int n = graph->n, squared = ctx->squared_distances;
+        size_t total = 0;
+        edge_task_t task = { graph, points };
+        graph->first = alloc_work(ctx, 2 * n - 1, size_t);
+        graph->degree = alloc_work(ctx, 2 * n - 1, int);
+        graph->size = alloc_work(ctx, 2 * n - 1, int);
+        graph->leaf = alloc_work(ctx, 2 * n - 1, int);
+        graph->nn = alloc_work(ctx, 2 * n - 1, int);
+        graph->heap = alloc_heap(ctx, 2 * n - 1);
+        if (squared)
+                graph->pos = alloc_work(ctx, (size_t) (2 * n - 1) *
+                                        graph->num_dims, double);
+        if (!graph->first || !graph->degree || !graph->size ||
+            !graph->leaf || !graph->nn || !graph->heap ||
+            (squared && !graph->pos)) {
+                alloc_fail("connectivity graph");
+                return 0;
+        }
+        for (int i = 0; i < n; ++i) {
+                if (offsets[i + 1] < offsets[i]) {
+                        fprintf(stderr, "Invalid edges of item %d.\n", i);
+                        return 0;
+                }
+                for (size_t t = offsets[i]; t < offsets[i + 1]; ++t) {
+                        int j = adjacent[t];
+                        if (j >= n) {
+                                fprintf(stderr, "Invalid edge from item "
+                                        "%d.\n", i);
+                                return 0;
+                        }
+                        if (j >= 0) {
+                                graph->degree[i]++;
+                                graph->degree[j]++;
+                                total += 2;
+                        }
+                }
+        }
+        graph->capacity = 2 * total + 1;
+        if (!(graph->pool = alloc_work(ctx, graph->capacity,
+                                       graph_entry_t))) {
+                alloc_fail("connectivity graph");
+                return 0;
+        }
+        for (int i = 0; i < n; ++i) {
+                graph->first[i] = graph->used;
+                graph->used += graph->degree[i];
+                graph->degree[i] = 0;
+                graph->size[i] = 1;
+                graph->leaf[i] = i;
+                for (int k = 0; squared && k < graph->num_dims; ++k)
+                        graph_pos(graph, i)[k] = point_coord(points, i)[k];
+        }
+        for (int i = 0; i < n; ++i)
+                for (size_t t = offsets[i]; t < offsets[i + 1]; ++t) {
+                        int j = adjacent[t];
+                        if (j < 0)
+                                continue;
+                        graph_list(graph, i)[graph->degree[i]++].node = j;
+                        graph_list(graph, j)[graph->degree[j]++].node = i;
+                }
+        ahc_parallel(ctx, edge_distances, &task, total * points->stride);
+        ctx->stats.distance_evaluations += total;
+        return 1;
+}
+
+/* queues cluster c by the distance to its nearest neighbour, if any */
+static void find_graph_neighbour(graph_t *graph, int c)
+{
+        const graph_entry_t *list = graph_list(graph, c);
+        double best = DBL_MAX;
+        graph->ctx->stats.neighbour_searches++;
+        graph->ctx->stats.rows_scanned += graph->degree[c];
+        for (int t = 0; t < graph->degree[c]; ++t) {
+                double d = entry_distance(graph, &list[t]);
+                if (d < best) {
+                        best = d;
+                        graph->nn[c] = list[t].node;
+                }
+        }
+        if (graph->degree[c])
+                heap_update(graph->heap, c, best);
+        else
+                heap_remove(graph->heap, c);
+}
+
+/* the merged cluster c and another, x, by the distance between them */
+static void join_graph_entry(graph_t *graph, int c, graph_entry_t *entry,
+                             const graph_entry_t *other)
+{
+        ahc_context_t *ctx = graph->ctx;
+        int x = entry->node;
+        if (ctx->squared_distances) {
+                double n = graph->size[c], nx = graph->size[x];
+                entry->value = squared_distance(graph->num_dims,
+                                                graph_pos(graph, c),
+                                                graph_pos(graph, x));
+                if (ctx->update_distances == update_ward)
+                        entry->value *= 2.0 * n * nx / (n + nx);
+        } else if (!other)
+                return;
+        else if (ctx->update_distances == update_single)
+                entry->value = fmin(entry->value, other->value);
+        else if (ctx->update_distances == update_complete)
+                entry->value = fmax(entry->value, other->value);
+        else if (ctx->update_distances == update_weighted)
+                entry->value = (entry->value + other->value) / 2.0;
+        else
+                entry->value += other->value;
+        if (other)
+                entry->edges += other->edges;
+}
+
+/* makes room at the end of the pool for count more entries */
+static void reserve_graph_entries(graph_t *graph, int last, size_t count)
+{
+        if (graph->used + count <= graph->capacity)
+                return;
+        graph->used = 0;
+        for (int c = 0; c <= last; ++c)
+                if (graph->degree[c] > 0) {
+                        memmove(&(graph->pool[graph->used]),
+                                graph_list(graph, c),
+                                graph->degree[c] * sizeof(graph_entry_t));
+                        graph->first[c] = graph->used;
+                        graph->used += graph->degree[c];
+                }
+}
+
+/*
+ * Merges clusters a and b into cluster c: its list joins theirs, and
+ * replaces them in the lists of its neighbours, whose nearest neighbours
+ * are found again if they were a or b.
+ */
+static void merge_graph_clusters(graph_t *graph, int a, int b, int c)
+{
+        int na = graph->degree[a], nb = graph->degree[b], degree = 0;
+        reserve_graph_entries(graph, c - 1, na + nb);
+        const graph_entry_t *la = graph_list(graph, a);
+        const graph_entry_t *lb = graph_list(graph, b);
+        graph->first[c] = graph->used;
+        graph->size[c] = graph->size[a] + graph->size[b];
+        graph->leaf[c] = graph->leaf[a];
+        if (graph->pos) {
+                double wa = graph->size[a], wb = graph->size[b];
+                if (graph->ctx->update_distances == update_median)
+                        wa = wb = 1.0;
+                for (int k = 0; k < graph->num_dims; ++k)
+                        graph_pos(graph, c)[k] = (wa * graph_pos(graph, a)[k]
+                                                  + wb * graph_pos(graph,
+                                                                   b)[k]) /
+                                (wa + wb);
+        }
+        graph_entry_t *list = graph_list(graph, c);
+        for (int s = 0, t = 0; s < na || t < nb;) {
+                int x = s < na ? la[s].node : INT_MAX;
+                int y = t < nb ? lb[t].node : INT_MAX;
+                if (x == b) {
+                        ++s;
+                        continue;
+                }
+                if (y == a) {
+                        ++t;
+                        continue;
+                }
+                list[degree] = x <= y ? la[s] : lb[t];
+                join_graph_entry(graph, c, &list[degree],
+                                 x == y ? &lb[t] : NULL);
+                degree++;
+                s += x <= y;
+                t += y <= x;
+        }
+        graph->used += degree;
+        graph->degree[c] = degree;
+        graph->degree[a] = graph->degree[b] = -1;
+        heap_remove(graph->heap, a);
+        heap_remove(graph->heap, b);
+        graph->ctx->stats.distance_updates += degree;
+        for (int t = 0; t < degree; ++t) {
+                int x = list[t].node, k = 0;
+                graph_entry_t *lx = graph_list(graph, x);
+                for (int s = 0; s < graph->degree[x]; ++s)
+                        if (lx[s].node != a && lx[s].node != b)
+                                lx[k++] = lx[s];
+                lx[k] = list[t];
+                lx[k].node = c;
+                graph->degree[x] = k + 1;
+                if (graph->nn[x] == a || graph->nn[x] == b)
+                        find_graph_neighbour(graph, x);
+                else if (entry_distance(graph, &list[t]) <
+                         graph->heap->key[x]) {
+                        graph->nn[x] = c;
+                        heap_update(graph->heap, x,
+                                    entry_distance(graph, &list[t]));
+                }
+        }
+        find_graph_neighbour(graph, c);
+}
+
+/*
+ * Merges the closest pair of clusters joined by an edge, as the generic
+ * algorithm does, until no edges are left. Clusters of different
+ * components of the graph are then merged at an infinite distance.
+ */
+static int graph_merges(graph_t *graph, merge_t merges[])
+{
+        int n = graph->n, c = n;
+        heap_t *heap = graph->heap;
+        for (int i = 0; i < n; ++i)
+                find_graph_neighbour(graph, i);
+        for (; heap->size; ++c) {
+                int a = heap->rows[0], b = graph->nn[a];
+                double d = heap->key[a];
+                merges[c - n].first = graph->leaf[a];
+                merges[c - n].second = graph->leaf[b];
+                merges[c - n].distance = graph->ctx->squared_distances ?
+                        sqrt(d) : d;
+                merge_graph_clusters(graph, a, b, c);
+        }
+        for (int x = 0, last = c, root = -1; x < last; ++x) {
+                if (graph->degree[x] < 0)
+                        continue;
+                if (root >= 0) {
+                        merges[c - n].first = graph->leaf[root];
+                        merges[c - n].second = graph->leaf[x];
+                        merges[c - n].distance = INFINITY;
+                        graph->leaf[c++] = graph->leaf[root];
+                }
+                root = x;
+                graph->degree[x] = -1;
+        }
+        return c - n;
+}
+
+int ahc_cluster_graph(ahc_context_t *ctx, const float *coords, size_t n,
+                      int num_dims, size_t stride, const size_t offsets[],
+                      const int adjacent[], ahc_merge_t out[])
+{
+        points_t points = { n, num_dims, stride, coords };
+        graph_t graph = { ctx, n, num_dims };
+        merge_t *merges = NULL;
+        float *copy = NULL;
+        int ok = 0;
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        if (!valid_points(n, num_dims, stride))
+                return 0;
+        if (ctx->squared_distances && ctx->metric != metrics) {
+                fprintf(stderr, "Centroid, median and Ward linkage "
+                        "need the euclidean metric.\n");
+                return 0;
+        }
+        if (n < 2)
+                return 1;
+        if ((stride % VECTOR_WIDTH || ctx->metric->normalise) &&
+            !(copy = copy_points(ctx, &points)))
+                return 0;
+        if (!select_distance_kernel(ctx, &points)) {
+                free(copy);
+                return 0;
+        }
+        start_timing(&(ctx->stats.distances));
+        ok = load_graph(&graph, &points, offsets, adjacent);
+        stop_timing(&(ctx->stats.distances));
+        if (!ok)
+                goto done;
+        if (!(merges = alloc_work(ctx, n, merge_t))) {
+                alloc_fail("array of merges");
+                ok = 0;
+                goto done;
+        }
+        start_timing(&(ctx->stats.merge));
+        graph_merges(&graph, merges);
+        stop_timing(&(ctx->stats.merge));
+        start_timing(&(ctx->stats.numbering));
+        ok = number_merges(ctx, merges, n, out);
+        stop_timing(&(ctx->stats.numbering));
+done:
+        free_graph(&graph);
+        free_work(ctx, merges);
+        free(copy);
+        return ok;
+}
+
+/*
+ * Hierarchy edited by ahc_insert(). Nodes 0 to n - 1 are the items, and
+ * the others are merges, taken from a stack of free nodes whenever a
+ * subtree is clustered again, and returned to it with the old subtree.
+ */
+typedef struct hierarchy_s {
+        int n; /* items, inserted or not */
+        int num_dims;
+        int root; /* top merge, or the only item */
+        int *left, *right; /* clusters joined by each merge */
+        int *parent; /* merge above each node, or -1 */
+        int *leaf; /* an item below each node */
+        int *size; /* items below each node */
+        float *height; /* distance of each merge */
+        double *sum; /* coordinate sums below each node */
+        int *free_nodes, num_free;
+        int *nodes, *items; /* scratch: nodes and items of a subtree */
+        float *distances; /* scratch: distances from an item */
+        ahc_merge_t *merges; /* scratch: merges of a subtree */
+} hierarchy_t;
+
+static void free_hierarchy(ahc_context_t *ctx, hierarchy_t *tree)
+{
+        free_work(ctx, tree->left);
+        free_work(ctx, tree->right);
+        free_work(ctx, tree->parent);
+        free_work(ctx, tree->leaf);
+        free_work(ctx, tree->size);
+        free_work(ctx, tree->height);
+        free_work(ctx, tree->sum);
+        free_work(ctx, tree->free_nodes);
+        free_work(ctx, tree->nodes);
+        free_work(ctx, tree->items);
+        free_work(ctx, tree->distances);
+        free_work(ctx, tree->merges);
+}
+
+static int alloc_hierarchy(ahc_context_t *ctx, hierarchy_t *tree,
+                           const points_t *points)
+{
+        int n = points->num_items, num_dims = points->num_dims;
+        size_t count = 2 * (size_t) n - 1;
+        tree->n = n;
+        tree->num_dims = num_dims;
+        tree->left = alloc_work(ctx, count, int);
+        tree->right = alloc_work(ctx, count, int);
+        tree->parent = alloc_work(ctx, count, int);
+        tree->leaf = alloc_work(ctx, count, int);
+        tree->size = alloc_work(ctx, count, int);
+        tree->height = alloc_work(ctx, count, float);
+        tree->sum = alloc_work(ctx, count * num_dims, double);
+        tree->free_nodes = alloc_work(ctx, n, int);
+        tree->nodes = alloc_work(ctx, count, int);
+        tree->items = alloc_work(ctx, n, int);
+        tree->distances = alloc_work(ctx, n, float);
+        tree->merges = alloc_work(ctx, n, ahc_merge_t);
+        if (!tree->left || !tree->right || !tree->parent || !tree->leaf ||
+            !tree->size || !tree->height || !tree->sum ||
+            !tree->free_nodes || !tree->nodes || !tree->items ||
+            !tree->distances || !tree->merges) {
+                alloc_fail("hierarchy");
+                return 0;
+        }
+        for (size_t v = 0; v < count; ++v)
+                tree->parent[v] = -1;
+        for (int i = 0; i < n; ++i) {
+                const float *x = point_coord(points, i);
+                tree->leaf[i] = i;
+                tree->size[i] = 1;
+                for (int k = 0; k < num_dims; ++k)
+                        tree->sum[(size_t) i * num_dims + k] = x[k];
+        }
+        return 1;
+}
+
+/* sizes and sums of merge v from its clusters */
+static void join_clusters(hierarchy_t *tree, int v)
+{
+        int a = tree->left[v], b = tree->right[v], d = tree->num_dims;
+        tree->leaf[v] = tree->leaf[a];
+        tree->size[v] = tree->size[a] + tree->size[b];
+        for (int k = 0; k < d; ++k)
+                tree->sum[(size_t) v * d + k] = tree->sum[(size_t) a * d + k] +
+                        tree->sum[(size_t) b * d + k];
+}
+
+static void set_merge(hierarchy_t *tree, int v, int a, int b, float height)
+{
+        tree->left[v] = a;
+        tree->right[v] = b;
+        tree->parent[a] = tree->parent[b] = v;
+        tree->height[v] = height;
+        join_clusters(tree, v);
+}
+
+/*
+ * Builds the hierarchy of the first num_old items from their merges,
+ * leaving the merges that inserting the others needs free.
+ */
+static int load_hierarchy(hierarchy_t *tree, const ahc_merge_t old[],
+                          int num_old)
+{
+        int n = tree->n;
+        for (int i = 0; i < num_old - 1; ++i) {
+                int a = old[i].first, b = old[i].second;
+                if (a < 0 || b < 0 || a >= num_old + i || b >= num_old + i ||
+                    a == b) {
+                        fprintf(stderr, "Invalid merge %d of the hierarchy.\n",
+                                i);
+                        return 0;
+                }
+                a = a < num_old ? a : n + a - num_old;
+                b = b < num_old ? b : n + b - num_old;
+                if (tree->parent[a] >= 0 || tree->parent[b] >= 0) {
+                        fprintf(stderr, "Invalid merge %d of the hierarchy.\n",
+                                i);
+                        return 0;
+                }
+                set_merge(tree, n + i, a, b, old[i].distance);
+        }
+        tree->root = num_old > 1 ? n + num_old - 2 : 0;
+        tree->num_free = 0;
+        for (int v = 2 * n - 2; v >= n + num_old - 1; --v)
+                tree->free_nodes[tree->num_free++] = v;
+        return 1;
+}
+
+/*
+ * Lists the items below node v in tree->items and, if release is true,
+ * returns its merges to the free stack. Returns the number of items.
+ */
+static int subtree_items(hierarchy_t *tree, int v, int release)
+{
+        int count = 0, top = 0;
+        tree->nodes[top++] = v;
+        while (top) {
+                v = tree->nodes[--top];
+                if (v < tree->n) {
+                        tree->items[count++] = v;
+                        continue;
+                }
+                tree->nodes[top++] = tree->left[v];
+                tree->nodes[top++] = tree->right[v];
+                if (release)
+                        tree->free_nodes[tree->num_free++] = v;
+        }
+        return count;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+        int x = *(const int *) a, y = *(const int *) b;
+        return (x > y) - (x < y);
+}
+
+/* distances from item x to the count items listed, as merges report */
+static void item_distances(const ahc_context_t *ctx, const points_t *points,
+                           int x, const int items[], int count, float out[])
+{
+        for (int k = 0; k < count; ++k)
+                compute_distances(ctx, point_coord(points, x),
+                                  point_coord(points, items[k]), 1,
+                                  points->stride, &out[k]);
+        for (int k = 0; ctx->squared_distances && k < count; ++k)
+                out[k] = sqrtf(out[k]);
+}
+
+/* clusters the items of tree->items again, below a merge taken as *top */
+static int recluster(ahc_context_t *ctx, hierarchy_t *tree,
+                     const points_t *points, int count, int *top)
+{
+        int stride = points->stride;
+        float *coords = alloc_coords(count, stride);
+        points_t subset = { count, points->num_dims, stride, coords };
+        ahc_merge_t *merges = tree->merges;
+        int ok;
+        if (!coords) {
+                alloc_fail("reclustered items");
+                return 0;
+        }
+        for (int j = 0; j < count; ++j)
+                memcpy(&coords[(size_t) j * stride],
+                       point_coord(points, tree->items[j]),
+                       stride * sizeof(float));
+        ok = cluster_points(ctx, &subset, &coords, merges);
+        free(coords);
+        if (!ok)
+                return 0;
+        /* the cluster numbers of the subset become nodes of the tree */
+        for (int i = 0; i < count - 1; ++i) {
+                int a = merges[i].first, b = merges[i].second;
+                int v = tree->free_nodes[--tree->num_free];
+                a = a < count ? tree->items[a] : merges[a - count].size;
+                b = b < count ? tree->items[b] : merges[b - count].size;
+                set_merge(tree, v, a, b, merges[i].distance);
+                merges[i].size = v;
+        }
+        *top = merges[count - 2].size;
+        return 1;
+}
+
+/*
+ * Height of merge p after item x was added below its cluster c, which
+ * the other cluster s is unchanged by. Single, complete and average
+ * linkage need the distances from x to the items of s, and centroid
+ * and Ward linkage the centroids of both clusters.
+ */
+static float repaired_height(ahc_context_t *ctx, hierarchy_t *tree,
+                             const points_t *points, int p, int c, int x)
+{
+        int s = tree->left[p] == c ? tree->right[p] : tree->left[p];
+        int d = tree->num_dims;
+        float h = tree->height[p];
+        if (ctx->squared_distances) {
+                double nc = tree->size[c], ns = tree->size[s], dist = 0.0;
+                const double *sc = &tree->sum[(size_t) c * d];
+                const double *ss = &tree->sum[(size_t) s * d];
+                for (int k = 0; k < d; ++k)
+                        dist += (sc[k] / nc - ss[k] / ns) *
+                                (sc[k] / nc - ss[k] / ns);
+                if (ctx->update_distances == update_ward)
+                        dist *= 2.0 * nc * ns / (nc + ns);
+                return sqrt(dist);
+        }
+        int count = subtree_items(tree, s, 0);
+        float *dist = tree->distances;
+        double total = 0.0;
+        item_distances(ctx, points, x, tree->items, count, dist);
+        ctx->stats.distance_evaluations += count;
+        for (int k = 0; k < count; ++k) {
+                if (ctx->update_distances == update_single)
+                        h = fminf(h, dist[k]);
+                else if (ctx->update_distances == update_complete)
+                        h = fmaxf(h, dist[k]);
+                total += dist[k];
+        }
+        if (ctx->update_distances == update_average) {
+                /* c held one item fewer when its distance to s was taken */
+                double old_pairs = (tree->size[c] - 1.0) * tree->size[s];
+                h = (h * old_pairs + total) / (old_pairs + count);
+        }
+        return h;
+}
+
+/*
+ * Places item x next to its nearest inserted item: the lowest subtree
+ * above that item whose merge is at least (1 + tolerance) times as far
+ * is clustered again with x, and the merges above it are brought up to
+ * date without changing their shape.
+ */
+static int insert_item(ahc_context_t *ctx, hierarchy_t *tree,
+                       const points_t *points, int x, float tolerance,
+                       ahc_update_t *update)
+{
+        float *dist = tree->distances, nearest_dist;
+        int nearest = 0, r, above, top, count;
+        compute_distances(ctx, point_coord(points, x), point_coord(points, 0),
+                          x, points->stride, dist);
+        ctx->stats.distance_evaluations += x;
+        ctx->stats.neighbour_searches++;
+        ctx->stats.rows_scanned += x;
+        for (int i = 1; i < x; ++i)
+                if (dist[i] < dist[nearest])
+                        nearest = i;
+        nearest_dist = ctx->squared_distances ? sqrtf(dist[nearest]) :
+                dist[nearest];
+        r = nearest;
+        while (tree->parent[r] >= 0 &&
+               tree->height[tree->parent[r]] < (1.0 + tolerance) *
+               nearest_dist)
+                r = tree->parent[r];
+        if (tree->parent[r] >= 0)
+                r = tree->parent[r];
+        above = tree->parent[r];
+        count = subtree_items(tree, r, 1);
+        /* in their order, so that ties are broken as a full clustering */
+        qsort(tree->items, count, sizeof(int), compare_items);
+        tree->items[count++] = x;
+        if (!recluster(ctx, tree, points, count, &top))
+                return 0;
+        update->reclustered += count;
+        tree->parent[top] = above;
+        if (above < 0)
+                tree->root = top;
+        else if (tree->left[above] == r)
+                tree->left[above] = top;
+        else
+                tree->right[above] = top;
+        for (int c = top, p = above; p >= 0; c = p, p = tree->parent[p]) {
+                int s = tree->left[p] == c ? tree->right[p] : tree->left[p];
+                float h = repaired_height(ctx, tree, points, p, c, x);
+                update->repaired++;
+                update->drift += fabs(h - tree->height[p]);
+                if ((c >= tree->n && h < tree->height[c]) ||
+                    (s >= tree->n && h < tree->height[s]))
+                        update->inversions++;
+                tree->height[p] = h;
+                join_clusters(tree, p);
+        }
+        return 1;
+}
+
+typedef struct ordered_merge_s {
+        float key; /* no merge below is higher */
+        int size;
+        int node;
+} ordered_merge_t;
+
+static int compare_ordered_merges(const void *a, const void *b)
+{
+        const ordered_merge_t *x = a, *y = b;
+        if (x->key != y->key)
+                return x->key < y->key ? -1 : 1;
+        if (x->size != y->size)
+                return x->size < y->size ? -1 : 1;
+        return (x->node > y->node) - (x->node < y->node);
+}
+
+/*
+ * Lists the merges of the tree by height, where a merge that fell below
+ * one under it, after an inversion, is listed just after that one.
+ */
+static int hierarchy_merges(ahc_context_t *ctx, hierarchy_t *tree,
+                            ahc_merge_t out[])
+{
+        int n = tree->n, count = 0, top = 0, ok = 0;
+        ordered_merge_t *order = alloc_work(ctx, n, ordered_merge_t);
+        merge_t *merges = alloc_work(ctx, n, merge_t);
+        float *key = tree->distances;
+        if (!order || !merges) {
+                alloc_fail("array of merges");
+                goto done;
+        }
+        /* merges in depth first order, each before those below it */
+        tree->nodes[top++] = tree->root;
+        while (top) {
+                int v = tree->nodes[--top];
+                if (v < n)
+                        continue;
+                order[count++].node = v;
+                tree->nodes[top++] = tree->left[v];
+                tree->nodes[top++] = tree->right[v];
+        }
+        for (int i = count - 1; i >= 0; --i) {
+                int v = order[i].node, a = tree->left[v], b = tree->right[v];
+                float h = tree->height[v];
+                if (a >= n)
+                        h = fmaxf(h, key[a - n]);
+                if (b >= n)
+                        h = fmaxf(h, key[b - n]);
+                key[v - n] = order[i].key = h;
+                order[i].size = tree->size[v];
+        }
+        qsort(order, count, sizeof(*order), compare_ordered_merges);
+        for (int i = 0; i < count; ++i) {
+                int v = order[i].node;
+                merges[i].first = tree->leaf[tree->left[v]];
+                merges[i].second = tree->leaf[tree->right[v]];
+                merges[i].distance = tree->height[v];
+        }
+        ok = number_merges(ctx, merges, n, out);
+done:
+        free_work(ctx, order);
+        free_work(ctx, merges);
+        return ok;
+}
+
+int ahc_insert(ahc_context_t *ctx, const float *coords, size_t num_old,
+               size_t n, int num_dims, size_t stride, const ahc_merge_t old[],
+               float tolerance, ahc_merge_t merges[], ahc_update_t *update)
+{
+        points_t points = { n, num_dims, stride, coords };
+        hierarchy_t tree = { 0 };
+        float *copy = NULL;
+        double total = 0.0;
+        int ok = 0;
+        memset(&(ctx->stats), 0, sizeof(ctx->stats));
+        memset(update, 0, sizeof(*update));
+        if (!valid_points(n, num_dims, stride))
+                return 0;
+        if (num_old < 1 || num_old > n || !(tolerance >= 0.0)) {
+                fprintf(stderr, "Invalid hierarchy to insert items into.\n");
+                return 0;
+        }
+        if (ctx->update_distances == update_median ||
+            ctx->update_distances == update_weighted) {
+                fprintf(stderr, "Items can only be inserted under single, "
+                        "complete, average, centroid or Ward linkage.\n");
+                return 0;
+        }
+        if (ctx->squared_distances && ctx->metric != metrics) {
+                fprintf(stderr, "Centroid, median and Ward linkage "
+                        "need the euclidean metric.\n");
+                return 0;
+        }
+        if (n < 2)
+                return 1;
+        if ((stride % VECTOR_WIDTH || ctx->metric->normalise) &&
+            !(copy = copy_points(ctx, &points)))
+                return 0;
+        if (!select_distance_kernel(ctx, &points) ||
+            !alloc_hierarchy(ctx, &tree, &points) ||
+            !load_hierarchy(&tree, old, num_old))
+                goto done;
+        for (size_t x = num_old; x < n; ++x)
+                if (!insert_item(ctx, &tree, &points, x, tolerance, update))
+                        goto done;
+        update->inserted = n - num_old;
+        for (int v = n; v < 2 * (int) n - 1; ++v)
+                total += tree.height[v];
+        update->drift = total > 0.0 ? update->drift / total : 0.0;
+        start_timing(&(ctx->stats.numbering));
+        ok = hierarchy_merges(ctx, &tree, merges);
+        stop_timing(&(ctx->stats.numbering));
+done:
+        free_hierarchy(ctx, &tree);
+        free(copy);
+        return ok;
+}
+
+/*
+ * Flat clusters formed by the merges whose key is at most t, where the
+ * key of a merge is never less than the keys of the merges below it.
+ * Items are labelled with their cluster, numbered from 0 in the order
+ * of their first items. Returns the number of clusters.
+ */
+static int flat_clusters(const ahc_merge_t merges[], int n,
+                         const double key[], double t, int labels[])
+{
+        int count = 0;
+        int *top = alloc_mem(2 * n, int); /* topmost merged ancestor */
+        int *id = alloc_mem(2 * n, int); /* number of each flat cluster */
+        if (!top || !id) {
+                alloc_fail("flat clusters");
+                goto done;
+        }
+        for (int c = 0; c < 2 * n - 1; ++c)
+                top[c] = id[c] = -1;
+        for (int i = n - 2; i >= 0; --i) {
+                if (key[i] > t)
+                        continue;
+                int root = top[n + i] >= 0 ? top[n + i] : n + i;
+                top[merges[i].first] = top[merges[i].second] = root;
+        }
+        for (int j = 0; j < n; ++j) {
+                int root = top[j] >= 0 ? top[j] : j;
+                if (id[root] < 0)
+                        id[root] = count++;
+                labels[j] = id[root];
+        }
+done:
+        free(top);
+        free(id);
+        return count;
+}
+
+/*
+ * Raises the key of every merge to the largest key below it, so that
+ * keys never decrease towards the root. Returns 0 if a merge names a
+ * cluster that was not made before it.
+ */
+static int subtree_maxima(const ahc_merge_t merges[], int n, double key[])
+{
+        for (int i = 0; i < n - 1; ++i) {
+                int child[2] = { merges[i].first, merges[i].second };
+                for (int c = 0; c < 2; ++c) {
+                        if (child[c] < 0 || child[c] >= n + i) {
+                                fprintf(stderr, "Invalid merge %d.\n", i);
+                                return 0;
+                        }
+                        if (child[c] >= n && key[child[c] - n] > key[i])
+                                key[i] = key[child[c] - n];
+                }
+        }
+        return 1;
+}
+
+/* distances of the merges within depth levels below merge i, inclusive */
+static void link_statistics(const ahc_merge_t merges[], int n, int i,
+                            int depth, double *sum, double *sum2, int *count)
+{
+        double d = merges[i].distance;
+        *sum += d;
+        *sum2 += d * d;
+        ++*count;
+        if (depth > 1) {
+                if (merges[i].first >= n)
+                        link_statistics(merges, n, merges[i].first - n,
+                                        depth - 1, sum, sum2, count);
+                if (merges[i].second >= n)
+                        link_statistics(merges, n, merges[i].second - n,
+                                        depth - 1, sum, sum2, count);
+        }
+}
+
+/*
+ * Inconsistency coefficient of every merge, as computed by SciPy: how
+ * many standard deviations its distance lies above the mean distance of
+ * the merges within depth levels below it, itself included.
+ */
+static void inconsistency(const ahc_merge_t merges[], int n, int depth,
+                          double coeff[])
+{
+        for (int i = 0; i < n - 1; ++i) {
+                double sum = 0.0, sum2 = 0.0, var = 0.0;
+                int count = 0;
+                link_statistics(merges, n, i, depth, &sum, &sum2, &count);
+                if (count > 1)
+                        var = (sum2 - sum * sum / count) / (count - 1);
+                coeff[i] = var > 0.0 ?
+                        (merges[i].distance - sum / count) / sqrt(var) : 0.0;
+        }
+}
+
+typedef enum { CUT_COUNT, CUT_DISTANCE, CUT_INCONSISTENT } cut_t;
+
+static int cut_merges(const ahc_merge_t merges[], size_t n, cut_t cut,
+                      double t, int depth, int labels[])
+{
+        int count = 0;
+        double *key;
+        if (n > INT_MAX / 2) {
+                fprintf(stderr, "Too many items to cut.\n");
+                return 0;
+        }
+        if (n < 2) {
+                if (n)
+                        labels[0] = 0;
+                return n;
+        }
+        if (!(key = alloc_mem(n - 1, double))) {
+                alloc_fail("merge keys");
+                return 0;
+        }
+        for (int i = 0; i < n - 1; ++i)
+                key[i] = cut == CUT_COUNT ? i : merges[i].distance;
+        if (cut == CUT_INCONSISTENT)
+                inconsistency(merges, n, depth, key);
+        if (subtree_maxima(merges, n, key))
+                count = flat_clusters(merges, n, key, t, labels);
+        free(key);
+        return count;
+}
+
+int ahc_cut_count(const ahc_merge_t merges[], size_t n, int k,
+                  int labels[])
+{
+        /* the first n - k merges leave k clusters */
+        return cut_merges(merges, n, CUT_COUNT, (double) n - k - 1, 0,
+                          labels);
+}
+
+int ahc_cut_distance(const ahc_merge_t merges[], size_t n, float t,
+                     int labels[])
+{
+        return cut_merges(merges, n, CUT_DISTANCE, t, 0, labels);
+}
+
+int ahc_cut_inconsistent(const ahc_merge_t merges[], size_t n, float t,
+                         int depth, int labels[])
+{
+        return cut_merges(merges, n, CUT_INCONSISTENT, t, depth, labels);
+}
+
+/*
+ * Hierarchy read from its merges, with the items below every cluster in
+ * consecutive positions of a leaf order, for cophenetic distances.
+ */
+typedef struct dendrogram_s {
+        int *parent; /* cluster made by merging each cluster, or -1 */
+        int *first; /* position of the first item of each cluster */
+        int *size; /* items in each cluster */
+        int *order; /* items in leaf order */
+} dendrogram_t;
+
+static void free_dendrogram(dendrogram_t *tree)
+{
+        free(tree->parent);
+        free(tree->first);
+        free(tree->size);
+        free(tree->order);
+}
+
+/* returns 0 if a merge names a cluster that was not left to merge */
+static int load_dendrogram(dendrogram_t *tree, const ahc_merge_t merges[],
+                           int n)
+{
+        tree->parent = alloc_mem(2 * n - 1, int);
+        tree->first = alloc_mem(2 * n - 1, int);
+        tree->size = alloc_mem(2 * n - 1, int);
+        tree->order = alloc_mem(n, int);
+        if (!tree->parent || !tree->first || !tree->size || !tree->order) {
+                alloc_fail("dendrogram");
+                return 0;
+        }
+        for (int c = 0; c < 2 * n - 1; ++c) {
+                tree->parent[c] = -1;
+                tree->size[c] = c < n;
+        }
+        for (int i = 0; i < n - 1; ++i) {
+                int child[2] = { merges[i].first, merges[i].second };
+                for (int c = 0; c < 2; ++c) {
+                        if (child[c] < 0 || child[c] >= n + i ||
+                            tree->parent[child[c]] >= 0) {
+                                fprintf(stderr, "Invalid merge %d.\n", i);
+                                return 0;
+                        }
+                        tree->parent[child[c]] = n + i;
+                        tree->size[n + i] += tree->size[child[c]];
+                }
+        }
+        /* the root comes last, and clusters before the merges of them */
+        for (int i = n - 2; i >= 0; --i) {
+                tree->first[merges[i].first] = tree->first[n + i];
+                tree->first[merges[i].second] = tree->first[n + i] +
+                        tree->size[merges[i].first];
+        }
+        for (int j = 0; j < n; ++j)
+                tree->order[tree->first[j]] = j;
+        return 1;
+}
+
+/* cophenetic distances from item i to all other items */
+static void cophenetic_row(const dendrogram_t *tree,
+                           const ahc_merge_t merges[], int n, int i,
+                           double row[])
+{
+        for (int c = i; tree->parent[c] >= 0; c = tree->parent[c]) {
+                const ahc_merge_t *merge = &merges[tree->parent[c] - n];
+                int other = merge->first == c ? merge->second : merge->first;
+                for (int k = 0; k < tree->size[other]; ++k)
+                        row[tree->order[tree->first[other] + k]] =
+                                merge->distance;
+        }
+}
+
+double ahc_cophenetic_correlation(const ahc_merge_t a[],
+                                  const ahc_merge_t b[], size_t n)
+{
+        dendrogram_t ta = { NULL }, tb = { NULL };
+        double *ra = NULL, *rb = NULL, r = NAN;
+        double sa = 0.0, sb = 0.0, saa = 0.0, sbb = 0.0, sab = 0.0;
+        if (n > INT_MAX / 2) {
+                fprintf(stderr, "Too many items to compare.\n");
+                return NAN;
+        }
+        if (n < 3)
+                return NAN;
+        if (!load_dendrogram(&ta, a, n) || !load_dendrogram(&tb, b, n))
+                goto done;
+        ra = alloc_mem(n, double);
+        rb = alloc_mem(n, double);
+        if (!ra || !rb) {
+                alloc_fail("cophenetic distances");
+                goto done;
+        }
+        for (int i = 0; i < n; ++i) {
+                cophenetic_row(&ta, a, n, i, ra);
+                cophenetic_row(&tb, b, n, i, rb);
+                for (int j = i + 1; j < n; ++j) {
+                        sa += ra[j];
+                        sb += rb[j];
+                        saa += ra[j] * ra[j];
+                        sbb += rb[j] * rb[j];
+                        sab += ra[j] * rb[j];
+                }
+        }
+        double pairs = (double) n * (n - 1) / 2;
+        double cov = sab - sa * sb / pairs;
+        double va = saa - sa * sa / pairs, vb = sbb - sb * sb / pairs;
+        if (va > 0.0 && vb > 0.0)
+                r = cov / sqrt(va * vb);
+done:
+        free_dendrogram(&ta);
+        free_dendrogram(&tb);
+        free(ra);
+        free(rb);
+        return r;
+}
+
+/*
+ * Node of a clustering feature tree (T. Zhang et al., BIRCH, 1996). Each
+ * entry summarises its items by their number, the sum of their
+ * coordinates and the sum of their squared norms: the entries of inner
+ * nodes summarise a child, and those of leaves are micro-clusters.
+ */
+struct cf_node_s {
+        int leaf; /* entries are micro-clusters */
+        int count; /* entries in use; one more fits while splitting */
+        size_t first; /* number of the first micro-cluster of a leaf */
+        double n[CF_CAPACITY + 1]; /* items summarised by each entry */
+        double ss[CF_CAPACITY + 1]; /* sum of their squared norms */
+        cf_node_t *child[CF_CAPACITY + 1]; /* subtree of each entry */
+        /* sum of their coordinates, num_dims per entry; inner nodes then
+           hold the bounding box of the micro-cluster centroids below each
+           entry, as num_dims lower and num_dims upper bounds */
+        double ls[];
+};
+
+struct ahc_summary_s {
+        int num_dims; /* number of coordinates of each item */
+        size_t max_entries; /* micro-clusters allowed */
+        size_t num_entries; /* micro-clusters in the leaves */
+        int indexed; /* micro-clusters are numbered, and boxes known */
+        double threshold; /* largest squared radius of a micro-cluster */
+        cf_node_t *root;
+        double *item; /* coordinates of the item being added or looked up */
+        double *seeds; /* centroids of the entries a split starts from */
+};
+
+#define cf_ls(summary, node, k)                                         \
+        (&(node)->ls[(size_t) (k) * (summary)->num_dims])
+#define cf_box(summary, node, k)                                        \
+        (&(node)->ls[(size_t) (CF_CAPACITY + 1 + 2 * (k)) *             \
+                     (summary)->num_dims])
+
+static cf_node_t *alloc_cf_node(const ahc_summary_t *summary, int leaf)
+{
+        cf_node_t *node = calloc(1, sizeof(cf_node_t) + (CF_CAPACITY + 1) *
+                                 (leaf ? 1 : 3) * summary->num_dims *
+                                 sizeof(double));
+        if (node)
+                node->leaf = leaf;
+        else
+                alloc_fail("summary tree node");
+        return node;
+}
+
+static void free_cf_node(cf_node_t *node)
+{
+        if (node && !node->leaf)
+                for (int k = 0; k < node->count; ++k)
+                        free_cf_node(node->child[k]);
+        free(node);
+}
+
+/* squared distance from the centroid of an entry to the point x */
+static double centroid_distance(const ahc_summary_t *summary,
+                                const cf_node_t *node, int k,
+                                const double *x)
+{
+        const double *ls = cf_ls(summary, node, k);
+        double d = 0.0;
+        for (int i = 0; i < summary->num_dims; ++i) {
+                double t = ls[i] / node->n[k] - x[i];
+                d += t * t;
+        }
+        return d;
+}
+
+/* squared radius of an entry, after adding n items of sums ls and ss */
+static double merged_radius(const ahc_summary_t *summary,
+                            const cf_node_t *node, int k, double n,
+                            const double *ls, double ss)
+{
+        const double *sum = cf_ls(summary, node, k);
+        double count = node->n[k] + n, norm = 0.0;
+        for (int i = 0; i < summary->num_dims; ++i) {
+                double c = (sum[i] + ls[i]) / count;
+                norm += c * c;
+        }
+        norm = (node->ss[k] + ss) / count - norm;
+        return norm > 0.0 ? norm : 0.0;
+}
+
+/* entry whose centroid is closest to the point x, or -1 if none */
+static int closest_entry(const ahc_summary_t *summary, const cf_node_t *node,
+                         const double *x)
+{
+        int best = -1;
+        double best_distance = 0.0;
+        for (int k = 0; k < node->count; ++k) {
+                double d = centroid_distance(summary, node, k, x);
+                if (best < 0 || d < best_distance) {
+                        best = k;
+                        best_distance = d;
+                }
+        }
+        return best;
+}
+
+static void set_entry(const ahc_summary_t *summary, cf_node_t *node, int k,
+                      double n, const double *ls, double ss,
+                      cf_node_t *child)
+{
+        node->n[k] = n;
+        node->ss[k] = ss;
+        node->child[k] = child;
+        memmove(cf_ls(summary, node, k), ls,
+                summary->num_dims * sizeof(double));
+}
+
+static void add_to_entry(const ahc_summary_t *summary, cf_node_t *node,
+                         int k, double n, const double *ls, double ss)
+{
+        double *sum = cf_ls(summary, node, k);
+        node->n[k] += n;
+        node->ss[k] += ss;
+        for (int i = 0; i < summary->num_dims; ++i)
+                sum[i] += ls[i];
+}
+
+/* sets entry k of the parent to the sum of the entries of its child */
+static void summarise_child(const ahc_summary_t *summary, cf_node_t *parent,
+                            int k, cf_node_t *child)
+{
+        set_entry(summary, parent, k, child->n[0], cf_ls(summary, child, 0),
+                  child->ss[0], child);
+        for (int j = 1; j < child->count; ++j)
+                add_to_entry(summary, parent, k, child->n[j],
+                             cf_ls(summary, child, j), child->ss[j]);
+}
+
+/*
+ * Moves the entries of an overfull node that are closer to the second of
+ * its two farthest entries than to the first into a new sibling.
+ */
+static cf_node_t *split_cf_node(ahc_summary_t *summary, cf_node_t *node)
+{
+        int a = 0, b = 1, kept = 0, num_dims = summary->num_dims;
+        double farthest = -1.0, *seed_a = summary->seeds;
+        double *seed_b = summary->seeds + num_dims;
+        cf_node_t *sibling = alloc_cf_node(summary, node->leaf);
+        if (!sibling)
+                return NULL;
+        for (int i = 0; i < node->count; ++i) {
+                for (int k = 0; k < num_dims; ++k)
+                        seed_a[k] = cf_ls(summary, node, i)[k] / node->n[i];
+                for (int j = i + 1; j < node->count; ++j) {
+                        double d = centroid_distance(summary, node, j,
+                                                     seed_a);
+                        if (d > farthest) {
+                                farthest = d;
+                                a = i;
+                                b = j;
+                        }
+                }
+        }
+        for (int k = 0; k < num_dims; ++k) {
+                seed_a[k] = cf_ls(summary, node, a)[k] / node->n[a];
+                seed_b[k] = cf_ls(summary, node, b)[k] / node->n[b];
+        }
+        for (int i = 0; i < node->count; ++i) {
+                cf_node_t *to = i == b || (i != a &&
+                        centroid_distance(summary, node, i, seed_b) <
+                        centroid_distance(summary, node, i, seed_a)) ?
+                        sibling : node;
+                int k = to == node ? kept++ : sibling->count++;
+                set_entry(summary, to, k, node->n[i],
+                          cf_ls(summary, node, i), node->ss[i],
+                          node->child[i]);
+        }
+        node->count = kept;
+        return sibling;
+}
+
+/*
+ * Adds n items, of coordinate sums ls and squared norms ss, to the
+ * subtree of the node: to the closest micro-cluster if its radius stays
+ * within the threshold, or as a new one. Sets *sibling to the new node
+ * if the node had to split. Returns 0 on failure.
+ */
+static int insert_cf(ahc_summary_t *summary, cf_node_t *node, double n,
+                     const double *ls, double ss, cf_node_t **sibling)
+{
+        double centroid[summary->num_dims];
+        for (int i = 0; i < summary->num_dims; ++i)
+                centroid[i] = ls[i] / n;
+        int k = closest_entry(summary, node, centroid);
+        *sibling = NULL;
+        if (!node->leaf) {
+                cf_node_t *split;
+                if (!insert_cf(summary, node->child[k], n, ls, ss, &split))
+                        return 0;
+                if (split) {
+                        summarise_child(summary, node, k, node->child[k]);
+                        summarise_child(summary, node, node->count++, split);
+                } else
+                        add_to_entry(summary, node, k, n, ls, ss);
+        } else if (k >= 0 && merged_radius(summary, node, k, n, ls, ss) <=
+                   summary->threshold) {
+                add_to_entry(summary, node, k, n, ls, ss);
+                return 1;
+        } else {
+                set_entry(summary, node, node->count++, n, ls, ss, NULL);
+                summary->num_entries++;
+        }
+        return node->count <= CF_CAPACITY ||
+                (*sibling = split_cf_node(summary, node)) != NULL;
+}
+
+static int add_to_summary(ahc_summary_t *summary, double n,
+                          const double *ls, double ss)
+{
+        cf_node_t *sibling, *root;
+        summary->indexed = 0;
+        if (!insert_cf(summary, summary->root, n, ls, ss, &sibling))
+                return 0;
+        if (sibling) {
+                if (!(root = alloc_cf_node(summary, 0))) {
+                        free_cf_node(sibling);
+                        return 0;
+                }
+                summarise_child(summary, root, 0, summary->root);
+                summarise_child(summary, root, 1, sibling);
+                root->count = 2;
+                summary->root = root;
+        }
+        return 1;
+}
+
+/*
+ * Copies the micro-clusters of the subtree into the arrays, and lowers
+ * *closest to the smallest positive squared radius that merging two
+ * micro-clusters of one leaf would give.
+ */
+static void collect_entries(const ahc_summary_t *summary, cf_node_t *node,
+                            double n[], double ls[], double ss[],
+                            size_t *count, double *closest)
+{
+        int num_dims = summary->num_dims;
+        if (!node->leaf) {
+                for (int k = 0; k < node->count; ++k)
+                        collect_entries(summary, node->child[k], n, ls, ss,
+                                        count, closest);
+                return;
+        }
+        for (int k = 0; k < node->count; ++k) {
+                for (int j = k + 1; j < node->count; ++j) {
+                        double r = merged_radius(summary, node, k, node->n[j],
+                                                 cf_ls(summary, node, j),
+                                                 node->ss[j]);
+                        if (r > 0.0 && r < *closest)
+                                *closest = r;
+                }
+                n[*count] = node->n[k];
+                ss[*count] = node->ss[k];
+                memcpy(&ls[*count * num_dims], cf_ls(summary, node, k),
+                       num_dims * sizeof(double));
+                ++*count;
+        }
+}
+
+/*
+ * Rebuilds the tree from its micro-clusters with a larger threshold, at
+ * least twice the last one, and enough for some pair of them to merge.
+ */
+static int rebuild_summary(ahc_summary_t *summary)
+{
+        size_t count = 0, m = summary->num_entries;
+        int num_dims = summary->num_dims, ok = 1;
+        double closest = DBL_MAX;
+        double *n = alloc_mem(m, double), *ss = alloc_mem(m, double);
+        double *ls = alloc_mem(m * num_dims, double);
+        cf_node_t *root = alloc_cf_node(summary, 1);
+        if (!n || !ss || !ls || !root) {
+                alloc_fail("summary rebuild");
+                ok = 0;
+                goto done;
+        }
+        collect_entries(summary, summary->root, n, ls, ss, &count, &closest);
+        free_cf_node(summary->root);
+        summary->root = root;
+        root = NULL;
+        summary->num_entries = 0;
+        summary->threshold *= 2.0;
+        if (closest < DBL_MAX && closest > summary->threshold)
+                summary->threshold = closest;
+        else if (summary->threshold == 0.0)
+                summary->threshold = DBL_MIN;
+        for (size_t i = 0; ok && i < count; ++i)
+                ok = add_to_summary(summary, n[i], &ls[i * num_dims], ss[i]);
+done:
+        free(n);
+        free(ss);
+        free(ls);
+        free(root);
+        return ok;
+}
+
+ahc_summary_t *ahc_create_summary(int num_dims, size_t max_entries)
+{
+        ahc_summary_t *summary;
+        if (num_dims < 1 || max_entries < 1) {
+                fprintf(stderr, "Invalid summary size.\n");
+                return NULL;
+        }
+        summary = alloc_mem(1, ahc_summary_t);
+        if (!summary) {
+                alloc_fail("summary");
+                return NULL;
+        }
+        summary->num_dims = num_dims;
+        summary->max_entries = max_entries;
+        summary->item = alloc_mem(num_dims, double);
+        summary->seeds = alloc_mem(2 * num_dims, double);
+        summary->root = alloc_cf_node(summary, 1);
+        if (!summary->item || !summary->seeds || !summary->root) {
+                alloc_fail("summary");
+                ahc_free_summary(summary);
+                return NULL;
+        }
+        return summary;
+}
+
+void ahc_free_summary(ahc_summary_t *summary)
+{
+        if (summary) {
+                free_cf_node(summary->root);
+                free(summary->item);
+                free(summary->seeds);
+                free(summary);
+        }
+}
+
+int ahc_summary_add(ahc_summary_t *summary, const float *coords)
+{
+        double ss = 0.0;
+        for (int k = 0; k < summary->num_dims; ++k) {
+                summary->item[k] = coords[k];
+                ss += summary->item[k] * summary->item[k];
+        }
+        if (!add_to_summary(summary, 1.0, summary->item, ss))
+                return 0;
+        while (summary->num_entries > summary->max_entries)
+                if (!rebuild_summary(summary))
+                        return 0;
+        return 1;
+}
+
+size_t ahc_summary_size(const ahc_summary_t *summary)
+{
+        return summary->num_entries;
+}
+
+/*
+ * Numbers the micro-clusters in the order of the leaves, and bounds the
+ * centroids below every inner entry, and below the node within box.
+ */
+static void index_summary(ahc_summary_t *summary, cf_node_t *node,
+                          size_t *next, double *box)
+{
+        int num_dims = summary->num_dims;
+        for (int k = 0; k < node->count; ++k) {
+                if (node->leaf) {
+                        for (int i = 0; i < num_dims; ++i)
+                                summary->item[i] =
+                                        cf_ls(summary, node, k)[i] /
+                                        node->n[k];
+                        widen_box(num_dims, box, summary->item);
+                        continue;
+                }
+                double *child_box = cf_box(summary, node, k);
+                for (int i = 0; i < num_dims; ++i) {
+                        child_box[i] = DBL_MAX;
+                        child_box[num_dims + i] = -DBL_MAX;
+                }
+                index_summary(summary, node->child[k], next, child_box);
+                widen_box(num_dims, box, child_box);
+                widen_box(num_dims, box, child_box + num_dims);
+        }
+        if (node->leaf) {
+                node->first = *next;
+                *next += node->count;
+        }
+}
+
+/*
+ * Branch and bound search for the micro-cluster whose centroid is
+ * nearest to x, skipping inner entries whose box of centroids is farther
+ * than the nearest centroid found. Entries are visited nearest first, so
+ * that the bound soon prunes the others.
+ */
+static void nearest_centroid(const ahc_summary_t *summary,
+                             const cf_node_t *node, const double *x,
+                             double *best, size_t *nearest)
+{
+        int order[CF_CAPACITY + 1];
+        double d[CF_CAPACITY + 1];
+        for (int k = 0; k < node->count; ++k) {
+                int j = k;
+                d[k] = node->leaf ? centroid_distance(summary, node, k, x) :
+                        box_distance(summary->num_dims,
+                                     cf_box(summary, node, k), x);
+                for (; j > 0 && d[order[j - 1]] > d[k]; --j)
+                        order[j] = order[j - 1];
+                order[j] = k;
+        }
+        for (int j = 0; j < node->count && d[order[j]] < *best; ++j) {
+                int k = order[j];
+                if (node->leaf) {
+                        *best = d[k];
+                        *nearest = node->first + k;
+                } else
+                        nearest_centroid(summary, node->child[k], x, best,
+                                         nearest);
+        }
+}
+
+static void leaf_centroids(const ahc_summary_t *summary, cf_node_t *node,
+                           float *centroids, size_t stride, int weights[])
+{
+        if (!node->leaf) {
+                for (int k = 0; k < node->count; ++k)
+                        leaf_centroids(summary, node->child[k], centroids,
+                                       stride, weights);
+                return;
+        }
+        for (int k = 0; k < node->count; ++k) {
+                size_t i = node->first + k;
+                for (int j = 0; j < summary->num_dims; ++j)
+                        centroids[i * stride + j] =
+                                cf_ls(summary, node, k)[j] / node->n[k];
+                weights[i] = node->n[k] < INT_MAX ? node->n[k] : INT_MAX;
+        }
+}
+
+static void prepare_lookups(ahc_summary_t *summary)
+{
+        size_t next = 0;
+        if (!summary->indexed)
+                index_summary(summary, summary->root, &next,
+                              summary->seeds);
+        summary->indexed = 1;
+}
+
+void ahc_summary_centroids(ahc_summary_t *summary, float *centroids,
+                           size_t stride, int weights[])
+{
+        prepare_lookups(summary);
+        leaf_centroids(summary, summary->root, centroids, stride, weights);
+}
+
+size_t ahc_summary_nearest(ahc_summary_t *summary, const float *coords)
+{
+        size_t nearest = SIZE_MAX;
+        double best = DBL_MAX;
+        prepare_lookups(summary);
+        for (int k = 0; k < summary->num_dims; ++k)
+                summary->item[k] = coords[k];
+        nearest_centroid(summary, summary->root, summary->item, &best,
+                         &nearest);
+        return nearest;
+}
+
+int ahc_set_linkage(ahc_context_t *ctx, char linkage)
+{
+        switch (linkage) {
+        case AHC_AVERAGE_LINKAGE:
+                ctx->update_distances = update_average;
+                break;
+        case AHC_COMPLETE_LINKAGE:
+                ctx->update_distances = update_complete;
+                break;
+        case AHC_CENTROID_LINKAGE:
+                ctx->update_distances = update_centroid;
+                break;
+        case AHC_MEDIAN_LINKAGE:
+                ctx->update_distances = update_median;
+                break;
+        case AHC_WARD_LINKAGE:
+                ctx->update_distances = update_ward;
+                break;
+        case AHC_WEIGHTED_LINKAGE:
+                ctx->update_distances = update_weighted;
+                break;
+        case AHC_SINGLE_LINKAGE:
+                ctx->update_distances = update_single;
+                break;
+        default:
+                return 0;
+        }
+        ctx->squared_distances = ctx->update_distances == update_centroid ||
+                ctx->update_distances == update_median ||
+                ctx->update_distances == update_ward;
+        /* centroid and median linkage may decrease when merging */
+        ctx->reducible_linkage = ctx->update_distances != update_centroid &&
+                ctx->update_distances != update_median;
+        return 1;
+}
+
+/* p is the power of the minkowski metric, and is otherwise ignored */
+int ahc_set_metric(ahc_context_t *ctx, const char *name, float p)
+{
+        const metric_t *metric;
+        for (metric = metrics; metric->name; ++metric)
+                if (!strcmp(metric->name, name))
+                        break;
+        if (!metric->name || (metric == &metrics[6] && !(p > 0.0)))
+                return 0;
+        if (metric == &metrics[6] && p == 1.0)
+                metric = &metrics[2]; /* manhattan */
+        else if (metric == &metrics[6] && p == 2.0)
+                metric = &metrics[0]; /* euclidean */
+        ctx->metric = metric;
+        ctx->minkowski_p = p;
+        return 1;
+}
+
+int ahc_set_threads(ahc_context_t *ctx, int count)
+{
+        if (count < 1)
+                count = 1;
+        if (count > MAX_THREADS)
+                count = MAX_THREADS;
+        free_thread_pool(ctx->thread_pool);
+        ctx->thread_pool = NULL;
+        if (count > 1 && !(ctx->thread_pool = create_thread_pool(count)))
+                return 0;
+        return ahc_num_threads(ctx);
+}
+
+void ahc_get_stats(const ahc_context_t *ctx, ahc_stats_t *stats)
+{
+        *stats = ctx->stats;
+}
+
+int ahc_num_threads(const ahc_context_t *ctx)
+{
+        return ctx->thread_pool ? ctx->thread_pool->num_threads : 1;
+}
+
+void ahc_set_huge_pages(ahc_context_t *ctx, int enable)
+{
+        ctx->use_huge_pages = enable;
+}
+
+void ahc_set_spatial_index(ahc_context_t *ctx, int enable)
+{
+        ctx->spatial_index = enable;
+}
+
+int ahc_set_matrix_format(ahc_context_t *ctx, const char *name)
+{
+        for (int format = 0; matrix_formats[format].name; ++format)
+                if (!strcmp(matrix_formats[format].name, name)) {
+                        ctx->matrix_format = format;
+                        return 1;
+                }
+        return 0;
+}
+
+int ahc_set_scratch_dir(ahc_context_t *ctx, const char *dir)
+{
+        char *copy = NULL;
+        if (dir && !(copy = strdup(dir))) {
+                alloc_fail("scratch directory");
+                return 0;
+        }
+        free(ctx->scratch_dir);
+        ctx->scratch_dir = copy;
+        return 1;
+}
+
+static void *default_alloc(size_t count, size_t size, void *data)
+{
+        return calloc(count, size);
+}
+
+static void default_free(void *ptr, void *data)
+{
+        free(ptr);
+}
+
+void ahc_set_allocator(ahc_context_t *ctx, const ahc_allocator_t *allocator)
+{
+        static const ahc_allocator_t standard = {
+                default_alloc, default_free, NULL
+        };
+        ctx->allocator = allocator ? *allocator : standard;
+}
+
+ahc_context_t *ahc_create_context(void)
+{
+        ahc_context_t *ctx = alloc_mem(1, ahc_context_t);
+        if (!ctx) {
+                alloc_fail("clustering context");
+                return NULL;
+        }
+        ctx->metric = metrics;
+        ctx->minkowski_p = 2.0;
+        ctx->kernel_level = cpu_kernel_level();
+        ahc_set_linkage(ctx, AHC_SINGLE_LINKAGE);
+        ahc_set_allocator(ctx, NULL);
+        return ctx;
+}
+
+ahc_context_t *ahc_copy_context(const ahc_context_t *ctx)
+{
+        ahc_context_t *copy = alloc_mem(1, ahc_context_t);
+        if (!copy) {
+                alloc_fail("clustering context");
+                return NULL;
+        }
+        *copy = *ctx;
+        copy->scratch_dir = NULL;
+        copy->thread_pool = NULL;
+        memset(&copy->stats, 0, sizeof(copy->stats));
+        copy->weights = NULL;
+        ahc_set_allocator(copy, NULL);
+        if (!ahc_set_scratch_dir(copy, ctx->scratch_dir)) {
+                free(copy);
+                return NULL;
+        }
+        return copy;
+}
+
+void ahc_free_context(ahc_context_t *ctx)
+{
+        if (ctx) {
+                free_thread_pool(ctx->thread_pool);
+                free(ctx->scratch_dir);
+                free(ctx);
+        }
+}
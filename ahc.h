@@ -0,0 +1,281 @@
+/**
+ * Copyright 2014 Gagarine Yaikhom (MIT License)
+ *
+ * Agglomerative Hierarchical Clustering library. The linkage, metric,
+ * allocator and threads of a clustering are held by a context, and the
+ * library has no other state: independent clusterings may run at the
+ * same time on different threads, each with its own context.
+ */
+#ifndef AHC_H
+#define AHC_H
+
+#include <stddef.h>
+
+#define AHC_VECTOR_WIDTH 4 /* coordinate strides are multiples of this */
+#define AHC_VECTOR_ALIGN 64 /* alignment of coordinate blocks */
+#define AHC_MAX_THREADS 256
+#define AHC_SPATIAL_MAX_DIMS 16 /* coordinates a k-d tree is used for */
+
+#define AHC_AVERAGE_LINKAGE  'a' /* choose average distance */
+#define AHC_CENTROID_LINKAGE 't' /* choose distance between centroids */
+#define AHC_COMPLETE_LINKAGE 'c' /* choose maximum distance */
+#define AHC_SINGLE_LINKAGE   's' /* choose minimum distance */
+#define AHC_MEDIAN_LINKAGE   'm' /* choose distance between medians */
+#define AHC_WARD_LINKAGE     'w' /* choose minimum increase in variance */
+#define AHC_WEIGHTED_LINKAGE 'p' /* choose weighted pair-group average */
+
+typedef struct ahc_context_s ahc_context_t;
+typedef struct ahc_allocator_s ahc_allocator_t;
+typedef struct ahc_merge_s ahc_merge_t;
+typedef struct ahc_timing_s ahc_timing_t;
+typedef struct ahc_stats_s ahc_stats_t;
+typedef struct ahc_summary_s ahc_summary_t;
+typedef struct ahc_update_s ahc_update_t;
+
+/*
+ * Allocates the working memory of a clustering: the distance matrix,
+ * unless it is backed by huge pages, and the bookkeeping of the merge
+ * loop. Like calloc(), alloc returns zeroed memory, or NULL.
+ */
+struct ahc_allocator_s {
+        void *(*alloc)(size_t count, size_t size, void *data);
+        void (*free)(void *ptr, void *data);
+        void *data; /* passed to alloc and free */
+};
+
+/*
+ * Clustering n items makes n - 1 merges, listed in the order they are
+ * made. Items are numbered 0 to n - 1, and the cluster made by the i-th
+ * merge is numbered n + i; the higher numbered cluster comes first.
+ */
+struct ahc_merge_s {
+        int first, second; /* clusters that were merged */
+        float distance; /* distance between them */
+        int size; /* number of items in the merged cluster */
+};
+
+/* wall clock and processor seconds, the latter over all threads */
+struct ahc_timing_s {
+        double wall, cpu;
+};
+
+/*
+ * What the last clustering, or computation of distances, of a context
+ * did. Counters are kept per row or per merge, never per distance, so
+ * they are always on. Single linkage computes its distances while it
+ * merges, and counts them under merge.
+ */
+struct ahc_stats_s {
+        ahc_timing_t distances; /* filling the distance matrix */
+        ahc_timing_t merge; /* finding and making the merges */
+        ahc_timing_t numbering; /* sorting and numbering the merges */
+        unsigned long long distance_evaluations; /* under the metric */
+        unsigned long long distance_updates; /* Lance-Williams updates */
+        unsigned long long neighbour_searches; /* nearest neighbour scans */
+        unsigned long long rows_scanned; /* by those scans */
+        unsigned long long chain_links; /* nearest-neighbour chain steps */
+        unsigned long long stale_neighbours; /* recomputed after merges */
+        unsigned long long allocations; /* from the allocator */
+        unsigned long long allocated_bytes;
+};
+
+/*
+ * How inserting items changed a hierarchy. Drift is the total change in
+ * the distances of the merges repaired, over the total of the distances
+ * of all merges: a rebuild is worth its cost once it grows large, or
+ * once merges fall below those under them.
+ */
+struct ahc_update_s {
+        size_t inserted; /* items inserted */
+        size_t reclustered; /* items in the subtrees clustered again */
+        size_t repaired; /* merges above them, whose distances changed */
+        size_t inversions; /* repaired merges below those under them */
+        double drift;
+};
+
+/* single linkage, euclidean metric, one thread and calloc() */
+ahc_context_t *ahc_create_context(void);
+/*
+ * New context with the linkage, metric and settings of ctx, but with one
+ * thread, calloc() and no stats, for a clustering on another thread.
+ */
+ahc_context_t *ahc_copy_context(const ahc_context_t *ctx);
+void ahc_free_context(ahc_context_t *ctx);
+
+/* returns 0 if the linkage or the metric is not known */
+int ahc_set_linkage(ahc_context_t *ctx, char linkage);
+int ahc_set_metric(ahc_context_t *ctx, const char *name, float p);
+
+void ahc_get_stats(const ahc_context_t *ctx, ahc_stats_t *stats);
+
+/* starts count - 1 workers, returning the number of threads, or 0 */
+int ahc_set_threads(ahc_context_t *ctx, int count);
+int ahc_num_threads(const ahc_context_t *ctx);
+
+/* back the distance matrix with huge pages, if enable is true */
+void ahc_set_huge_pages(ahc_context_t *ctx, int enable);
+
+/*
+ * If enable is true, items of at most AHC_SPATIAL_MAX_DIMS coordinates
+ * are clustered with single, centroid or median linkage under euclidean
+ * distances through a k-d tree instead of a distance matrix: in O(n)
+ * memory, and close to O(n log n) time when they are spread out. Merges
+ * at equal distances may be made in another order.
+ */
+void ahc_set_spatial_index(ahc_context_t *ctx, int enable);
+
+/*
+ * Keep distance matrices in a scratch file in dir, mapped into memory,
+ * so that they may be larger than memory; NULL keeps them in working
+ * memory. The file is removed as soon as it is created. Items are
+ * reordered to make the file cheap to search, so distances agree with
+ * those computed in memory up to rounding. Returns 0 if the name could
+ * not be copied.
+ */
+int ahc_set_scratch_dir(ahc_context_t *ctx, const char *dir);
+
+/*
+ * Store the distance matrices computed from coordinates as "float", the
+ * default, or in half the memory as IEEE "half" precision or "bfloat16"
+ * numbers, or as "u16" steps, or in a quarter of it as "u8" steps, of a
+ * scale kept for each row of the matrix. Rows are scaled again as they
+ * are merged. Merges whose distances round to the same value may be
+ * made in another order. Returns 0 if the format is not known.
+ */
+int ahc_set_matrix_format(ahc_context_t *ctx, const char *name);
+
+/* NULL restores calloc() and free() */
+void ahc_set_allocator(ahc_context_t *ctx, const ahc_allocator_t *allocator);
+
+/*
+ * Runs task(arg, thread, count) on the count threads of the context,
+ * including the caller. Small amounts of work are run by the caller
+ * alone, as task(arg, 0, 1). Returns the number of threads that ran it.
+ */
+int ahc_parallel(ahc_context_t *ctx, void (*task)(void *, int, int),
+                 void *arg, size_t work);
+
+/*
+ * Clusters n items with num_dims coordinates each, stored stride
+ * floats apart, into the n - 1 merges. Coordinates whose stride is a
+ * multiple of AHC_VECTOR_WIDTH, with zero padding, are used in place;
+ * others are copied. Returns 0 on failure.
+ */
+int ahc_cluster(ahc_context_t *ctx, const float *coords, size_t n,
+                int num_dims, size_t stride, ahc_merge_t merges[]);
+
+/*
+ * Clusters n items, given the distances between them: the n(n - 1) / 2
+ * entries d(i, j), i < j, row after row, or all n * n entries if square
+ * is true, of which the upper triangle is used. The distances are
+ * overwritten. Centroid, median and Ward linkage need coordinates.
+ */
+int ahc_cluster_matrix(ahc_context_t *ctx, float *distances, size_t n,
+                       int square, ahc_merge_t merges[]);
+
+/*
+ * Clusters n points as ahc_cluster() does, where point i stands for
+ * weights[i] items at the same place: the sizes of the merges count
+ * items, and average, centroid and Ward linkage weigh clusters by
+ * them.
+ */
+int ahc_cluster_weighted(ahc_context_t *ctx, const float *coords,
+                         const int weights[], size_t n, int num_dims,
+                         size_t stride, ahc_merge_t merges[]);
+
+/*
+ * Inserts items num_old to n - 1 into the hierarchy of the old merges of
+ * the first num_old items, giving the n - 1 merges of all of them. Each
+ * item is clustered again with the lowest subtree above its nearest
+ * item whose merge is at least (1 + tolerance) times as far; the merges
+ * above are repaired in place. The larger the tolerance, the closer the
+ * result is to clustering all items afresh. Single, complete, average,
+ * centroid and Ward linkage are supported.
+ */
+int ahc_insert(ahc_context_t *ctx, const float *coords, size_t num_old,
+               size_t n, int num_dims, size_t stride, const ahc_merge_t old[],
+               float tolerance, ahc_merge_t merges[], ahc_update_t *update);
+
+/*
+ * Finds the k nearest items to each item under the metric of the
+ * context, nearest first: those of item i are neighbours[i * k] to
+ * neighbours[i * k + k - 1], padded with -1 when there are fewer. Few
+ * euclidean coordinates are searched through a k-d tree.
+ */
+int ahc_knn_graph(ahc_context_t *ctx, const float *coords, size_t n,
+                  int num_dims, size_t stride, int k, int neighbours[]);
+
+/*
+ * Clusters n items as ahc_cluster() does, but only merges clusters that
+ * an edge of the connectivity graph joins, in time and memory that grow
+ * with its edges rather than n^2. Item i has an edge to every item from
+ * adjacent[offsets[i]] to adjacent[offsets[i + 1] - 1], or to none if it
+ * is negative, and edges may be listed in one direction or both. The
+ * distance between clusters is their linkage over the edges between
+ * them: centroid, median and Ward linkage follow from the positions of
+ * the clusters, and average linkage takes the mean of the edges. The
+ * clusters of different components are merged last, at an infinite
+ * distance. A complete graph gives the hierarchy of ahc_cluster().
+ */
+int ahc_cluster_graph(ahc_context_t *ctx, const float *coords, size_t n,
+                      int num_dims, size_t stride, const size_t offsets[],
+                      const int adjacent[], ahc_merge_t merges[]);
+
+/*
+ * Computes the n(n - 1) / 2 distances d(i, j), i < j, between the items
+ * under the metric of the context, row after row, as clustering does.
+ */
+int ahc_distances(ahc_context_t *ctx, const float *coords, size_t n,
+                  int num_dims, size_t stride, float distances[]);
+
+/*
+ * Flat clusters of the n items, cut from the hierarchy of their merges:
+ * labels[i] is set to the cluster of item i, numbered from 0 in the order
+ * of their first items. The clusters are those left by the first n - k
+ * merges, or the largest subtrees with no merge above the distance t,
+ * or above the inconsistency coefficient t computed as by SciPy over
+ * depth levels of merges. Returns the number of clusters, or 0 on
+ * failure.
+ */
+int ahc_cut_count(const ahc_merge_t merges[], size_t n, int k,
+                  int labels[]);
+int ahc_cut_distance(const ahc_merge_t merges[], size_t n, float t,
+                     int labels[]);
+int ahc_cut_inconsistent(const ahc_merge_t merges[], size_t n, float t,
+                         int depth, int labels[]);
+
+/*
+ * Pearson correlation between the cophenetic distances of two
+ * hierarchies of the same n items, that is the distances of the merges
+ * that first join each pair of items, computed in O(n^2) time and O(n)
+ * memory. Returns NaN if it is not defined, or on failure.
+ */
+double ahc_cophenetic_correlation(const ahc_merge_t a[],
+                                  const ahc_merge_t b[], size_t n);
+
+/*
+ * Summarises items added one at a time into at most max_entries
+ * micro-clusters, kept in a BIRCH clustering feature tree. Each holds
+ * the number, coordinate sums and squared norms of its items, under
+ * euclidean distances. When there are too many, the tree is rebuilt
+ * with a larger micro-cluster radius. Returns NULL, or 0, on failure,
+ * after which the summary may only be freed.
+ */
+ahc_summary_t *ahc_create_summary(int num_dims, size_t max_entries);
+void ahc_free_summary(ahc_summary_t *summary);
+int ahc_summary_add(ahc_summary_t *summary, const float *coords);
+
+/* number of micro-clusters */
+size_t ahc_summary_size(const ahc_summary_t *summary);
+
+/*
+ * Stores the centroid of every micro-cluster, stride floats apart, and
+ * the number of items it holds, for ahc_cluster_weighted().
+ */
+void ahc_summary_centroids(ahc_summary_t *summary, float *centroids,
+                           size_t stride, int weights[]);
+
+/* micro-cluster whose centroid is nearest to the item */
+size_t ahc_summary_nearest(ahc_summary_t *summary, const float *coords);
+
+#endif
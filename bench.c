@@ -0,0 +1,394 @@
+/**
+ * Copyright 2014 Gagarine Yaikhom (MIT License)
+ *
+ * Benchmarks the clustering library on synthetic items. Every case is run
+ * in a child process, so that its peak resident set size is its own.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahc.h"
+
+#define DEFAULT_SIZES "1000 2000 5000 10000"
+#define DEFAULT_LINKAGES "scaptmw"
+#define DEFAULT_MAX_MATRIX 4096 /* MiB of distance matrix, at most */
+#define NUM_BLOBS 16 /* centres of the blobs data set */
+#define CUT_CLUSTERS 10 /* flat clusters cut from each hierarchy */
+
+#define alloc_mem(N, T) (T *) calloc(N, sizeof(T))
+#define alloc_fail(M) fprintf(stderr,                                   \
+                              "Failed to allocate memory for %s.\n", M)
+
+typedef struct generator_s generator_t;
+typedef struct timings_s timings_t;
+
+struct generator_s {
+        const char *name; /* name used to choose the data set */
+        int num_dims; /* number of coordinates of each item */
+        /* fills n items of num_dims coordinates, stride floats apart */
+        void (*generate)(float *coords, int n, int num_dims, int stride,
+                         uint64_t *state);
+};
+
+/* seconds taken by each phase of a case, or -1 if it was skipped */
+struct timings_s {
+        double distances; /* computing the distance matrix alone */
+        double cluster; /* clustering the items from their coordinates */
+        double cut; /* cutting the hierarchy into flat clusters */
+};
+
+/* xorshift64*: fast, and the same sequence on every platform */
+uint64_t next_random(uint64_t *state)
+{
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, 1) */
+double uniform(uint64_t *state)
+{
+        return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* standard normal, by the Box-Muller transform */
+double gaussian(uint64_t *state)
+{
+        double u = 1.0 - uniform(state), v = uniform(state);
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+void generate_uniform(float *coords, int n, int num_dims, int stride,
+                      uint64_t *state)
+{
+        for (int i = 0; i < n; ++i)
+                for (int k = 0; k < num_dims; ++k)
+                        coords[(size_t) i * stride + k] =
+                                1000.0 * uniform(state);
+}
+
+/* gaussian blobs of unit deviation around uniformly placed centres */
+void generate_blobs(float *coords, int n, int num_dims, int stride,
+                    uint64_t *state)
+{
+        float centres[NUM_BLOBS][num_dims];
+        for (int c = 0; c < NUM_BLOBS; ++c)
+                for (int k = 0; k < num_dims; ++k)
+                        centres[c][k] = 100.0 * uniform(state);
+        for (int i = 0; i < n; ++i) {
+                int c = next_random(state) % NUM_BLOBS;
+                for (int k = 0; k < num_dims; ++k)
+                        coords[(size_t) i * stride + k] =
+                                centres[c][k] + gaussian(state);
+        }
+}
+
+/* a random walk: elongated chains that single linkage follows */
+void generate_chain(float *coords, int n, int num_dims, int stride,
+                    uint64_t *state)
+{
+        for (int i = 0; i < n; ++i)
+                for (int k = 0; k < num_dims; ++k)
+                        coords[(size_t) i * stride + k] = (i ?
+                                coords[(size_t) (i - 1) * stride + k] : 0.0) +
+                                gaussian(state);
+}
+
+/* items drawn from a sixteenth as many distinct points */
+void generate_duplicates(float *coords, int n, int num_dims, int stride,
+                         uint64_t *state)
+{
+        int distinct = n / 16 + 1;
+        generate_uniform(coords, distinct < n ? distinct : n, num_dims,
+                         stride, state);
+        for (int i = distinct; i < n; ++i)
+                memcpy(&coords[(size_t) i * stride],
+                       &coords[(size_t) (next_random(state) % distinct) *
+                               stride], num_dims * sizeof(float));
+}
+
+static const generator_t generators[] = {
+        { "uniform", 2, generate_uniform },
+        { "blobs", 8, generate_blobs },
+        { "chain", 2, generate_chain },
+        { "highdim", 128, generate_uniform },
+        { "duplicates", 2, generate_duplicates },
+};
+
+#define NUM_GENERATORS (sizeof(generators) / sizeof(generators[0]))
+
+double now(void)
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+const generator_t *find_generator(const char *name)
+{
+        for (size_t i = 0; i < NUM_GENERATORS; ++i)
+                if (!strcmp(generators[i].name, name))
+                        return &generators[i];
+        return NULL;
+}
+
+/* runs the phases of one case, keeping the fastest of the runs */
+int time_case(ahc_context_t *ctx, const float *coords, int n, int num_dims,
+              int stride, size_t max_matrix, int runs, timings_t *timings)
+{
+        size_t count = (size_t) n * (n - 1) / 2;
+        int status = 0, *labels = alloc_mem(n, int);
+        ahc_merge_t *merges = alloc_mem(n, ahc_merge_t);
+        float *distances = NULL;
+        if (!labels || !merges) {
+                alloc_fail("merges");
+                goto cleanup;
+        }
+        timings->distances = count * sizeof(float) <= max_matrix ?
+                HUGE_VAL : -1.0;
+        timings->cluster = timings->cut = HUGE_VAL;
+        for (int r = 0; r < runs; ++r) {
+                double start;
+                if (timings->distances > 0.0) {
+                        if (!(distances = alloc_mem(count, float))) {
+                                alloc_fail("distance matrix");
+                                goto cleanup;
+                        }
+                        start = now();
+                        if (!ahc_distances(ctx, coords, n, num_dims, stride,
+                                           distances))
+                                goto cleanup;
+                        timings->distances = fmin(timings->distances,
+                                                  now() - start);
+                        /* leave the memory to the clustering */
+                        free(distances);
+                        distances = NULL;
+                }
+                start = now();
+                if (!ahc_cluster(ctx, coords, n, num_dims, stride, merges))
+                        goto cleanup;
+                timings->cluster = fmin(timings->cluster, now() - start);
+                start = now();
+                if (!ahc_cut_count(merges, n, CUT_CLUSTERS, labels))
+                        goto cleanup;
+                timings->cut = fmin(timings->cut, now() - start);
+        }
+        status = 1;
+
+cleanup:
+        free(distances);
+        free(merges);
+        free(labels);
+        return status;
+}
+
+void print_seconds(double seconds)
+{
+        if (seconds < 0.0)
+                fprintf(stdout, " %11s", "-");
+        else
+                fprintf(stdout, " %11.6f", seconds);
+}
+
+/* generates the items of a case, times it and prints its results */
+int run_case(ahc_context_t *ctx, const generator_t *generator, int n,
+             char linkage, uint64_t seed, size_t max_matrix, int runs,
+             int spatial)
+{
+        int num_dims = generator->num_dims;
+        int stride = (num_dims + AHC_VECTOR_WIDTH - 1) / AHC_VECTOR_WIDTH *
+                AHC_VECTOR_WIDTH;
+        size_t count = (size_t) n * (n - 1) / 2;
+        uint64_t state = seed ? seed : 1;
+        struct rusage usage;
+        timings_t timings;
+        float *coords;
+        /* these are clustered without a distance matrix */
+        int matrix_free = linkage == AHC_SINGLE_LINKAGE ||
+                (spatial && num_dims <= AHC_SPATIAL_MAX_DIMS &&
+                 (linkage == AHC_CENTROID_LINKAGE ||
+                  linkage == AHC_MEDIAN_LINKAGE));
+        if (!matrix_free && count * sizeof(float) > max_matrix) {
+                fprintf(stderr, "Skipping %s %c %d: the distance matrix "
+                        "is too large.\n", generator->name, linkage, n);
+                return 1;
+        }
+        if (!(coords = alloc_mem((size_t) n * stride, float))) {
+                alloc_fail("items");
+                return 0;
+        }
+        generator->generate(coords, n, num_dims, stride, &state);
+        if (!ahc_set_linkage(ctx, linkage) ||
+            !time_case(ctx, coords, n, num_dims, stride, max_matrix, runs,
+                       &timings)) {
+                free(coords);
+                return 0;
+        }
+        free(coords);
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stdout, "%-10s %c %8d %4d", generator->name, linkage, n,
+                num_dims);
+        print_seconds(timings.distances);
+        print_seconds(timings.cluster);
+        print_seconds(timings.cut);
+        fprintf(stdout, " %12.0f", n / timings.cluster);
+        if (timings.distances > 0.0)
+                fprintf(stdout, " %12.4g", count / timings.distances);
+        else
+                fprintf(stdout, " %12s", "-");
+        fprintf(stdout, " %10ld\n", usage.ru_maxrss);
+        return 1;
+}
+
+/* runs each case in a child, so that peak memory is measured apart */
+int fork_case(int num_threads, int spatial, const generator_t *generator,
+              int n, char linkage, uint64_t seed, size_t max_matrix,
+              int runs)
+{
+        int status;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                return 0;
+        }
+        if (!pid) {
+                ahc_context_t *ctx = ahc_create_context();
+                if (ctx)
+                        ahc_set_spatial_index(ctx, spatial);
+                status = ctx && ahc_set_threads(ctx, num_threads) &&
+                        run_case(ctx, generator, n, linkage, seed,
+                                 max_matrix, runs, spatial);
+                if (ctx)
+                        ahc_free_context(ctx);
+                fflush(stdout);
+                _exit(!status);
+        }
+        if (waitpid(pid, &status, 0) < 0) {
+                perror("waitpid");
+                return 0;
+        }
+        return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [options] [sizes...]\n"
+                "Options:\n"
+                "\t-d D\tcomma separated data sets (default all): uniform, "
+                "blobs,\n\t\tchain, highdim, duplicates\n"
+                "\t-j N\tcluster with N threads\n"
+                "\t-k\tcluster few coordinates with a k-d tree, where "
+                "it applies\n"
+                "\t-l L\tlinkages to time (default %s)\n"
+                "\t-m M\tskip cases whose distance matrix exceeds M MiB "
+                "(default %d)\n"
+                "\t-r R\tkeep the fastest of R runs of each case\n"
+                "\t-s S\tseed of the data sets (default 1)\n"
+                "Sizes default to %s.\n",
+                prog, DEFAULT_LINKAGES, DEFAULT_MAX_MATRIX, DEFAULT_SIZES);
+        exit(1);
+}
+
+/* parses the comma or space separated data set names */
+int parse_datasets(char *names, const generator_t *chosen[])
+{
+        int count = 0;
+        for (char *d = strtok(names, ", "); d; d = strtok(NULL, ", ")) {
+                if (!(chosen[count] = find_generator(d)))
+                        return 0;
+                if (++count == NUM_GENERATORS)
+                        break;
+        }
+        return count;
+}
+
+int main(int argc, char **argv)
+{
+        int opt, num_threads = 1, spatial = 0, runs = 1, failed = 0;
+        int num_datasets = NUM_GENERATORS, num_sizes = 0, *sizes;
+        const char *linkages = DEFAULT_LINKAGES;
+        const generator_t *datasets[NUM_GENERATORS];
+        char default_sizes[] = DEFAULT_SIZES;
+        size_t max_matrix = (size_t) DEFAULT_MAX_MATRIX << 20;
+        uint64_t seed = 1;
+        for (size_t i = 0; i < NUM_GENERATORS; ++i)
+                datasets[i] = &generators[i];
+        while ((opt = getopt(argc, argv, "d:j:kl:m:r:s:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        if (!(num_datasets = parse_datasets(optarg,
+                                                            datasets)))
+                                usage(argv[0]);
+                        break;
+                case 'j':
+                        num_threads = atoi(optarg);
+                        break;
+                case 'k':
+                        spatial = 1;
+                        break;
+                case 'l':
+                        linkages = optarg;
+                        break;
+                case 'm':
+                        max_matrix = (size_t) atol(optarg) << 20;
+                        break;
+                case 'r':
+                        if ((runs = atoi(optarg)) < 1)
+                                usage(argv[0]);
+                        break;
+                case 's':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        for (const char *l = linkages; *l; ++l) {
+                ahc_context_t *ctx = ahc_create_context();
+                int known = ctx && ahc_set_linkage(ctx, *l);
+                if (ctx)
+                        ahc_free_context(ctx);
+                if (!known)
+                        usage(argv[0]);
+        }
+        if (!(sizes = alloc_mem(argc + sizeof(default_sizes), int))) {
+                alloc_fail("sizes");
+                return 1;
+        }
+        for (int a = optind; a < argc; ++a)
+                sizes[num_sizes++] = atoi(argv[a]);
+        if (!num_sizes)
+                for (char *n = strtok(default_sizes, " "); n;
+                     n = strtok(NULL, " "))
+                        sizes[num_sizes++] = atoi(n);
+        for (int i = 0; i < num_sizes; ++i)
+                if (sizes[i] < 2) {
+                        free(sizes);
+                        usage(argv[0]);
+                }
+
+        fprintf(stdout, "# threads %d, runs %d, seed %llu%s\n", num_threads,
+                runs, (unsigned long long) seed, spatial ? ", k-d tree" : "");
+        fprintf(stdout, "%-10s %c %8s %4s %11s %11s %11s %12s %12s %10s\n",
+                "#dataset", 'L', "items", "dims", "distances_s",
+                "cluster_s", "cut_s", "items/s", "dists/s", "rss_kb");
+        for (int d = 0; d < num_datasets; ++d)
+                for (int i = 0; i < num_sizes; ++i)
+                        for (const char *l = linkages; *l; ++l)
+                                failed |= !fork_case(num_threads, spatial,
+                                                     datasets[d], sizes[i],
+                                                     *l, seed, max_matrix,
+                                                     runs);
+        free(sizes);
+        return failed;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Regression checks of the clustering program, run by make check.
+# usage: check.sh [program]
+prog=${1:-./agglomerate}
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+failed=0
+
+# expect <name> <last line of the output> <arguments...>
+expect() {
+        name=$1
+        want=$2
+        shift 2
+        got=$(timeout 10 "$prog" "$@" 2>&1 | tail -n 1)
+        if [ "$got" = "$want" ]; then
+                echo "ok     $name"
+        else
+                echo "FAILED $name: got '$got', expected '$want'"
+                failed=1
+        fi
+}
+
+# coordinates 1e20 apart overflow a float once squared
+printf '4\nA| 0 0\nB| 1e20 4\nC| 1 1\nD| 2 2\n' > "$input"
+for linkage in s c a p; do
+        expect "large coordinates, linkage $linkage" "1,5,1.00000002e+20,4" \
+                -o csv "$input" 2 "$linkage"
+done
+expect "large coordinates, manhattan metric" "1,5,1.00000002e+20,4" \
+        -m manhattan -o csv "$input" 2 a
+too_far="The items are too far apart for squared distances in single \
+precision."
+for linkage in w t m; do
+        expect "large coordinates, linkage $linkage" "$too_far" \
+                -o csv "$input" 2 "$linkage"
+done
+
+# distances near the largest float saturate in the linkage updates
+printf '4\nA| 0 0\nB| 3e38 4\nC| -3e38 1\nD| 2 2\n' > "$input"
+expect "largest coordinates, linkage c" "2,5,3.40282347e+38,4" \
+        -o csv "$input" 2 c
+expect "largest coordinates, linkage a" "2,5,3.13427442e+38,4" \
+        -o csv "$input" 2 a
+
+# coordinates that are not numbers, or infinite, are rejected
+printf '3\nA| 0 0\nB| nan 4\nC| 1 1\n' > "$input"
+expect "coordinates not a number" "Invalid coordinates of item 1." \
+        -o csv "$input" 2 a
+printf '3\nA| 0 0\nB| 1 1\nC| -inf 1\n' > "$input"
+expect "infinite coordinates" "Invalid coordinates of item 2." \
+        -o csv "$input" 2 c
+
+exit $failed
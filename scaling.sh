@@ -0,0 +1,30 @@
+#!/bin/sh
+# Times the clustering of random points with increasing numbers of threads.
+# usage: scaling.sh [items] [linkage] [threads...]
+items=${1:-10000}
+linkage=${2:-a}
+shift 2 2>/dev/null
+threads=${*:-1 2 4 8}
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+awk -v n="$items" 'BEGIN {
+        srand(1);
+        print n;
+        for (i = 0; i < n; ++i)
+                printf "P%d| %.4f %.4f\n", i, rand() * 1000, rand() * 1000;
+}' > "$input"
+
+echo "items: $items, linkage: $linkage"
+base=
+for j in $threads; do
+        start=$(date +%s.%N)
+        ./agglomerate -j "$j" "$input" 2 "$linkage" > /dev/null || exit 1
+        end=$(date +%s.%N)
+        time=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+        base=${base:-$time}
+        echo "$j $time $base" | awk '{
+                printf "threads %3d: %8.3f s, speedup %5.2f\n",
+                       $1, $2, $3 / $2;
+        }'
+done